@@ -7,6 +7,7 @@
 */
 
 #include <assert.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,6 +27,55 @@
 #define LUASQL_ENVIRONMENT_PG "PostgreSQL environment"
 #define LUASQL_CONNECTION_PG "PostgreSQL connection"
 #define LUASQL_CURSOR_PG "PostgreSQL cursor"
+#define LUASQL_STATEMENT_PG "PostgreSQL statement"
+#define LUASQL_PIPELINE_PG "PostgreSQL pipeline"
+
+#define LUASQL_TYPED "typed"
+#define LUASQL_NUMERICSTRING "numeric_string"
+#define LUASQL_BINARY "binary"
+
+/* type OIDs (see pg_type.h) sent in binary format or decoded */
+#define BOOLOID    16
+#define BYTEAOID   17
+#define INT8OID    20
+#define INT2OID    21
+#define INT4OID    23
+#define CHAROID    18
+#define NAMEOID    19
+#define TEXTOID    25
+#define OIDOID     26
+#define JSONOID    114
+#define FLOAT4OID  700
+#define FLOAT8OID  701
+#define UNKNOWNOID 705
+#define BPCHAROID  1042
+#define VARCHAROID 1043
+#define DATEOID    1082
+#define TIMESTAMPOID 1114
+#define TIMESTAMPTZOID 1184
+#define NUMERICOID 1700
+#define UUIDOID    2950
+
+/* results of the rows of a streaming cursor */
+#ifdef LIBPQ_HAS_CHUNK_MODE
+#define is_chunk(s) ((s) == PGRES_SINGLE_TUPLE || (s) == PGRES_TUPLES_CHUNK)
+#else
+#define is_chunk(s) ((s) == PGRES_SINGLE_TUPLE)
+#endif
+
+/* seconds and days from 1970-01-01 to 2000-01-01, the binary epoch */
+#define PG_EPOCH_SECS 946684800.0
+#define PG_EPOCH_DAYS 10957.0
+
+/* how the values of a column are pushed by a typed cursor */
+#define KIND_STRING  0
+#define KIND_NUMBER  1
+#define KIND_NUMERIC 2
+#define KIND_BOOLEAN 3
+#define KIND_BYTEA   4
+
+/* bytes reserved for the text or binary form of a parameter */
+#define PARAM_BUFFER 32
 
 typedef struct {
 	short      closed;
@@ -37,10 +87,18 @@ typedef struct {
 	int        env;                /* reference to environment */
 	int        auto_commit;        /* 0 for manual commit */
 	PGconn    *pg_conn;
+	struct stmt_data *statements;  /* list of prepared statements */
+	int        stmt_counter;       /* to name unnamed statements */
+	int        typed;              /* default of the cursors */
+	int        numeric_string;     /* default of the cursors */
+	int        binary;             /* 1 for binary results of statements */
+	struct cur_data *stream;       /* streaming cursor, or NULL */
+	int        pipeline;           /* 1 while in pipeline mode */
+	int        copy;               /* 1 while a COPY calls Lua */
 } conn_data;
 
 
-typedef struct {
+typedef struct cur_data {
 	short      closed;
 	int        conn;               /* reference to connection */
 	int        numcols;            /* number of columns */
@@ -48,9 +106,26 @@ typedef struct {
 	int        curr_tuple;         /* next tuple to be read */
 	PGresult  *pg_res;
 	char	  *modestring;
+	int        typed;              /* 1 to push values by column type */
+	int        numeric_string;     /* 1 to keep numeric values as strings */
+	char      *kinds;              /* KIND_* of each column */
+	conn_data *stream;             /* connection streaming the rows, or NULL */
+	int        cancel;             /* 1 if closing may cancel the query */
 } cur_data;
 
 
+typedef struct stmt_data {
+	short      closed;
+	int        conn;               /* reference to connection */
+	conn_data *conn_data;
+	char      *name;               /* name of the prepared statement */
+	int        nparams;            /* number of parameters */
+	Oid       *paramtypes;         /* types of the parameters */
+	int        binary;             /* 1 if all result columns decode */
+	struct stmt_data *next;        /* next statement of the connection */
+} stmt_data;
+
+
 typedef void (*creator) (lua_State *L, cur_data *cur);
 
 
@@ -79,6 +154,33 @@ static conn_data *getconnection (lua_State *L) {
 }
 
 
+/*
+** Return NULL if the connection can run a statement and wait for its
+** result, otherwise the reason why it cannot.
+*/
+static const char *conn_busy (conn_data *conn) {
+	if (conn->stream != NULL)
+		return LUASQL_PREFIX"connection is busy with a streaming cursor";
+	if (conn->pipeline)
+		return LUASQL_PREFIX"connection is busy with a pipeline";
+	if (conn->copy)
+		return LUASQL_PREFIX"connection is busy with a COPY";
+	return NULL;
+}
+
+
+/*
+** Check for valid connection not busy with a streaming cursor or a
+** pipeline.
+*/
+static conn_data *getidleconnection (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	const char *busy = conn_busy (conn);
+	luaL_argcheck (L, busy == NULL, 1, busy);
+	return conn;
+}
+
+
 /*
 ** Check for valid cursor.
 */
@@ -90,14 +192,244 @@ static cur_data *getcursor (lua_State *L) {
 }
 
 
+/*
+** Check for valid statement.
+*/
+static stmt_data *getstatement (lua_State *L) {
+	stmt_data *stmt = (stmt_data *)luaL_checkudata (L, 1, LUASQL_STATEMENT_PG);
+	luaL_argcheck (L, stmt != NULL, 1, LUASQL_PREFIX"statement expected");
+	luaL_argcheck (L, !stmt->closed, 1, LUASQL_PREFIX"statement is closed");
+	return stmt;
+}
+
+
+/*
+** Return true if values of type 'type' can be decoded from the binary
+** format.
+*/
+static int binary_type (Oid type) {
+	switch (type) {
+		case BOOLOID: case BYTEAOID: case CHAROID: case NAMEOID:
+		case INT8OID: case INT2OID: case INT4OID: case TEXTOID:
+		case OIDOID: case JSONOID: case FLOAT4OID: case FLOAT8OID:
+		case UNKNOWNOID: case BPCHAROID: case VARCHAROID: case DATEOID:
+		case TIMESTAMPOID: case TIMESTAMPTZOID: case UUIDOID:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+
+/*
+** Reads a big-endian signed integer of 'size' (2, 4 or 8) bytes.
+*/
+static lua_Number get_int (const char *value, int size) {
+	const unsigned char *p = (const unsigned char *)value;
+	unsigned long hi = 0, lo = 0;
+	int i;
+
+	for (i = 0; i < size && i < 4; i++)
+		hi = (hi << 8) | p[i];
+	if (size == 8)
+		for (i = 4; i < 8; i++)
+			lo = (lo << 8) | p[i];
+	else {
+		lo = hi;
+		hi = (p[0] & 0x80) ? 0xffffffffUL : 0;
+		if (size == 2)
+			lo |= (p[0] & 0x80) ? 0xffff0000UL : 0;
+	}
+	if (hi & 0x80000000UL)
+		return -(((lua_Number)(0xffffffffUL - hi)) * 4294967296.0
+			+ (lua_Number)(0xffffffffUL - lo) + 1);
+	return (lua_Number)hi * 4294967296.0 + (lua_Number)lo;
+}
+
+
+/*
+** Reads a big-endian IEEE float of 'size' (4 or 8) bytes.
+*/
+static lua_Number get_float (const char *value, int size) {
+	unsigned short one = 1;
+	int little = *(unsigned char *)&one;
+	unsigned char b[8];
+	int i;
+
+	for (i = 0; i < size; i++)
+		b[little ? size - 1 - i : i] = (unsigned char)value[i];
+	if (size == 4) {
+		float f;
+		memcpy (&f, b, 4);
+		return (lua_Number)f;
+	} else {
+		double d;
+		memcpy (&d, b, 8);
+		return (lua_Number)d;
+	}
+}
+
+
+/*
+** Pushes a value received in binary format: numbers, booleans, uuids
+** as strings, timestamps as microseconds and dates as days since
+** 1970-01-01 (infinite ones as +-math.huge), and the bytes of other
+** values.
+*/
+static void push_binary (lua_State *L, Oid type, const char *value, int len) {
+	const unsigned char *p = (const unsigned char *)value;
+	char uuid[37];
+	int i, n;
+
+	switch (type) {
+		case INT2OID:
+			lua_pushnumber (L, get_int (value, 2));
+			break;
+		case INT4OID:
+			lua_pushnumber (L, get_int (value, 4));
+			break;
+		case INT8OID:
+			lua_pushnumber (L, get_int (value, 8));
+			break;
+		case OIDOID:
+			lua_pushnumber (L, (lua_Number)(((unsigned long)p[0] << 24)
+				| ((unsigned long)p[1] << 16) | ((unsigned long)p[2] << 8) | p[3]));
+			break;
+		case FLOAT4OID:
+			lua_pushnumber (L, get_float (value, 4));
+			break;
+		case FLOAT8OID:
+			lua_pushnumber (L, get_float (value, 8));
+			break;
+		case BOOLOID:
+			lua_pushboolean (L, p[0] != 0);
+			break;
+		case UUIDOID:
+			for (i = 0, n = 0; i < 16; i++) {
+				if (i == 4 || i == 6 || i == 8 || i == 10)
+					uuid[n++] = '-';
+				sprintf (uuid + n, "%02x", p[i]);
+				n += 2;
+			}
+			lua_pushlstring (L, uuid, n);
+			break;
+		case TIMESTAMPOID:
+		case TIMESTAMPTZOID:
+			if (p[0] == 0x7f && memcmp (value + 1, "\xff\xff\xff\xff\xff\xff\xff", 7) == 0)
+				lua_pushnumber (L, HUGE_VAL);
+			else if (p[0] == 0x80 && memcmp (value + 1, "\0\0\0\0\0\0\0", 7) == 0)
+				lua_pushnumber (L, -HUGE_VAL);
+			else
+				lua_pushnumber (L, get_int (value, 8) + PG_EPOCH_SECS * 1e6);
+			break;
+		case DATEOID:
+			if (p[0] == 0x7f && memcmp (value + 1, "\xff\xff\xff", 3) == 0)
+				lua_pushnumber (L, HUGE_VAL);
+			else if (p[0] == 0x80 && memcmp (value + 1, "\0\0\0", 3) == 0)
+				lua_pushnumber (L, -HUGE_VAL);
+			else
+				lua_pushnumber (L, get_int (value, 4) + PG_EPOCH_DAYS);
+			break;
+		default:
+			/* bytea and the text types send their bytes */
+			lua_pushlstring (L, value, len);
+	}
+}
+
+
 /*
 ** Push the value of #i field of #tuple row.
+** Typed cursors push numbers, booleans and the bytes of bytea values.
 */
-static void pushvalue (lua_State *L, PGresult *res, int tuple, int i) {
-	if (PQgetisnull (res, tuple, i-1))
+static void pushvalue (lua_State *L, cur_data *cur, int tuple, int i) {
+	PGresult *res = cur->pg_res;
+	const char *value;
+	int kind;
+
+	if (PQgetisnull (res, tuple, i-1)) {
 		lua_pushnil (L);
-	else
-		lua_pushstring (L, PQgetvalue (res, tuple, i-1));
+		return;
+	}
+	value = PQgetvalue (res, tuple, i-1);
+	if (PQfformat (res, i-1) == 1) {
+		push_binary (L, PQftype (res, i-1), value, PQgetlength (res, tuple, i-1));
+		return;
+	}
+	kind = cur->typed ? cur->kinds[i-1] : KIND_STRING;
+	if (kind == KIND_NUMERIC && cur->numeric_string)
+		kind = KIND_STRING;
+	switch (kind) {
+		case KIND_NUMBER:
+		case KIND_NUMERIC:
+			lua_pushnumber (L, (lua_Number)strtod (value, NULL));
+			break;
+		case KIND_BOOLEAN:
+			lua_pushboolean (L, value[0] == 't');
+			break;
+		case KIND_BYTEA: {
+			size_t len;
+			unsigned char *bytes = PQunescapeBytea ((const unsigned char *)value, &len);
+			if (bytes == NULL)
+				luaL_error (L, LUASQL_PREFIX"out of memory");
+			lua_pushlstring (L, (const char *)bytes, len);
+			PQfreemem (bytes);
+			break;
+		}
+		default:
+			lua_pushlstring (L, value, PQgetlength (res, tuple, i-1));
+	}
+}
+
+
+/*
+** Asks the server to cancel the query running on the connection.
+*/
+static void cancel_query (conn_data *conn) {
+	PGcancel *cancel = PQgetCancel (conn->pg_conn);
+	if (cancel != NULL) {
+		char errbuf[256];
+		PQcancel (cancel, errbuf, sizeof (errbuf));
+		PQfreeCancel (cancel);
+	}
+}
+
+
+/*
+** Discards the results left by the query of a streaming cursor and
+** frees its connection.
+*/
+static void stream_end (cur_data *cur) {
+	PGresult *res;
+	while ((res = PQgetResult (cur->stream->pg_conn)) != NULL)
+		PQclear (res);
+	cur->stream->stream = NULL;
+	cur->stream = NULL;
+}
+
+
+/*
+** Replaces the exhausted result of a streaming cursor by the next rows.
+** Return 1 if there are more rows, 0 at the end of the query or -1 on
+** error, in which case the error message is pushed.
+*/
+static int stream_next (lua_State *L, cur_data *cur) {
+	PGresult *res = PQgetResult (cur->stream->pg_conn);
+	int more = 0;
+
+	if (res != NULL && is_chunk (PQresultStatus (res))) {
+		PQclear (cur->pg_res);
+		cur->pg_res = res;
+		cur->curr_tuple = 0;
+		return 1;
+	}
+	if (res == NULL || PQresultStatus (res) != PGRES_TUPLES_OK) {
+		lua_pushstring (L, res != NULL ? PQresultErrorMessage (res)
+			: PQerrorMessage (cur->stream->pg_conn));
+		more = -1;
+	}
+	PQclear (res);
+	stream_end (cur);
+	return more;
 }
 
 
@@ -105,6 +437,13 @@ static void pushvalue (lua_State *L, PGresult *res, int tuple, int i) {
 ** Closes the cursor and nullify all structure fields.
 */
 static void cur_nullify (lua_State *L, cur_data *cur) {
+	if (cur->stream != NULL) {
+		/* cancel the rest of the query, unless that would abort the
+		   transaction it runs in: its rows are then read and dropped */
+		if (cur->cancel)
+			cancel_query (cur->stream);
+		stream_end (cur);
+	}
 	/* Nullify structure fields. */
 	cur->closed = 1;
 	PQclear(cur->pg_res);
@@ -123,9 +462,18 @@ static int cur_fetch (lua_State *L) {
 	int tuple = cur->curr_tuple;
 
 	if (tuple >= PQntuples(cur->pg_res)) {
-		cur_nullify (L, cur);
-		lua_pushnil(L);  /* no more results */
-		return 1;
+		int more = cur->stream != NULL ? stream_next (L, cur) : 0;
+		if (more <= 0) {
+			cur_nullify (L, cur);
+			lua_pushnil(L);  /* no more results */
+			if (more < 0) {
+				lua_insert (L, -2);
+				return 2;
+			}
+			return 1;
+		}
+		res = cur->pg_res;
+		tuple = 0;
 	}
 
 	cur->curr_tuple++;
@@ -135,14 +483,14 @@ static int cur_fetch (lua_State *L) {
 		if (strchr (opts, 'n') != NULL)
 			/* Copy values to numerical indices */
 			for (i = 1; i <= cur->numcols; i++) {
-				pushvalue (L, res, tuple, i);
+				pushvalue (L, cur, tuple, i);
 				lua_rawseti (L, 2, i);
 			}
 		if (strchr (opts, 'a') != NULL)
 			/* Copy values to alphanumerical indices */
 			for (i = 1; i <= cur->numcols; i++) {
 				lua_pushstring (L, PQfname (res, i-1));
-				pushvalue (L, res, tuple, i);
+				pushvalue (L, cur, tuple, i);
 				lua_rawset (L, 2);
 			}
 		lua_pushvalue(L, 2);
@@ -152,7 +500,7 @@ static int cur_fetch (lua_State *L) {
 		int i;
 		luaL_checkstack (L, cur->numcols, LUASQL_PREFIX"too many columns");
 		for (i = 1; i <= cur->numcols; i++)
-			pushvalue (L, res, tuple, i);
+			pushvalue (L, cur, tuple, i);
 		return cur->numcols; /* return #numcols values */
 	}
 }
@@ -242,6 +590,8 @@ static void create_coltypes (lua_State *L, cur_data *cur) {
 	if (!lua_isuserdata (L, -1))
 		luaL_error (L, LUASQL_PREFIX"invalid connection");
 	conn = (conn_data *)lua_touserdata (L, -1);
+	if (conn_busy (conn) != NULL)
+		luaL_error (L, conn_busy (conn));
 	lua_newtable (L);
 	for (i = 1; i <= cur->numcols; i++) {
 		lua_pushstring(L, getcolumntype (conn->pg_conn, result, i-1, typename));
@@ -291,7 +641,10 @@ static int cur_getcoltypes (lua_State *L) {
 ** Push the number of rows.
 */
 static int cur_numrows (lua_State *L) {
-	lua_pushnumber (L, PQntuples (getcursor(L)->pg_res));
+	cur_data *cur = getcursor(L);
+	if (cur->stream != NULL)
+		return luasql_faildirect (L, LUASQL_PREFIX"streaming cursors do not know their number of rows");
+	lua_pushnumber (L, PQntuples (cur->pg_res));
 	return 1;
 }
 
@@ -312,6 +665,12 @@ static void cur_set(lua_State *L) {
 				if( strcmp(key, LUASQL_MODESTRING) == 0 ) {
 					if( lua_isstring( L, -1 ) )
 						cur->modestring = lua_tostring( L, -1 );
+				} else if( strcmp(key, LUASQL_TYPED) == 0 ) {
+					if( lua_isboolean( L, -1 ) )
+						cur->typed = lua_toboolean( L, -1 );
+				} else if( strcmp(key, LUASQL_NUMERICSTRING) == 0 ) {
+					if( lua_isboolean( L, -1 ) )
+						cur->numeric_string = lua_toboolean( L, -1 );
 				}
 			}
 
@@ -340,6 +699,14 @@ static int cur_get( lua_State *L ) {
 					lua_pushstring( L, LUASQL_MODESTRING );
 					lua_pushstring( L, cur->modestring );
 					lua_settable( L, rsp );
+				} else if( strcmp(key, LUASQL_TYPED) == 0 ) {
+					lua_pushstring( L, LUASQL_TYPED );
+					lua_pushboolean( L, cur->typed );
+					lua_settable( L, rsp );
+				} else if( strcmp(key, LUASQL_NUMERICSTRING) == 0 ) {
+					lua_pushstring( L, LUASQL_NUMERICSTRING );
+					lua_pushboolean( L, cur->numeric_string );
+					lua_settable( L, rsp );
 				}
 			}
 
@@ -352,6 +719,12 @@ static int cur_get( lua_State *L ) {
 			if( strcmp(key, LUASQL_MODESTRING) == 0 ) {
 				cur_data *cur = getcursor(L);
 				lua_pushstring( L, cur->modestring );
+			} else if( strcmp(key, LUASQL_TYPED) == 0 ) {
+				cur_data *cur = getcursor(L);
+				lua_pushboolean( L, cur->typed );
+			} else if( strcmp(key, LUASQL_NUMERICSTRING) == 0 ) {
+				cur_data *cur = getcursor(L);
+				lua_pushboolean( L, cur->numeric_string );
 			} else
 				lua_pushnil(L);
 		} else
@@ -365,17 +738,44 @@ static int cur_get( lua_State *L ) {
 ** Create a new Cursor object and push it on top of the stack.
 */
 static int create_cursor (lua_State *L, int conn, PGresult *result) {
-	cur_data *cur = (cur_data *)lua_newuserdata(L, sizeof(cur_data));
+	conn_data *c = (conn_data *)lua_touserdata (L, conn);
+	int i, numcols = PQnfields(result);
+	/* the kinds of the columns follow the structure */
+	cur_data *cur = (cur_data *)lua_newuserdata(L, sizeof(cur_data) + numcols);
 	luasql_setmeta (L, LUASQL_CURSOR_PG);
 
 	/* fill in structure */
 	cur->closed = 0;
 	cur->conn = LUA_NOREF;
-	cur->numcols = PQnfields(result);
+	cur->numcols = numcols;
 	cur->colnames = LUA_NOREF;
 	cur->coltypes = LUA_NOREF;
 	cur->curr_tuple = 0;
 	cur->pg_res = result;
+	cur->modestring = "n";
+	cur->typed = c->typed;
+	cur->numeric_string = c->numeric_string;
+	cur->kinds = (char *)(cur + 1);
+	cur->stream = NULL;
+	cur->cancel = 0;
+	for (i = 0; i < numcols; i++)
+		switch (PQftype (result, i)) {
+			case INT2OID: case INT4OID: case INT8OID: case OIDOID:
+			case FLOAT4OID: case FLOAT8OID:
+				cur->kinds[i] = KIND_NUMBER;
+				break;
+			case NUMERICOID:
+				cur->kinds[i] = KIND_NUMERIC;
+				break;
+			case BOOLOID:
+				cur->kinds[i] = KIND_BOOLEAN;
+				break;
+			case BYTEAOID:
+				cur->kinds[i] = KIND_BYTEA;
+				break;
+			default:
+				cur->kinds[i] = KIND_STRING;
+		}
 	lua_pushvalue (L, conn);
 	cur->conn = luaL_ref (L, LUA_REGISTRYINDEX);
 
@@ -398,12 +798,51 @@ static void sql_rollback(conn_data *conn) {
 }
 
 
+/*
+** Closes a prepared statement, deallocating it on the server if
+** 'deallocate' is true, and removes it from its connection.
+*/
+static void stmt_nullify (lua_State *L, stmt_data *stmt, int deallocate) {
+	conn_data *conn = stmt->conn_data;
+	stmt_data **p;
+
+	/* a statement collected while busy stays until the session ends */
+	if (deallocate && conn_busy (conn) == NULL) {
+		char *name = PQescapeIdentifier (conn->pg_conn, stmt->name,
+			strlen (stmt->name));
+		if (name != NULL) {
+			char *sql = (char *)malloc (strlen (name) + sizeof ("DEALLOCATE "));
+			if (sql != NULL) {
+				sprintf (sql, "DEALLOCATE %s", name);
+				PQclear (PQexec (conn->pg_conn, sql));
+				free (sql);
+			}
+			PQfreemem (name);
+		}
+	}
+	for (p = &conn->statements; *p != NULL; p = &(*p)->next)
+		if (*p == stmt) {
+			*p = stmt->next;
+			break;
+		}
+	stmt->closed = 1;
+	free (stmt->name);
+	free (stmt->paramtypes);
+	luaL_unref (L, LUA_REGISTRYINDEX, stmt->conn);
+}
+
+
 /*
 ** Connection object collector function
 */
 static int conn_gc (lua_State *L) {
 	conn_data *conn = (conn_data *)luaL_checkudata (L, 1, LUASQL_CONNECTION_PG);
 	if (conn != NULL && !(conn->closed)) {
+		if (conn->stream != NULL)
+			conn->stream->stream = NULL;
+		/* the server drops the statements with the session */
+		while (conn->statements != NULL)
+			stmt_nullify (L, conn->statements, 0);
 		/* Nullify structure fields. */
 		conn->closed = 1;
 		luaL_unref (L, LUA_REGISTRYINDEX, conn->env);
@@ -426,6 +865,8 @@ static int conn_close (lua_State *L) {
 		lua_pushboolean (L, 0);
 		return 1;
 	}
+	/* a streaming cursor would read a truncated result as its end */
+	luaL_argcheck (L, conn_busy (conn) == NULL, 1, conn_busy (conn));
 	conn_gc (L);
 	lua_pushboolean (L, 1);
 	return 1;
@@ -452,14 +893,12 @@ static int conn_escape (lua_State *L) {
 
 
 /*
-** Execute an SQL statement.
-** Return a Cursor object if the statement is a query, otherwise
-** return the number of tuples affected by the statement.
+** Pushes the outcome of a statement: a Cursor object (of the connection
+** at stack position 'o') if it is a query, otherwise the number of
+** tuples affected by the statement.
+** Return nil and an error message on failure.
 */
-static int conn_execute (lua_State *L) {
-	conn_data *conn = getconnection (L);
-	const char *statement = luaL_checkstring (L, 2);
-	PGresult *res = PQexec(conn->pg_conn, statement);
+static int push_result (lua_State *L, conn_data *conn, int o, PGresult *res) {
 	if (res && PQresultStatus(res)==PGRES_COMMAND_OK) {
 		/* no tuples returned */
 		lua_pushnumber(L, atof(PQcmdTuples(res)));
@@ -468,7 +907,7 @@ static int conn_execute (lua_State *L) {
 	}
 	else if (res && PQresultStatus(res)==PGRES_TUPLES_OK)
 		/* tuples returned */
-		return create_cursor (L, 1, res);
+		return create_cursor (L, o, res);
 	else {
 		/* error */
 		PQclear (res);
@@ -477,11 +916,745 @@ static int conn_execute (lua_State *L) {
 }
 
 
+/*
+** Execute an SQL statement.
+** Return a Cursor object if the statement is a query, otherwise
+** return the number of tuples affected by the statement.
+*/
+static int conn_execute (lua_State *L) {
+	conn_data *conn = getidleconnection (L);
+	const char *statement = luaL_checkstring (L, 2);
+	return push_result (L, conn, 1, PQexec(conn->pg_conn, statement));
+}
+
+
+/*
+** Executes an SQL statement, streaming its rows: the cursor holds one
+** row, or one chunk of 'rows' rows with libpq 17, at a time.
+** Return a Cursor object if the statement is a query, otherwise
+** return the number of tuples affected by the statement.
+*/
+static int conn_stream (lua_State *L) {
+	conn_data *conn = getidleconnection (L);
+	const char *statement = luaL_checkstring (L, 2);
+	int rows = luaL_optint (L, 3, 1);
+	int idle = PQtransactionStatus (conn->pg_conn) == PQTRANS_IDLE;
+	PGresult *res, *rest;
+
+	if (!PQsendQuery (conn->pg_conn, statement))
+		return luasql_faildirect (L, PQerrorMessage (conn->pg_conn));
+#ifdef LIBPQ_HAS_CHUNK_MODE
+	if (rows > 1)
+		PQsetChunkedRowsMode (conn->pg_conn, rows);
+	else
+#endif
+		PQsetSingleRowMode (conn->pg_conn);
+	(void)rows;
+	res = PQgetResult (conn->pg_conn);
+	if (res != NULL && is_chunk (PQresultStatus (res))) {
+		cur_data *cur;
+		create_cursor (L, 1, res);
+		cur = (cur_data *)lua_touserdata (L, -1);
+		cur->stream = conn;
+		cur->cancel = idle;
+		conn->stream = cur;
+		return 1;
+	}
+	/* no rows: wait for the end of the query */
+	while ((rest = PQgetResult (conn->pg_conn)) != NULL)
+		PQclear (rest);
+	return push_result (L, conn, 1, res);
+}
+
+
+/*
+** Writes the text form of a number: integers in the range of int8
+** without exponent, other numbers with enough digits to be read back
+** exactly.
+*/
+static void format_number (char *buff, lua_Number n) {
+	if (n == floor (n) && n >= -9223372036854775808.0
+			&& n < 9223372036854775808.0)
+		sprintf (buff, "%.0f", (double)n);
+	else
+		sprintf (buff, "%.17g", (double)n);
+}
+
+
+typedef struct {
+	char      *data;
+	size_t     len, size;
+} copy_buffer;
+
+
+/*
+** Appends 'len' bytes to a buffer.
+** Return 0 if out of memory.
+*/
+static int copy_add (copy_buffer *b, const char *s, size_t len) {
+	if (b->len + len > b->size) {
+		size_t size = b->size > 0 ? b->size : 256;
+		char *data;
+		while (size < b->len + len)
+			size *= 2;
+		if ((data = (char *)realloc (b->data, size)) == NULL)
+			return 0;
+		b->data = data;
+		b->size = size;
+	}
+	memcpy (b->data + b->len, s, len);
+	b->len += len;
+	return 1;
+}
+
+
+/*
+** Appends the row of the table at 'idx' to a buffer, in COPY text
+** format. The number of values is the field 'n' or the length of the
+** table; nil values are NULL.
+** Return NULL, or an error message.
+*/
+static const char *copy_row (lua_State *L, int idx, copy_buffer *b) {
+	char num[32];
+	const char *s;
+	size_t len, i, j;
+	int col, n, ok = 1;
+
+	lua_getfield (L, idx, "n");
+	n = lua_isnumber (L, -1) ? (int)lua_tointeger (L, -1) : (int)lua_objlen (L, idx);
+	lua_pop (L, 1);
+	for (col = 1; ok && col <= n; col++) {
+		if (col > 1)
+			ok = copy_add (b, "\t", 1);
+		lua_rawgeti (L, idx, col);
+		switch (lua_type (L, -1)) {
+			case LUA_TNIL:
+				ok = ok && copy_add (b, "\\N", 2);
+				break;
+			case LUA_TBOOLEAN:
+				ok = ok && copy_add (b, lua_toboolean (L, -1) ? "t" : "f", 1);
+				break;
+			case LUA_TNUMBER:
+				format_number (num, lua_tonumber (L, -1));
+				ok = ok && copy_add (b, num, strlen (num));
+				break;
+			case LUA_TSTRING:
+				s = lua_tolstring (L, -1, &len);
+				/* escape the backslashes and the delimiters */
+				for (i = j = 0; ok && i < len; i++) {
+					const char *esc = s[i] == '\\' ? "\\\\" : s[i] == '\t' ? "\\t"
+						: s[i] == '\n' ? "\\n" : s[i] == '\r' ? "\\r" : NULL;
+					if (esc != NULL) {
+						ok = copy_add (b, s + j, i - j) && copy_add (b, esc, 2);
+						j = i + 1;
+					}
+				}
+				ok = ok && copy_add (b, s + j, len - j);
+				break;
+			default:
+				lua_pop (L, 1);
+				return LUASQL_PREFIX"rows may only have strings, numbers, booleans and nil";
+		}
+		lua_pop (L, 1);
+	}
+	if (!(ok && copy_add (b, "\n", 1)))
+		return LUASQL_PREFIX"out of memory";
+	return NULL;
+}
+
+
+/*
+** Waits for the end of a COPY statement.
+** Return the number of rows copied, or nil and an error message (the
+** given one, if any, or the one of the server).
+*/
+static int copy_end (lua_State *L, conn_data *conn, const char *errmsg) {
+	PGresult *res, *last = NULL;
+	while ((res = PQgetResult (conn->pg_conn)) != NULL) {
+		PQclear (last);
+		last = res;
+	}
+	if (errmsg == NULL && PQresultStatus (last) == PGRES_COMMAND_OK) {
+		lua_pushnumber (L, atof (PQcmdTuples (last)));
+		PQclear (last);
+		return 1;
+	}
+	lua_pushnil (L);
+	lua_pushstring (L, errmsg != NULL ? errmsg : last != NULL
+		? PQresultErrorMessage (last) : PQerrorMessage (conn->pg_conn));
+	PQclear (last);
+	return 2;
+}
+
+
+/*
+** Runs a COPY ... FROM STDIN statement, sending the data returned by
+** calls to the function 'source' until it returns nil: strings are
+** sent as they are and tables are rows encoded in COPY text format.
+** Return the number of rows copied, or nil and an error message.
+*/
+static int conn_copyin (lua_State *L) {
+	conn_data *conn = getidleconnection (L);
+	const char *sql = luaL_checkstring (L, 2);
+	copy_buffer b = {NULL, 0, 0};
+	const char *errmsg = NULL;
+	const char *data;
+	size_t len;
+	PGresult *res;
+	int ok;
+
+	luaL_checktype (L, 3, LUA_TFUNCTION);
+	lua_settop (L, 3);
+	res = PQexec (conn->pg_conn, sql);
+	if (PQresultStatus (res) != PGRES_COPY_IN) {
+		int status = PQresultStatus (res);
+		PQclear (res);
+		return luasql_faildirect (L, status == PGRES_COMMAND_OK || status == PGRES_TUPLES_OK
+			? LUASQL_PREFIX"not a COPY FROM STDIN statement" : PQerrorMessage (conn->pg_conn));
+	}
+	PQclear (res);
+	while (errmsg == NULL) {
+		lua_pushvalue (L, 3);
+		conn->copy = 1;
+		ok = lua_pcall (L, 0, 1, 0) == 0;
+		conn->copy = 0;
+		if (!ok) {
+			errmsg = lua_isstring (L, -1) ? lua_tostring (L, -1)
+				: LUASQL_PREFIX"error in the source function";
+			break;
+		}
+		if (lua_isnil (L, -1))
+			break;
+		if (lua_istable (L, -1)) {
+			b.len = 0;
+			errmsg = copy_row (L, 4, &b);
+			data = b.data;
+			len = b.len;
+		} else if (lua_type (L, -1) == LUA_TSTRING)
+			data = lua_tolstring (L, -1, &len);
+		else
+			errmsg = LUASQL_PREFIX"the source must return strings, tables or nil";
+		if (errmsg == NULL && PQputCopyData (conn->pg_conn, data, (int)len) != 1)
+			errmsg = PQerrorMessage (conn->pg_conn);
+		if (errmsg == NULL)
+			lua_pop (L, 1);
+	}
+	free (b.data);
+	/* a message makes the server abort the COPY */
+	PQputCopyEnd (conn->pg_conn, errmsg);
+	return copy_end (L, conn, errmsg);
+}
+
+
+/*
+** Pushes a table with the values of a row in COPY text format, and the
+** number of values in the field 'n'. NULL values are nil.
+*/
+static void copy_decode (lua_State *L, const char *row, int len) {
+	char *field = (char *)malloc (len + 1);
+	int i = 0, n = 0, j;
+
+	if (field == NULL)
+		luaL_error (L, LUASQL_PREFIX"out of memory");
+	if (len > 0 && row[len - 1] == '\n')
+		len--;
+	lua_newtable (L);
+	while (i <= len) {
+		n++;
+		if (i + 1 < len && row[i] == '\\' && row[i + 1] == 'N'
+				&& (i + 2 == len || row[i + 2] == '\t')) {
+			/* NULL */
+			i += 3;
+			continue;
+		}
+		for (j = 0; i < len && row[i] != '\t'; i++) {
+			if (row[i] != '\\' || i + 1 == len) {
+				field[j++] = row[i];
+				continue;
+			}
+			switch (row[++i]) {
+				case 'b': field[j++] = '\b'; break;
+				case 'f': field[j++] = '\f'; break;
+				case 'n': field[j++] = '\n'; break;
+				case 'r': field[j++] = '\r'; break;
+				case 't': field[j++] = '\t'; break;
+				case 'v': field[j++] = '\v'; break;
+				case 'x':
+					if (i + 1 < len && isxdigit ((unsigned char)row[i + 1])) {
+						int k, c = 0;
+						for (k = 0; k < 2 && i + 1 < len && isxdigit ((unsigned char)row[i + 1]); k++) {
+							char h = row[++i];
+							c = c * 16 + (isdigit ((unsigned char)h) ? h - '0' : tolower ((unsigned char)h) - 'a' + 10);
+						}
+						field[j++] = (char)c;
+					} else
+						field[j++] = 'x';
+					break;
+				default:
+					if (row[i] >= '0' && row[i] <= '7') {
+						int k, c = row[i] - '0';
+						for (k = 1; k < 3 && i + 1 < len && row[i + 1] >= '0' && row[i + 1] <= '7'; k++)
+							c = c * 8 + row[++i] - '0';
+						field[j++] = (char)c;
+					} else
+						field[j++] = row[i];
+			}
+		}
+		lua_pushlstring (L, field, j);
+		lua_rawseti (L, -2, n);
+		i++;
+	}
+	free (field);
+	lua_pushinteger (L, n);
+	lua_setfield (L, -2, "n");
+}
+
+
+/*
+** Runs a COPY ... TO STDOUT statement, passing the data to 'sink', a
+** function or an object with a 'write' method (such as a file), one
+** row at a time: as the string sent by the server, or as a table of
+** values when 'rows' is true (text format only).
+** Return the number of rows copied, or nil and an error message.
+*/
+static int conn_copyout (lua_State *L) {
+	conn_data *conn = getidleconnection (L);
+	const char *sql = luaL_checkstring (L, 2);
+	int rows = lua_toboolean (L, 4);
+	int method = !lua_isfunction (L, 3);
+	const char *errmsg = NULL;
+	PGresult *res;
+	char *data;
+	int len, ok;
+
+	lua_settop (L, 3);
+	if (method) {
+		lua_getfield (L, 3, "write");
+		luaL_argcheck (L, lua_isfunction (L, -1), 3, LUASQL_PREFIX"function or object with a write method expected");
+	} else
+		lua_pushvalue (L, 3);
+	res = PQexec (conn->pg_conn, sql);
+	if (PQresultStatus (res) != PGRES_COPY_OUT) {
+		int status = PQresultStatus (res);
+		PQclear (res);
+		return luasql_faildirect (L, status == PGRES_COMMAND_OK || status == PGRES_TUPLES_OK
+			? LUASQL_PREFIX"not a COPY TO STDOUT statement" : PQerrorMessage (conn->pg_conn));
+	}
+	PQclear (res);
+	while ((len = PQgetCopyData (conn->pg_conn, &data, 0)) >= 0) {
+		/* after an error, discard the rest */
+		if (errmsg == NULL) {
+			lua_pushvalue (L, 4);
+			if (method)
+				lua_pushvalue (L, 3);
+			if (rows)
+				copy_decode (L, data, len);
+			else
+				lua_pushlstring (L, data, len);
+			conn->copy = 1;
+			ok = lua_pcall (L, method + 1, 0, 0) == 0;
+			conn->copy = 0;
+			if (!ok) {
+				errmsg = lua_isstring (L, -1) ? lua_tostring (L, -1)
+					: LUASQL_PREFIX"error in the sink";
+				cancel_query (conn);
+			}
+		}
+		PQfreemem (data);
+	}
+	if (len == -2 && errmsg == NULL)
+		errmsg = PQerrorMessage (conn->pg_conn);
+	return copy_end (L, conn, errmsg);
+}
+
+
+/*
+** Prepares a statement on the server.
+** Unnamed statements get a name unique in the connection.
+** Return a Statement object or nil and an error message.
+*/
+static int conn_prepare (lua_State *L) {
+	conn_data *conn = getidleconnection (L);
+	const char *name = luaL_optstring (L, 2, NULL);
+	const char *sql = luaL_checkstring (L, 3);
+	char buff[32];
+	stmt_data *stmt;
+	PGresult *res;
+	int i;
+
+	if (name == NULL) {
+		sprintf (buff, "luasql_%d", ++conn->stmt_counter);
+		name = buff;
+	}
+	res = PQprepare (conn->pg_conn, name, sql, 0, NULL);
+	if (PQresultStatus (res) == PGRES_COMMAND_OK) {
+		PQclear (res);
+		res = PQdescribePrepared (conn->pg_conn, name);
+	}
+	if (PQresultStatus (res) != PGRES_COMMAND_OK) {
+		PQclear (res);
+		return luasql_faildirect (L, PQerrorMessage (conn->pg_conn));
+	}
+
+	stmt = (stmt_data *)lua_newuserdata (L, sizeof (stmt_data));
+	luasql_setmeta (L, LUASQL_STATEMENT_PG);
+	stmt->closed = 0;
+	stmt->conn_data = conn;
+	stmt->nparams = PQnparams (res);
+	stmt->name = (char *)malloc (strlen (name) + 1);
+	stmt->paramtypes = (Oid *)malloc ((stmt->nparams + 1) * sizeof (Oid));
+	if (stmt->name == NULL || stmt->paramtypes == NULL) {
+		free (stmt->name);
+		free (stmt->paramtypes);
+		PQclear (res);
+		stmt->closed = 1;
+		return luasql_faildirect (L, LUASQL_PREFIX"out of memory");
+	}
+	strcpy (stmt->name, name);
+	for (i = 0; i < stmt->nparams; i++)
+		stmt->paramtypes[i] = PQparamtype (res, i);
+	/* statements with a column of an unknown type get text results */
+	stmt->binary = PQnfields (res) > 0;
+	for (i = 0; i < PQnfields (res); i++)
+		if (!binary_type (PQftype (res, i)))
+			stmt->binary = 0;
+	PQclear (res);
+	lua_pushvalue (L, 1);
+	stmt->conn = luaL_ref (L, LUA_REGISTRYINDEX);
+	stmt->next = conn->statements;
+	conn->statements = stmt;
+	return 1;
+}
+
+
+/*
+** Writes 'n' as a big-endian two's complement integer of 'size' bytes.
+*/
+static void put_int (char *p, lua_Number n, int size) {
+	double hi = floor (n / 4294967296.0);
+	unsigned long lo = (unsigned long)(n - hi * 4294967296.0);
+	int i;
+
+	if (size == 8) {
+		unsigned long h = (unsigned long)(hi < 0 ? hi + 4294967296.0 : hi);
+		for (i = 0; i < 4; i++)
+			p[i] = (char)((h >> (24 - 8 * i)) & 0xff);
+		p += 4;
+		size = 4;
+	}
+	for (i = 0; i < size; i++)
+		p[i] = (char)((lo >> (8 * (size - 1 - i))) & 0xff);
+}
+
+
+/*
+** Writes 'n' as a big-endian IEEE float of 'size' (4 or 8) bytes.
+*/
+static void put_float (char *p, lua_Number n, int size) {
+	unsigned short one = 1;
+	int little = *(unsigned char *)&one;
+	unsigned char b[8];
+	int i;
+
+	if (size == 4) {
+		float f = (float)n;
+		memcpy (b, &f, 4);
+	} else {
+		double d = (double)n;
+		memcpy (b, &d, 8);
+	}
+	for (i = 0; i < size; i++)
+		p[i] = (char)b[little ? size - 1 - i : i];
+}
+
+
+/*
+** Converts the Lua value at 'idx' into a parameter of type 'type':
+** numbers, booleans and bytea strings in binary format when the type
+** allows it, other values in text format.
+** The text or binary form of numbers and booleans is written to 'buff'.
+*/
+static void bind_param (lua_State *L, int idx, Oid type, char *buff,
+		const char **value, int *length, int *format) {
+	lua_Number n;
+	size_t len;
+
+	*length = 0;
+	*format = 0;
+	switch (lua_type (L, idx)) {
+		case LUA_TNIL:
+			*value = NULL;
+			return;
+		case LUA_TBOOLEAN:
+			*value = buff;
+			if (type == BOOLOID) {
+				buff[0] = (char)lua_toboolean (L, idx);
+				*length = 1;
+				*format = 1;
+			} else
+				strcpy (buff, lua_toboolean (L, idx) ? "true" : "false");
+			return;
+		case LUA_TNUMBER:
+			n = lua_tonumber (L, idx);
+			*value = buff;
+			*format = 1;
+			if (type == FLOAT8OID || type == FLOAT4OID) {
+				*length = type == FLOAT8OID ? 8 : 4;
+				put_float (buff, n, *length);
+			} else if (n == floor (n) && ((type == INT2OID
+					&& n >= -32768.0 && n <= 32767.0)
+				|| (type == INT4OID
+					&& n >= -2147483648.0 && n <= 2147483647.0)
+				|| (type == INT8OID
+					&& n >= -9223372036854775808.0 && n < 9223372036854775808.0))) {
+				*length = type == INT2OID ? 2 : type == INT4OID ? 4 : 8;
+				put_int (buff, n, *length);
+			} else {
+				/* let the server convert (or reject) it */
+				*format = 0;
+				format_number (buff, n);
+			}
+			return;
+		default:
+			*value = lua_tolstring (L, idx, &len);
+			if (type == BYTEAOID) {
+				*length = (int)len;
+				*format = 1;
+			}
+	}
+}
+
+
+typedef struct {
+	const char **values;
+	int        *lengths;
+	int        *formats;
+} param_set;
+
+
+/*
+** Converts the 'n' Lua values from stack position 'first' into
+** parameters of the given types, or text parameters if 'types' is NULL.
+** Return 0 if out of memory; 'values' must be freed after use.
+*/
+static int bind_params (lua_State *L, int first, int n, const Oid *types,
+		param_set *p) {
+	char *buff;
+	int i;
+
+	for (i = first; i < first + n; i++)
+		if (lua_type (L, i) != LUA_TNIL && lua_type (L, i) != LUA_TBOOLEAN
+				&& !lua_isstring (L, i))
+			luaL_argerror (L, i, LUASQL_PREFIX"parameter must be a number, string, boolean or nil");
+	p->values = NULL;
+	p->lengths = p->formats = NULL;
+	if (n == 0)
+		return 1;
+	p->values = (const char **)malloc (n * (sizeof (char *)
+		+ 2 * sizeof (int) + PARAM_BUFFER));
+	if (p->values == NULL)
+		return 0;
+	p->lengths = (int *)(p->values + n);
+	p->formats = p->lengths + n;
+	buff = (char *)(p->formats + n);
+	for (i = 0; i < n; i++)
+		bind_param (L, first + i, types != NULL ? types[i] : 0,
+			buff + i * PARAM_BUFFER, &p->values[i], &p->lengths[i],
+			&p->formats[i]);
+	return 1;
+}
+
+
+/*
+** Executes a prepared statement with the given parameters.
+** Return a Cursor object if the statement is a query, otherwise
+** return the number of tuples affected by the statement.
+*/
+static int stmt_execute (lua_State *L) {
+	stmt_data *stmt = getstatement (L);
+	conn_data *conn = stmt->conn_data;
+	int n = stmt->nparams;
+	const char *busy = conn_busy (conn);
+	param_set p;
+	PGresult *res;
+
+	luaL_argcheck (L, busy == NULL, 1, busy);
+	if (lua_gettop (L) - 1 != n) {
+		lua_pushnil (L);
+		lua_pushfstring (L, LUASQL_PREFIX"statement expects %d parameters, got %d",
+			n, lua_gettop (L) - 1);
+		return 2;
+	}
+	if (!bind_params (L, 2, n, stmt->paramtypes, &p))
+		return luasql_faildirect (L, LUASQL_PREFIX"out of memory");
+	res = PQexecPrepared (conn->pg_conn, stmt->name, n, p.values, p.lengths,
+		p.formats, conn->binary && stmt->binary);
+	free ((void *)p.values);
+	lua_rawgeti (L, LUA_REGISTRYINDEX, stmt->conn);
+	return push_result (L, conn, lua_gettop (L), res);
+}
+
+
+/*
+** Closes a prepared statement and deallocates it on the server.
+** Returns true in case of success, or false in case the statement was
+** already closed.
+*/
+static int stmt_close (lua_State *L) {
+	stmt_data *stmt = (stmt_data *)luaL_checkudata (L, 1, LUASQL_STATEMENT_PG);
+	luaL_argcheck (L, stmt != NULL, 1, LUASQL_PREFIX"statement expected");
+	if (stmt->closed) {
+		lua_pushboolean (L, 0);
+		return 1;
+	}
+	stmt_nullify (L, stmt, 1);
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Statement object collector function
+*/
+static int stmt_gc (lua_State *L) {
+	stmt_data *stmt = (stmt_data *)luaL_checkudata (L, 1, LUASQL_STATEMENT_PG);
+	if (stmt != NULL && !(stmt->closed))
+		stmt_nullify (L, stmt, 1);
+	return 0;
+}
+
+
+#ifdef LIBPQ_HAS_PIPELINING
+typedef struct {
+	conn_data *conn;               /* NULL once the pipeline has ended */
+	int        count;              /* statements sent */
+} pipe_data;
+
+
+/*
+** Check for a pipeline still running.
+*/
+static pipe_data *getpipeline (lua_State *L) {
+	pipe_data *p = (pipe_data *)luaL_checkudata (L, 1, LUASQL_PIPELINE_PG);
+	luaL_argcheck (L, p != NULL, 1, LUASQL_PREFIX"pipeline expected");
+	luaL_argcheck (L, p->conn != NULL, 1, LUASQL_PREFIX"pipeline has ended");
+	return p;
+}
+
+
+/*
+** Sends a statement, an SQL string or a prepared statement, with the
+** given parameters, without waiting for its result. Each statement is
+** followed by a synchronization point, so it runs on its own like with
+** conn:execute.
+** Return the position of its result, or nil and an error message.
+*/
+static int pipe_execute (lua_State *L) {
+	pipe_data *p = getpipeline (L);
+	conn_data *conn = p->conn;
+	int n = lua_gettop (L) - 2;
+	stmt_data *stmt = NULL;
+	const char *sql = NULL;
+	param_set params;
+	int sent;
+
+	if (lua_type (L, 2) == LUA_TUSERDATA) {
+		stmt = (stmt_data *)luaL_checkudata (L, 2, LUASQL_STATEMENT_PG);
+		luaL_argcheck (L, !stmt->closed && stmt->conn_data == conn, 2,
+			LUASQL_PREFIX"open statement of the connection expected");
+		if (n != stmt->nparams) {
+			lua_pushnil (L);
+			lua_pushfstring (L, LUASQL_PREFIX"statement expects %d parameters, got %d",
+				stmt->nparams, n);
+			return 2;
+		}
+	} else
+		sql = luaL_checkstring (L, 2);
+	if (!bind_params (L, 3, n, stmt != NULL ? stmt->paramtypes : NULL, &params))
+		return luasql_faildirect (L, LUASQL_PREFIX"out of memory");
+	if (stmt != NULL)
+		sent = PQsendQueryPrepared (conn->pg_conn, stmt->name, n, params.values,
+			params.lengths, params.formats, conn->binary && stmt->binary);
+	else
+		sent = PQsendQueryParams (conn->pg_conn, sql, n, NULL, params.values,
+			params.lengths, params.formats, 0);
+	free ((void *)params.values);
+	if (!sent)
+		return luasql_faildirect (L, PQerrorMessage (conn->pg_conn));
+	p->count++;
+	if (!PQpipelineSync (conn->pg_conn))
+		return luasql_faildirect (L, PQerrorMessage (conn->pg_conn));
+	lua_pushnumber (L, p->count);
+	return 1;
+}
+
+
+/*
+** Runs the function 'f' with a pipeline object whose execute method
+** queues statements, then reads their results in order: row counts or
+** cursors, or false (and the error message in the second table).
+** Return the tables of results and of errors, or nil and the error
+** raised by 'f' (the statements it sent still run).
+*/
+static int conn_pipeline (lua_State *L) {
+	conn_data *conn = getidleconnection (L);
+	pipe_data *p;
+	int i, ok, results, errors;
+
+	luaL_checktype (L, 2, LUA_TFUNCTION);
+	lua_settop (L, 2);
+	if (!PQenterPipelineMode (conn->pg_conn))
+		return luasql_faildirect (L, PQerrorMessage (conn->pg_conn));
+	conn->pipeline = 1;
+	p = (pipe_data *)lua_newuserdata (L, sizeof (pipe_data));
+	luasql_setmeta (L, LUASQL_PIPELINE_PG);
+	p->conn = conn;
+	p->count = 0;
+	lua_pushvalue (L, 2);
+	lua_pushvalue (L, 3);
+	ok = lua_pcall (L, 1, 0, 0) == 0;
+	p->conn = NULL;
+
+	lua_newtable (L);
+	results = lua_gettop (L);
+	lua_newtable (L);
+	errors = results + 1;
+	for (i = 1; i <= p->count; i++) {
+		PGresult *res = PQgetResult (conn->pg_conn), *rest;
+		int status = PQresultStatus (res);
+		if (res != NULL && (status == PGRES_COMMAND_OK || status == PGRES_TUPLES_OK))
+			push_result (L, conn, 1, res);
+		else {
+			lua_pushstring (L, status == PGRES_PIPELINE_ABORTED
+				? LUASQL_PREFIX"pipeline aborted" : res != NULL
+				? PQresultErrorMessage (res) : PQerrorMessage (conn->pg_conn));
+			lua_rawseti (L, errors, i);
+			lua_pushboolean (L, 0);
+			PQclear (res);
+		}
+		lua_rawseti (L, results, i);
+		/* the end of the results and the synchronization point */
+		while ((rest = PQgetResult (conn->pg_conn)) != NULL)
+			PQclear (rest);
+		PQclear (PQgetResult (conn->pg_conn));
+	}
+	PQexitPipelineMode (conn->pg_conn);
+	conn->pipeline = 0;
+	if (!ok) {
+		lua_pushnil (L);
+		lua_pushvalue (L, 4);
+		return 2;
+	}
+	return 2;
+}
+#endif
+
+
 /*
 ** Commit the current transaction.
 */
 static int conn_commit (lua_State *L) {
-	conn_data *conn = getconnection (L);
+	conn_data *conn = getidleconnection (L);
 	sql_commit(conn);
 	if (conn->auto_commit == 0) {
 		sql_begin(conn);
@@ -496,7 +1669,7 @@ static int conn_commit (lua_State *L) {
 ** Rollback the current transaction.
 */
 static int conn_rollback (lua_State *L) {
-	conn_data *conn = getconnection (L);
+	conn_data *conn = getidleconnection (L);
 	sql_rollback(conn);
 	if (conn->auto_commit == 0) {
 		sql_begin(conn);
@@ -513,6 +1686,8 @@ static int conn_rollback (lua_State *L) {
 ** If 'false', then start a new transaction.
 */
 static void conn_dosetautocommit(lua_State *L, conn_data *conn, int pos){
+	if (conn_busy (conn) != NULL)
+		luaL_error (L, conn_busy (conn));
 	if (lua_toboolean (L, pos)) {
 		conn->auto_commit = 1;
 		sql_rollback(conn); /* Undo active transaction. */
@@ -547,6 +1722,15 @@ static void conn_set(lua_State *L) {
 				if( strcmp(key, LUASQL_AUTOCOMMIT) == 0 ) {
 					if( lua_isboolean( L, -1 ) )
 						conn_dosetautocommit(L, conn, -1);
+				} else if( strcmp(key, LUASQL_TYPED) == 0 ) {
+					if( lua_isboolean( L, -1 ) )
+						conn->typed = lua_toboolean( L, -1 );
+				} else if( strcmp(key, LUASQL_NUMERICSTRING) == 0 ) {
+					if( lua_isboolean( L, -1 ) )
+						conn->numeric_string = lua_toboolean( L, -1 );
+				} else if( strcmp(key, LUASQL_BINARY) == 0 ) {
+					if( lua_isboolean( L, -1 ) )
+						conn->binary = lua_toboolean( L, -1 );
 				}
 			}
 
@@ -576,6 +1760,18 @@ static int conn_get( lua_State *L ) {
 					lua_pushstring( L, LUASQL_AUTOCOMMIT );
 					lua_pushboolean( L, conn->auto_commit );
 					lua_settable( L, rsp );
+				} else if( strcmp(key, LUASQL_TYPED) == 0 ) {
+					lua_pushstring( L, LUASQL_TYPED );
+					lua_pushboolean( L, conn->typed );
+					lua_settable( L, rsp );
+				} else if( strcmp(key, LUASQL_NUMERICSTRING) == 0 ) {
+					lua_pushstring( L, LUASQL_NUMERICSTRING );
+					lua_pushboolean( L, conn->numeric_string );
+					lua_settable( L, rsp );
+				} else if( strcmp(key, LUASQL_BINARY) == 0 ) {
+					lua_pushstring( L, LUASQL_BINARY );
+					lua_pushboolean( L, conn->binary );
+					lua_settable( L, rsp );
 				}
 			}
 
@@ -588,6 +1784,15 @@ static int conn_get( lua_State *L ) {
 			if( strcmp(key, LUASQL_AUTOCOMMIT) == 0 ) {
 				conn_data *conn = getconnection(L);
 				lua_pushboolean( L, conn->auto_commit );
+			} else if( strcmp(key, LUASQL_TYPED) == 0 ) {
+				conn_data *conn = getconnection(L);
+				lua_pushboolean( L, conn->typed );
+			} else if( strcmp(key, LUASQL_NUMERICSTRING) == 0 ) {
+				conn_data *conn = getconnection(L);
+				lua_pushboolean( L, conn->numeric_string );
+			} else if( strcmp(key, LUASQL_BINARY) == 0 ) {
+				conn_data *conn = getconnection(L);
+				lua_pushboolean( L, conn->binary );
 			} else
 				lua_pushnil(L);
 		} else
@@ -609,6 +1814,11 @@ static int create_connection (lua_State *L, int env, PGconn *const pg_conn) {
 	conn->env = LUA_NOREF;
 	conn->auto_commit = 1;
 	conn->pg_conn = pg_conn;
+	conn->statements = NULL;
+	conn->stmt_counter = 0;
+	conn->typed = conn->numeric_string = conn->binary = 0;
+	conn->stream = NULL;
+	conn->pipeline = conn->copy = 0;
 	lua_pushvalue (L, env);
 	conn->env = luaL_ref (L, LUA_REGISTRYINDEX);
 	return 1;
@@ -816,6 +2026,13 @@ static void create_metatables (lua_State *L) {
 		{"close",         conn_close},
 		{"escape",        conn_escape},
 		{"execute",       conn_execute},
+		{"prepare",       conn_prepare},
+		{"stream",        conn_stream},
+		{"copyin",        conn_copyin},
+		{"copyout",       conn_copyout},
+#ifdef LIBPQ_HAS_PIPELINING
+		{"pipeline",      conn_pipeline},
+#endif
 		{"commit",        conn_commit},
 		{"rollback",      conn_rollback},
 		{"setautocommit", conn_setautocommit},
@@ -834,11 +2051,28 @@ static void create_metatables (lua_State *L) {
 	    {"set", 		cur_set},
 		{NULL, NULL},
 	};
+	struct luaL_reg statement_methods[] = {
+		{"__gc",        stmt_gc},
+		{"close",       stmt_close},
+		{"execute",     stmt_execute},
+		{NULL, NULL},
+	};
+#ifdef LIBPQ_HAS_PIPELINING
+	struct luaL_reg pipeline_methods[] = {
+		{"execute",     pipe_execute},
+		{NULL, NULL},
+	};
+#endif
 	luasql_createmeta (L, LUASQL_ENVIRONMENT_PG, environment_methods);
 	luasql_createmeta (L, LUASQL_CONNECTION_PG, connection_methods);
 	luasql_createmeta (L, LUASQL_CURSOR_PG, cursor_methods);
+	luasql_createmeta (L, LUASQL_STATEMENT_PG, statement_methods);
+#ifdef LIBPQ_HAS_PIPELINING
+	luasql_createmeta (L, LUASQL_PIPELINE_PG, pipeline_methods);
+	lua_pop (L, 1);
+#endif
 	luasql_createdefaultoptions( L );
-	lua_pop (L, 3);
+	lua_pop (L, 4);
 }
 
 /*
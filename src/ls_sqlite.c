@@ -50,6 +50,8 @@ typedef struct
 	int         numcols;            /* number of columns */
 	int         colnames, coltypes; /* reference to column information tables */
 	sqlite_vm  *sql_vm;
+	int         pending;            /* result of the first step, not fetched yet */
+	const char **row;               /* row produced by the first step */
 	char	   *modestring;
 } cur_data;
 
@@ -121,7 +123,16 @@ static int cur_fetch (lua_State *L) {
     if (vm == NULL)
         return 0;
 
-    res = sqlite_step(vm, NULL, &row, NULL);
+    /* the first step was already run by execute */
+    if (cur->pending)
+    {
+        res = cur->pending;
+        row = cur->row;
+        cur->pending = 0;
+        cur->row = NULL;
+    }
+    else
+        res = sqlite_step(vm, NULL, &row, NULL);
 
     /* no more results? */
     if (res == SQLITE_DONE)
@@ -295,7 +306,8 @@ static int cur_get( lua_State *L ) {
 /* static int create_cursor(lua_State *L, int conn, sqlite_vm *sql_vm,
     int numcols, const char **row, const char **col_info)*/
 static int create_cursor(lua_State *L, int o, conn_data *conn, 
-		sqlite_vm *sql_vm, int numcols, const char **col_info)
+		sqlite_vm *sql_vm, int numcols, const char **col_info,
+		int pending, const char **row)
 {
     int i;
 	cur_data *cur = (cur_data*)lua_newuserdata(L, sizeof(cur_data));
@@ -311,6 +323,8 @@ static int create_cursor(lua_State *L, int o, conn_data *conn,
 	cur->colnames = LUA_NOREF;
 	cur->coltypes = LUA_NOREF;
 	cur->sql_vm = sql_vm;
+	cur->pending = pending;
+	cur->row = row;
 	cur->modestring = "n";
 
     lua_pushvalue(L, o);
@@ -375,6 +389,7 @@ static int conn_execute(lua_State *L)
     sqlite_vm *vm;
     char *errmsg;
     int numcols;
+    const char **row = NULL;
     const char **col_info;
 
     res = sqlite_compile(conn->sql_conn, statement, NULL, &vm, &errmsg);
@@ -389,13 +404,13 @@ static int conn_execute(lua_State *L)
     }
 
     /* process first result to retrive query information and type */
-    res = sqlite_step(vm, &numcols, NULL, &col_info);
+    res = sqlite_step(vm, &numcols, &row, &col_info);
 
     /* real query? if empty, must have numcols!=0 */
 	if ((res == SQLITE_ROW) || ((res == SQLITE_DONE) && numcols))
 	{
-		sqlite_reset(vm, NULL);
-		return create_cursor(L, 1, conn, vm, numcols, col_info);
+		/* keep the result of this step for the first fetch */
+		return create_cursor(L, 1, conn, vm, numcols, col_info, res, row);
 	}
 
     if (res == SQLITE_DONE) /* and numcols==0, INSERT,UPDATE,DELETE statement */
@@ -6,11 +6,29 @@
 ** $Id: ls_sqlite3.c,v 1.12 2008/06/11 00:26:13 jasonsantos Exp $
 */
 
+#ifndef _WIN32
+/* clock_gettime and POSIX threads are not declared under -ansi */
+#define _POSIX_C_SOURCE 200112L
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#endif
 
+#ifdef LUASQL_SQLITE_COMPAT
+/* the SQLite 2 library, read by env:convert */
+#include "sqlite.h"
+#undef SQLITE_VERSION
+#undef SQLITE_TEXT
+#endif
 #include "sqlite3.h"
 
 #include "lua.h"
@@ -25,15 +43,382 @@
 #define LUASQL_ENVIRONMENT_SQLITE "SQLite3 environment"
 #define LUASQL_CONNECTION_SQLITE "SQLite3 connection"
 #define LUASQL_CURSOR_SQLITE "SQLite3 cursor"
+#define LUASQL_STATEMENT_SQLITE "SQLite3 statement"
+#define LUASQL_BLOB_SQLITE "SQLite3 blob"
+#define LUASQL_BACKUP_SQLITE "SQLite3 backup"
+#define LUASQL_READPOOL_SQLITE "SQLite3 read pool"
+#define LUASQL_READJOB_SQLITE "SQLite3 read job"
 #define LUASQL_LOCKTIMEOUT "locktimeout"
+#define LUASQL_STMTCACHE "stmtcache"
+#define LUASQL_STMTCACHE_SIZE "stmtcache_size"
+#define LUASQL_STMTCACHE_HITS "stmtcache_hits"
+#define LUASQL_STMTCACHE_MISSES "stmtcache_misses"
+#define LUASQL_STMTCACHE_EVICTIONS "stmtcache_evictions"
+#define LUASQL_BUSYTIMEOUT "busy_timeout"
+#define LUASQL_READONLY "readonly"
+#define LUASQL_URI "uri"
+#define LUASQL_SHAREDCACHE "sharedcache"
+#define LUASQL_MUTEX "mutex"
+#define LUASQL_JOURNALMODE "journal_mode"
+#define LUASQL_TRANSACTION "transaction"
+#define LUASQL_TIMINGS "timings"
+#define LUASQL_PAGESPERSTEP "pages_per_step"
+#define LUASQL_SLEEPMS "sleep_ms"
+#define LUASQL_PROGRESS "progress"
+#define LUASQL_SCHEMA "schema"
+#define LUASQL_RESIZEABLE "resizeable"
+#define LUASQL_ENABLE "enable"
+#define LUASQL_RESET "reset"
+#define LUASQL_SLOWMS "slow_ms"
+#define LUASQL_SLOW "slow"
+#define LUASQL_TRACE "trace"
+#define LUASQL_DETERMINISTIC "deterministic"
+#define LUASQL_SCAN "scan"
+#define LUASQL_BESTINDEX "best_index"
+#define LUASQL_INTERVALMS "interval_ms"
+#define LUASQL_RESTARTPAGES "restart_pages"
+#define LUASQL_TRUNCATEPAGES "truncate_pages"
+#define LUASQL_MAXAGEMS "max_age_ms"
+#define LUASQL_WALSIZE "wal_size"
+#define LUASQL_WALFRAMES "wal_frames"
+#define LUASQL_CHECKPOINTED "checkpointed_frames"
+#define LUASQL_CHECKPOINTMS "checkpoint_ms"
+#define LUASQL_CHECKPOINTMODE "checkpoint_mode"
+#define LUASQL_CHECKPOINTS "checkpoints"
+#define LUASQL_CHECKPOINTBUSY "checkpoint_busy"
+#define LUASQL_GROUPCOMMIT "groupcommit"
+#define LUASQL_MAXROWS "max_rows"
+#define LUASQL_MAXMS "max_ms"
+#define LUASQL_GROUPCOMMIT_PENDING "groupcommit_pending"
+#define LUASQL_GROUPCOMMIT_COMMITS "groupcommit_commits"
+#define LUASQL_GROUPCOMMIT_STATEMENTS "groupcommit_statements"
+#define LUASQL_GROUPCOMMIT_LAST "groupcommit_last"
+#define LUASQL_LOOKASIDE "lookaside"
+#define LUASQL_PAGECACHE "pagecache"
+#define LUASQL_SIZE "size"
+#define LUASQL_COUNT "count"
+#define LUASQL_SOFTHEAPLIMIT "soft_heap_limit"
+#define LUASQL_HARDHEAPLIMIT "hard_heap_limit"
+#define LUASQL_TIMEOUTMS "timeout_ms"
+#define LUASQL_RESULTCACHE "resultcache"
+#define LUASQL_RESULTCACHE_SIZE "resultcache_size"
+#define LUASQL_RESULTCACHE_ENTRIES "resultcache_entries"
+#define LUASQL_RESULTCACHE_HITS "resultcache_hits"
+#define LUASQL_RESULTCACHE_MISSES "resultcache_misses"
+#define LUASQL_RESULTCACHE_EVICTIONS "resultcache_evictions"
+#define LUASQL_RESULTCACHE_INVALIDATIONS "resultcache_invalidations"
+
+/* statements cached by default by the connections of luasql.sqlite */
+#define COMPAT_STMTCACHE 32
+
+/* virtual machine instructions between checks of a deadline */
+#define DEADLINE_OPS 1000
+
+/*
+** Tuning pragmas accepted by env:connect and reported by conn:get,
+** in the order they are applied.
+*/
+static const char *const tuning_pragmas[] = {
+  "page_size", LUASQL_JOURNALMODE, "synchronous", "cache_size",
+  "mmap_size", "temp_store", NULL
+};
 
 typedef struct
 {
   short       closed;
   int		  locktimeout;
+  short       compat;             /* 1 for the luasql.sqlite API */
 } env_data;
 
 
+/*
+** Compiled statement kept by the statement cache, keyed by its SQL text.
+*/
+typedef struct cache_entry
+{
+  const char   *sql;               /* sqlite3_sql(vm) */
+  size_t       len;
+  unsigned int hash;
+  sqlite3_stmt *vm;
+  struct cache_entry *prev, *next;
+  struct cache_entry *chain;       /* next entry of the same bucket */
+} cache_entry;
+
+
+/*
+** LRU list of compiled statements of a connection, indexed by a hash
+** table of 'nbuckets' (a power of 2, or 0) chains.
+*/
+typedef struct
+{
+  int          capacity;           /* 0 disables the cache */
+  int          size;
+  cache_entry  *first, *last;      /* most and least recently used */
+  cache_entry  **buckets;
+  unsigned int nbuckets;
+  unsigned long hits, misses, evictions;
+} stmt_cache;
+
+
+/*
+** Statistics of the runs of one statement, keyed by its SQL text.
+*/
+typedef struct profile_entry
+{
+  char         *sql;
+  size_t       len;
+  unsigned int hash;
+  unsigned long count;             /* completed runs */
+  sqlite3_int64 total, min, max;   /* run times in nanoseconds */
+  double       rows;
+  double       fullscan_steps, sorts, autoindexes, vm_steps;
+  struct profile_entry *next;      /* next entry in the bucket */
+} profile_entry;
+
+
+/*
+** Profiling state of a connection; only allocated while enabled.
+*/
+typedef struct
+{
+  lua_State    *T;                 /* thread running the callbacks */
+  int          thread;             /* reference to T */
+  int          slow;               /* reference to slow statement function */
+  int          trace;              /* reference to trace function */
+  sqlite3_int64 slow_ns;
+  profile_entry **buckets;
+  int          nbuckets, size;
+  sqlite3_stmt *last_vm;           /* statement of the last row event */
+  profile_entry *last;
+  sqlite3_stmt *internal;          /* statement of the driver, not profiled */
+  short        running;            /* a Lua callback is running */
+} profile_data;
+
+
+/*
+** Threads, mutexes and condition variables of the background workers.
+*/
+#ifdef _WIN32
+typedef CRITICAL_SECTION sys_mutex;
+typedef CONDITION_VARIABLE sys_cond;
+typedef HANDLE sys_thread;
+#define WORKER_API		DWORD WINAPI
+#define mutex_init(m)		InitializeCriticalSection(m)
+#define mutex_destroy(m)	DeleteCriticalSection(m)
+#define mutex_lock(m)		EnterCriticalSection(m)
+#define mutex_unlock(m)		LeaveCriticalSection(m)
+#define cond_init(c)		InitializeConditionVariable(c)
+#define cond_destroy(c)		((void)(c))
+#define cond_signal(c)		WakeConditionVariable(c)
+#define cond_broadcast(c)	WakeAllConditionVariable(c)
+#define cond_wait(c, m)		SleepConditionVariableCS(c, m, INFINITE)
+#define thread_create(t, f, arg) \
+  ((*(t) = CreateThread(NULL, 0, f, arg, 0, NULL)) == NULL)
+#define thread_join(t)		(WaitForSingleObject(t, INFINITE), CloseHandle(t))
+#else
+typedef pthread_mutex_t sys_mutex;
+typedef pthread_cond_t sys_cond;
+typedef pthread_t sys_thread;
+#define WORKER_API		void *
+#define mutex_init(m)		pthread_mutex_init(m, NULL)
+#define mutex_destroy(m)	pthread_mutex_destroy(m)
+#define mutex_lock(m)		pthread_mutex_lock(m)
+#define mutex_unlock(m)		pthread_mutex_unlock(m)
+#define cond_init(c)		pthread_cond_init(c, NULL)
+#define cond_destroy(c)		pthread_cond_destroy(c)
+#define cond_signal(c)		pthread_cond_signal(c)
+#define cond_broadcast(c)	pthread_cond_broadcast(c)
+#define cond_wait(c, m)		pthread_cond_wait(c, m)
+#define thread_create(t, f, arg) pthread_create(t, NULL, f, arg)
+#define thread_join(t)		pthread_join(t, NULL)
+#endif
+
+
+/*
+** Background checkpointer of a connection in WAL mode.  The worker
+** thread uses its own connection; the statistics are guarded by 'lock'.
+*/
+typedef struct checkpointer
+{
+  sqlite3      *db;                /* connection of the worker thread */
+  int          interval_ms;        /* pause between checkpoints */
+  int          restart_pages;      /* WAL size escalating to RESTART */
+  int          truncate_pages;     /* WAL size escalating to TRUNCATE */
+  int          max_age_ms;         /* TRUNCATE when not reset for so long */
+  int          page_size;
+  int          autocheckpoint;     /* wal_autocheckpoint to restore */
+  int          stop;
+  double       last_reset;         /* time the WAL was last emptied */
+  int          wal_frames;         /* frames in the WAL ... */
+  int          checkpointed;       /* ... and checkpointed by the last run */
+  double       duration;           /* seconds taken by the last run */
+  const char   *mode;              /* mode of the last run */
+  unsigned long count, busy;
+  sys_mutex    lock;
+  sys_cond     wake;
+  sys_thread   thread;
+} checkpointer;
+
+
+/*
+** Group commit of a connection in auto commit mode: its writes run in
+** an implicit transaction, committed every max_rows statements or
+** max_ms milliseconds.
+*/
+typedef struct
+{
+  int          max_rows;           /* 0 when group commit is disabled */
+  int          max_ms;             /* 0 for no age limit */
+  int          open;               /* the implicit transaction is open */
+  int          pending;            /* statements run in it */
+  double       start;              /* time it was opened */
+  int          last;               /* statements of the last commit */
+  unsigned long commits, statements;
+} group_commit;
+
+
+/*
+** Deadline of the statements of a connection, checked by a progress
+** handler installed the first time a deadline is set.
+*/
+typedef struct
+{
+  double       timeout;            /* seconds, 0 for no deadline */
+  double       expires;            /* deadline of the running step, or 0 */
+  short        timedout;           /* the last step missed its deadline */
+  short        installed;          /* the progress handler is installed */
+} query_deadline;
+
+
+/*
+** Value of a parameter or of a column of a query run by a read pool or
+** kept by the result cache.  The rows of a query are kept in a buffer
+** of encoded values: a type byte followed by an integer, a double, or a
+** length and the bytes.
+*/
+typedef struct
+{
+  int          type;               /* SQLITE_INTEGER, SQLITE_TEXT, ... */
+  sqlite3_int64 i;
+  double       d;
+  const char   *s;
+  size_t       len;
+} pooled_value;
+
+
+typedef struct
+{
+  unsigned char *data;
+  size_t       size, capacity;
+} value_buffer;
+
+
+/*
+** Cached result of a query, keyed by its SQL text with the values of
+** its parameters.  It is shared by the cache and the cursors replaying
+** it, and freed by the last one.
+*/
+typedef struct result_entry
+{
+  char         *key;
+  size_t       len;
+  unsigned int hash;
+  char         *tables;            /* names of the tables read, each ended
+				      by a '\0', and a final '\0' */
+  int          ncols, nrows;
+  value_buffer columns;            /* name and declared type of each column */
+  value_buffer rows;
+  size_t       bytes;              /* memory used by the entry */
+  int          refs;
+  struct result_entry *prev, *next;
+} result_entry;
+
+
+/*
+** Results of the queries of a connection, most recently used first,
+** bounded by their size in bytes.  Writes reported by the update hook
+** discard the results read from the tables written.
+*/
+typedef struct
+{
+  size_t       capacity;           /* 0 when the cache is disabled */
+  size_t       size;
+  int          entries;
+  result_entry *first, *last;
+  int          changes;            /* total changes seen by the update hook */
+  short        schema;             /* the schema may have changed */
+  short        cacheable;          /* the statement being compiled can be cached */
+  value_buffer *reads;             /* tables read by that statement */
+  sqlite3_stmt *version;           /* PRAGMA data_version, or NULL */
+  sqlite3_int64 data_version;      /* when the results were checked */
+  unsigned long generation;        /* incremented by every write */
+  unsigned long hits, misses, evictions, invalidations;
+} result_cache;
+
+
+#define JOB_QUEUED	0
+#define JOB_RUNNING	1
+#define JOB_DONE	2
+
+/*
+** Query submitted to a read pool.  Its fields are only written by the
+** worker running it until it is done; 'state' is guarded by the lock
+** of the pool.
+*/
+typedef struct read_job
+{
+  struct read_pool *pool;
+  char         *sql;
+  value_buffer params;             /* positional values, then name/value */
+  int          npositional, nnamed;
+  int          state;
+  int          orphan;             /* the job object was collected */
+  char         *errmsg;            /* NULL on success */
+  int          ncols, nrows;
+  value_buffer names, rows;
+  struct read_job *next;           /* next queued job */
+} read_job;
+
+
+typedef struct
+{
+  struct read_pool *pool;
+  sqlite3      *db;                /* read-only connection of the worker */
+  sys_thread   thread;
+} read_worker;
+
+
+/*
+** Workers of a read pool and their queue of jobs.  It is released with
+** the last of the pool object and its jobs.
+*/
+typedef struct read_pool
+{
+  int          refs;
+  int          stop;
+  int          nthreads;
+  read_worker  *workers;
+  read_job     *first, *last;      /* queued jobs */
+  sys_mutex    lock;
+  sys_cond     work;               /* a job was queued */
+  sys_cond     done;               /* a job is done */
+} read_pool;
+
+
+typedef struct
+{
+  short        closed;
+  int          env;                /* reference to environment */
+  read_pool    *pool;
+} pool_data;
+
+
+typedef struct
+{
+  read_job     *job;               /* NULL once collected */
+} job_data;
+
+
 typedef struct
 {
   short        closed;
@@ -41,9 +426,57 @@ typedef struct
   short        auto_commit;        /* 0 for manual commit */
   unsigned int cur_counter;          
   sqlite3      *sql_conn;
+  struct stmt_data *statements;    /* list of prepared statements */
+  struct blob_data *blobs;         /* list of open blob handles */
+  struct backup_data *backups;     /* list of backups read from it */
+  stmt_cache   cache;              /* compiled statements of conn:execute */
+  profile_data *profile;           /* NULL when profiling is disabled */
+  checkpointer *checkpointer;      /* NULL when checkpoints are inline */
+  group_commit group;
+  query_deadline deadline;
+  result_cache results;
+  short        compat;             /* 1 for the luasql.sqlite API */
 } conn_data;
 
 
+typedef struct stmt_data
+{
+  short        closed;
+  short        busy;               /* a cursor is reading its results */
+  int          conn;               /* reference to connection */
+  conn_data    *conn_data;         /* reference to connection for statement */
+  sqlite3_stmt *sql_vm;
+  struct stmt_data *next;          /* next statement of the connection */
+} stmt_data;
+
+
+typedef struct blob_data
+{
+  short        closed;
+  int          conn;               /* reference to connection */
+  conn_data    *conn_data;         /* reference to connection for blob */
+  sqlite3_blob *blob;
+  int          offset;             /* position of the next read or write */
+  struct blob_data *next;          /* next blob handle of the connection */
+} blob_data;
+
+
+typedef struct backup_data
+{
+  short        closed;
+  int          conn;               /* reference to source connection */
+  int          dest;               /* reference to destination connection */
+  conn_data    *conn_data;         /* source connection */
+  conn_data    *dest_data;         /* destination, NULL if opened by path */
+  sqlite3      *dest_db;
+  sqlite3_backup *backup;
+  int          pages_per_step;
+  int          sleep_ms;           /* pause between steps of backup:run */
+  int          progress;           /* reference to progress function */
+  struct backup_data *next;        /* next backup of the source connection */
+} backup_data;
+
+
 typedef struct
 {
   short       closed;
@@ -51,11 +484,25 @@ typedef struct
   int         numcols;            /* number of columns */
   int         colnames, coltypes; /* reference to column information tables */
   conn_data   *conn_data;         /* reference to connection for cursor */
+  short       compat;             /* 1 to fetch every value as a string */
+  int         stmt;               /* reference to statement owning sql_vm */
+  stmt_data   *stmt_data;         /* NULL if the cursor owns sql_vm */
   sqlite3_stmt  *sql_vm;
+  int         pending;            /* result of the first step, not fetched yet */
+  double      expires;            /* deadline of the statement, or 0 */
+  result_entry *replay;           /* cached result replayed, or NULL */
+  const unsigned char *next;      /* next value of the replayed result */
+  int         row;                /* rows replayed */
+  pooled_value *values;           /* values of the current replayed row */
+  result_entry *capture;          /* result being cached, or NULL */
+  unsigned long generation;       /* of the cache when the capture started */
   char			*modestring;
 } cur_data;
 
 LUASQL_API int luaopen_luasql_sqlite3(lua_State *L);
+#ifdef LUASQL_SQLITE_COMPAT
+LUASQL_API int luaopen_luasql_sqlite(lua_State *L);
+#endif
 
 
 /*
@@ -69,6 +516,68 @@ static env_data *getenvironment(lua_State *L) {
 }
 
 
+/*
+** Returns the time in seconds of a monotonic clock.
+*/
+static double monotonic_time(void)
+{
+#ifdef _WIN32
+  LARGE_INTEGER count, freq;
+  QueryPerformanceCounter(&count);
+  QueryPerformanceFrequency(&freq);
+  return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+
+/*
+** Commits the implicit transaction of the group commit, if open.
+** Return SQLITE_OK or the error of COMMIT, which leaves it open.
+*/
+static int group_flush(conn_data *conn)
+{
+  group_commit *group = &conn->group;
+  int res;
+
+  if (!group->open)
+    return SQLITE_OK;
+  if (sqlite3_get_autocommit(conn->sql_conn))
+    {
+      /* rolled back by an error (or by the application) */
+      group->open = group->pending = 0;
+      return SQLITE_OK;
+    }
+  res = sqlite3_exec(conn->sql_conn, "COMMIT", NULL, NULL, NULL);
+  if (res == SQLITE_OK)
+    {
+      group->commits++;
+      group->statements += group->pending;
+      group->last = group->pending;
+      group->open = group->pending = 0;
+    }
+  return res;
+}
+
+
+/*
+** Commits the implicit transaction of the group commit once it is
+** older than max_ms, so that a connection left idle after a write does
+** not keep it (and the write lock) open until its next statement.
+** Errors are left to the next commit.
+*/
+static void group_expire(conn_data *conn)
+{
+  group_commit *group = &conn->group;
+  if (group->open && group->max_ms > 0
+      && (monotonic_time() - group->start) * 1e3 >= group->max_ms)
+    group_flush(conn);
+}
+
+
 /*
 ** Check for valid connection.
 */
@@ -76,6 +585,7 @@ static conn_data *getconnection(lua_State *L) {
   conn_data *conn = (conn_data *)luaL_checkudata (L, 1, LUASQL_CONNECTION_SQLITE);
   luaL_argcheck(L, conn != NULL, 1, LUASQL_PREFIX"connection expected");
   luaL_argcheck(L, !conn->closed, 1, LUASQL_PREFIX"connection is closed");
+  group_expire(conn);
   return conn;
 }
 
@@ -90,223 +600,4435 @@ static cur_data *getcursor(lua_State *L) {
   return cur;
 }
 
+
 /*
-** Finalizes the vm
-** Return nil + errmsg or nil in case of sucess
+** Check for valid statement.
 */
-static int finalize(lua_State *L, cur_data *cur) {
-  const char *errmsg;
-  if (sqlite3_finalize(cur->sql_vm) != SQLITE_OK)
-    {
-      errmsg = sqlite3_errmsg(cur->conn_data->sql_conn);
-      cur->sql_vm = NULL;
-      lua_pushnil(L);
-      lua_pushliteral(L, LUASQL_PREFIX);
-      lua_pushstring(L, errmsg);
-      lua_concat(L, 2);
-      return 2;
-    }
-  cur->sql_vm = NULL;
-  lua_pushnil(L);
-  return 1;
+static stmt_data *getstatement(lua_State *L) {
+  stmt_data *stmt = (stmt_data *)luaL_checkudata (L, 1, LUASQL_STATEMENT_SQLITE);
+  luaL_argcheck(L, stmt != NULL, 1, LUASQL_PREFIX"statement expected");
+  luaL_argcheck(L, !stmt->closed, 1, LUASQL_PREFIX"statement is closed");
+  return stmt;
 }
 
 
-static void push_column(lua_State *L, sqlite3_stmt *vm, int column) {
-  switch (sqlite3_column_type(vm, column)) {
-  case SQLITE_INTEGER:
-    lua_pushinteger(L, sqlite3_column_int64(vm, column));
-    break;
-  case SQLITE_FLOAT:
-    lua_pushnumber(L, sqlite3_column_double(vm, column));
-    break;
-  case SQLITE_TEXT:
-    lua_pushlstring(L, sqlite3_column_text(vm, column),
-		    sqlite3_column_bytes(vm, column));
-    break;
-  case SQLITE_BLOB:
-    lua_pushlstring(L, sqlite3_column_blob(vm, column),
-		    sqlite3_column_bytes(vm, column));
-    break;
-  case SQLITE_NULL:
-    lua_pushnil(L);
-    break;
-  default:
-    luaL_error(L, LUASQL_PREFIX"Unrecognized column type");
-    break;
-  }
-}
-
 /*
-** Get another row of the given cursor.
+** Hash function for the SQL text of cached statements (FNV-1a).
 */
-static int cur_fetch (lua_State *L) {
-  cur_data *cur = getcursor(L);
-  sqlite3_stmt *vm = cur->sql_vm;
-  int res;
-
-  if (vm == NULL)
-    return 0;
+static unsigned int cache_hash(const char *sql, size_t len) {
+  unsigned int h = 2166136261u;
+  size_t i;
+  for (i = 0; i < len; i++)
+    h = (h ^ (unsigned char)sql[i]) * 16777619u;
+  return h;
+}
 
-  res = sqlite3_step(vm);
 
-  /* no more results? */
-  if (res == SQLITE_DONE)
-    return finalize(L, cur);
+static void cache_unlink(stmt_cache *cache, cache_entry *e) {
+  cache_entry **p = &cache->buckets[e->hash & (cache->nbuckets - 1)];
+  while (*p != e)
+    p = &(*p)->chain;
+  *p = e->chain;
+  if (e->prev) e->prev->next = e->next; else cache->first = e->next;
+  if (e->next) e->next->prev = e->prev; else cache->last = e->prev;
+  cache->size--;
+}
 
-  if (res != SQLITE_ROW)
-    return finalize(L, cur);
 
-  if (lua_istable (L, 2))
+/*
+** Finalizes the least recently used statements until the cache fits
+** in 'capacity' entries.
+*/
+static void cache_trim(stmt_cache *cache, int capacity) {
+  while (cache->size > capacity)
     {
-      int i;
-      const char *opts = luasql_getfetchmodestring( L, cur->modestring );
-
-      if (strchr(opts, 'n') != NULL)
-        {
-	  /* Copy values to numerical indices */
-	  for (i = 0; i < cur->numcols;)
-            {
-	      push_column(L, vm, i);
-	      lua_rawseti(L, 2, ++i);
-	    }
-        }
-      if (strchr(opts, 'a') != NULL)
-        {
-	  /* Copy values to alphanumerical indices */
-	  lua_rawgeti(L, LUA_REGISTRYINDEX, cur->colnames);
-
-	  for (i = 0; i < cur->numcols; i++)
-            {
-	      lua_rawgeti(L, -1, i+1);
-	      push_column(L, vm, i);
-	      lua_rawset (L, 2);
-	    }
-        }
-      lua_pushvalue(L, 2);
-      return 1; /* return table */
+      cache_entry *e = cache->last;
+      cache_unlink(cache, e);
+      sqlite3_finalize(e->vm);
+      free(e);
+      cache->evictions++;
     }
-  else
+  if (capacity == 0)
     {
-      int i;
-      luaL_checkstack (L, cur->numcols, LUASQL_PREFIX"too many columns");
-      for (i = 0; i < cur->numcols; ++i)
-	push_column(L, vm, i);
-      return cur->numcols; /* return #numcols values */
+      free(cache->buckets);
+      cache->buckets = NULL;
+      cache->nbuckets = 0;
     }
 }
 
 
 /*
-** Close the cursor on top of the stack.
-** Return 1
+** Look for the entry of the given SQL text.
 */
-static int cur_close(lua_State *L)
-{
-  conn_data *conn;
-  cur_data *cur = (cur_data *)luaL_checkudata(L, 1, LUASQL_CURSOR_SQLITE);
-  luaL_argcheck(L, cur != NULL, 1, LUASQL_PREFIX"cursor expected");
-  if (cur->closed) {
-    lua_pushboolean(L, 0);
-    return 1;
-  }
-
-  /* Nullify structure fields. */
-  cur->closed = 1;
-  sqlite3_finalize(cur->sql_vm);
-  /* Decrement cursor counter on connection object */
-  lua_rawgeti (L, LUA_REGISTRYINDEX, cur->conn);
-  conn = lua_touserdata (L, -1);
-  conn->cur_counter--;
-
-  luaL_unref(L, LUA_REGISTRYINDEX, cur->conn);
-  luaL_unref(L, LUA_REGISTRYINDEX, cur->colnames);
-  luaL_unref(L, LUA_REGISTRYINDEX, cur->coltypes);
-
-  lua_pushboolean(L, 1);
-  return 1;
+static cache_entry *cache_find(stmt_cache *cache, const char *sql,
+			       size_t len, unsigned int hash) {
+  cache_entry *e;
+  if (cache->nbuckets == 0)
+    return NULL;
+  for (e = cache->buckets[hash & (cache->nbuckets - 1)]; e != NULL; e = e->chain)
+    if (e->hash == hash && e->len == len && memcmp(e->sql, sql, len) == 0)
+      return e;
+  return NULL;
 }
 
 
 /*
-** Return the list of field names.
+** Doubles the buckets of the cache when it has as many entries.
+** Return 0 if out of memory.
 */
-static int cur_getcolnames(lua_State *L)
-{
-  cur_data *cur = getcursor(L);
-  lua_rawgeti(L, LUA_REGISTRYINDEX, cur->colnames);
+static int cache_grow(stmt_cache *cache) {
+  unsigned int n = cache->nbuckets ? cache->nbuckets * 2 : 16;
+  cache_entry **buckets;
+  cache_entry *e;
+  if ((unsigned int)cache->size < cache->nbuckets)
+    return 1;
+  buckets = (cache_entry **)calloc(n, sizeof(cache_entry *));
+  if (buckets == NULL)
+    return cache->nbuckets != 0;
+  for (e = cache->first; e != NULL; e = e->next)
+    {
+      e->chain = buckets[e->hash & (n - 1)];
+      buckets[e->hash & (n - 1)] = e;
+    }
+  free(cache->buckets);
+  cache->buckets = buckets;
+  cache->nbuckets = n;
   return 1;
 }
 
 
 /*
-** Return the list of field types.
+** Takes a compiled statement for the given SQL text out of the cache.
+** Return NULL if there is none.
 */
-static int cur_getcoltypes(lua_State *L)
+static sqlite3_stmt *cache_get(conn_data *conn, const char *sql, size_t len) {
+  stmt_cache *cache = &conn->cache;
+  unsigned int hash;
+  cache_entry *e;
+  if (cache->capacity == 0)
+    return NULL;
+  hash = cache_hash(sql, len);
+  e = cache_find(cache, sql, len, hash);
+  if (e != NULL)
+    {
+      sqlite3_stmt *vm = e->vm;
+      cache_unlink(cache, e);
+      free(e);
+      cache->hits++;
+      return vm;
+    }
+  cache->misses++;
+  return NULL;
+}
+
+
+/*
+** Gives back a statement taken from the cache or compiled by
+** conn:execute.  It is reset and kept as the most recently used entry,
+** or finalized if the cache is disabled or already has one for its text.
+** Return the result of sqlite3_reset (or sqlite3_finalize).
+*/
+static int cache_release(conn_data *conn, sqlite3_stmt *vm) {
+  stmt_cache *cache = &conn->cache;
+  const char *sql;
+  cache_entry *e;
+  int res;
+  if (cache->capacity == 0 || (sql = sqlite3_sql(vm)) == NULL)
+    return sqlite3_finalize(vm);
+  res = sqlite3_reset(vm);
+  sqlite3_clear_bindings(vm);
+  e = (cache_entry *)malloc(sizeof(cache_entry));
+  if (e == NULL || !cache_grow(cache))
+    {
+      free(e);
+      sqlite3_finalize(vm);
+      return res;
+    }
+  e->sql = sql;
+  e->len = strlen(sql);
+  e->hash = cache_hash(sql, e->len);
+  e->vm = vm;
+  /* keep only one statement for each text */
+  if (cache_find(cache, sql, e->len, e->hash) != NULL)
+    {
+      sqlite3_finalize(vm);
+      free(e);
+      return res;
+    }
+  e->chain = cache->buckets[e->hash & (cache->nbuckets - 1)];
+  cache->buckets[e->hash & (cache->nbuckets - 1)] = e;
+  e->prev = NULL;
+  e->next = cache->first;
+  if (cache->first) cache->first->prev = e; else cache->last = e;
+  cache->first = e;
+  cache->size++;
+  cache_trim(cache, cache->capacity);
+  return res;
+}
+
+
+/*
+** Check for valid blob handle.
+*/
+static blob_data *getblob(lua_State *L) {
+  blob_data *blob = (blob_data *)luaL_checkudata (L, 1, LUASQL_BLOB_SQLITE);
+  luaL_argcheck(L, blob != NULL, 1, LUASQL_PREFIX"blob expected");
+  luaL_argcheck(L, !blob->closed, 1, LUASQL_PREFIX"blob is closed");
+  return blob;
+}
+
+
+/*
+** Check for valid backup.
+*/
+static backup_data *getbackup(lua_State *L) {
+  backup_data *backup = (backup_data *)luaL_checkudata (L, 1, LUASQL_BACKUP_SQLITE);
+  luaL_argcheck(L, backup != NULL, 1, LUASQL_PREFIX"backup expected");
+  luaL_argcheck(L, !backup->closed, 1, LUASQL_PREFIX"backup is closed");
+  return backup;
+}
+
+
+/*
+** Progress handler of a connection: stops the running step once its
+** deadline has passed.
+*/
+static int deadline_handler(void *arg)
+{
+  query_deadline *deadline = &((conn_data *)arg)->deadline;
+  if (deadline->expires > 0 && monotonic_time() >= deadline->expires)
+    {
+      deadline->timedout = 1;
+      return 1;
+    }
+  return 0;
+}
+
+
+/*
+** Returns the deadline of a statement starting now with the given
+** timeout in seconds, or 0 if there is none.
+*/
+static double deadline_start(conn_data *conn, double timeout)
+{
+  if (timeout <= 0)
+    return 0;
+  if (!conn->deadline.installed)
+    {
+      sqlite3_progress_handler(conn->sql_conn, DEADLINE_OPS,
+			       deadline_handler, conn);
+      conn->deadline.installed = 1;
+    }
+  return monotonic_time() + timeout;
+}
+
+
+/*
+** Runs a step of a statement with the given deadline.  A statement
+** already past its deadline is not stepped.
+*/
+static int deadline_step(conn_data *conn, sqlite3_stmt *vm, double expires)
+{
+  int res;
+  conn->deadline.timedout = 0;
+  if (expires > 0 && monotonic_time() >= expires)
+    {
+      conn->deadline.timedout = 1;
+      return SQLITE_INTERRUPT;
+    }
+  conn->deadline.expires = expires;
+  res = sqlite3_step(vm);
+  conn->deadline.expires = 0;
+  return res;
+}
+
+
+/*
+** Returns the message of the last error of the connection: "timeout"
+** if a statement missed its deadline.
+*/
+static const char *error_message(conn_data *conn)
+{
+  if (conn->deadline.timedout)
+    {
+      conn->deadline.timedout = 0;
+      return "timeout";
+    }
+  return sqlite3_errmsg(conn->sql_conn);
+}
+
+
+/*
+** Grows a value buffer to hold 'len' more bytes.
+** Return 0 if out of memory.
+*/
+static int buffer_reserve(value_buffer *b, size_t len)
+{
+  if (b->size + len > b->capacity)
+    {
+      size_t capacity = b->capacity > 0 ? b->capacity : 256;
+      unsigned char *data;
+      while (capacity < b->size + len)
+        capacity *= 2;
+      data = (unsigned char *)realloc(b->data, capacity);
+      if (data == NULL)
+        return 0;
+      b->data = data;
+      b->capacity = capacity;
+    }
+  return 1;
+}
+
+
+/*
+** Appends a value to a buffer.
+** Return 0 if out of memory.
+*/
+static int value_encode(value_buffer *b, const pooled_value *v)
+{
+  unsigned char *p;
+  size_t len = 1;
+
+  if (v->type == SQLITE_TEXT || v->type == SQLITE_BLOB)
+    len += sizeof(size_t) + v->len;
+  else if (v->type != SQLITE_NULL)
+    len += sizeof(sqlite3_int64);
+  if (!buffer_reserve(b, len))
+    return 0;
+
+  p = b->data + b->size;
+  *p++ = (unsigned char)v->type;
+  switch (v->type) {
+  case SQLITE_INTEGER:
+    memcpy(p, &v->i, sizeof(v->i));
+    break;
+  case SQLITE_FLOAT:
+    memcpy(p, &v->d, sizeof(v->d));
+    break;
+  case SQLITE_TEXT:
+  case SQLITE_BLOB:
+    memcpy(p, &v->len, sizeof(size_t));
+    if (v->len > 0)
+      memcpy(p + sizeof(size_t), v->s, v->len);
+    break;
+  }
+  b->size += len;
+  return 1;
+}
+
+
+/*
+** Reads the value at 'p'.
+** Return the position of the next value.
+*/
+static const unsigned char *value_decode(const unsigned char *p,
+					 pooled_value *v)
+{
+  v->type = *p++;
+  switch (v->type) {
+  case SQLITE_INTEGER:
+    memcpy(&v->i, p, sizeof(v->i));
+    return p + sizeof(v->i);
+  case SQLITE_FLOAT:
+    memcpy(&v->d, p, sizeof(v->d));
+    return p + sizeof(v->d);
+  case SQLITE_TEXT:
+  case SQLITE_BLOB:
+    memcpy(&v->len, p, sizeof(size_t));
+    v->s = (const char *)p + sizeof(size_t);
+    return p + sizeof(size_t) + v->len;
+  }
+  return p;
+}
+
+
+/*
+** Reads column 'i' of the current row of a statement.  Text and blobs
+** point into the statement.
+*/
+static void value_column(sqlite3_stmt *vm, int i, pooled_value *v)
+{
+  v->type = sqlite3_column_type(vm, i);
+  switch (v->type) {
+  case SQLITE_INTEGER:
+    v->i = sqlite3_column_int64(vm, i);
+    break;
+  case SQLITE_FLOAT:
+    v->d = sqlite3_column_double(vm, i);
+    break;
+  case SQLITE_TEXT:
+    v->s = (const char *)sqlite3_column_text(vm, i);
+    v->len = sqlite3_column_bytes(vm, i);
+    break;
+  case SQLITE_BLOB:
+    v->s = (const char *)sqlite3_column_blob(vm, i);
+    v->len = sqlite3_column_bytes(vm, i);
+    break;
+  }
+}
+
+
+/*
+** Pushes a value, converted as by push_column.
+*/
+static void value_push(lua_State *L, const pooled_value *v)
+{
+  switch (v->type) {
+  case SQLITE_INTEGER:
+    lua_pushinteger(L, v->i);
+    break;
+  case SQLITE_FLOAT:
+    lua_pushnumber(L, v->d);
+    break;
+  case SQLITE_TEXT:
+  case SQLITE_BLOB:
+    lua_pushlstring(L, v->s, v->len);
+    break;
+  default:
+    lua_pushnil(L);
+    break;
+  }
+}
+
+
+/*
+** Releases a reference to a cached result.
+*/
+static void results_unref(result_entry *e)
+{
+  if (--e->refs > 0)
+    return;
+  free(e->rows.data);
+  free(e->columns.data);
+  free(e->tables);
+  free(e->key);
+  free(e);
+}
+
+
+static void results_remove(result_cache *r, result_entry *e)
+{
+  if (e->prev) e->prev->next = e->next; else r->first = e->next;
+  if (e->next) e->next->prev = e->prev; else r->last = e->prev;
+  r->size -= e->bytes;
+  r->entries--;
+  results_unref(e);
+}
+
+
+/*
+** Discards the cached results, and the results being cached.
+*/
+static void results_clear(result_cache *r)
+{
+  while (r->first != NULL)
+    results_remove(r, r->first);
+  r->generation++;
+}
+
+
+/*
+** Update hook: discards the results read from the table written.
+*/
+static void results_update(void *arg, int op, const char *db,
+			   const char *table, sqlite3_int64 rowid)
+{
+  result_cache *r = (result_cache *)arg;
+  result_entry *e, *next;
+  (void)op; (void)db; (void)rowid;
+
+  r->changes++;
+  r->generation++;
+  for (e = r->first; e != NULL; e = next)
+    {
+      const char *t;
+      next = e->next;
+      for (t = e->tables; *t != '\0'; t += strlen(t) + 1)
+        if (sqlite3_stricmp(t, table) == 0)
+          {
+            r->invalidations++;
+            results_remove(r, e);
+            break;
+          }
+    }
+}
+
+
+/*
+** Rollback hook: the results may have been read from rolled back
+** writes.
+*/
+static void results_rollback(void *arg)
+{
+  result_cache *r = (result_cache *)arg;
+  r->invalidations += r->entries;
+  results_clear(r);
+}
+
+
+/*
+** Built-in functions whose results change between calls.
+*/
+static const char *const volatile_functions[] = {
+  "random", "randomblob", "changes", "total_changes", "last_insert_rowid",
+  "date", "time", "datetime", "julianday", "unixepoch", "strftime",
+  "timediff", "current_date", "current_time", "current_timestamp", NULL
+};
+
+
+/*
+** Authorizer installed while the cache is enabled: it collects the
+** tables read by a statement being compiled for the cache, and notes
+** the statements changing the schema.
+*/
+static int results_authorizer(void *arg, int action, const char *a,
+			      const char *b, const char *db, const char *view)
+{
+  result_cache *r = (result_cache *)arg;
+  int i;
+  (void)db; (void)view;
+
+  switch (action) {
+  case SQLITE_READ:
+    if (r->reads != NULL && a != NULL)
+      {
+        const char *t, *end = (const char *)r->reads->data + r->reads->size;
+        size_t len = strlen(a) + 1;
+        for (t = (const char *)r->reads->data; t < end; t += strlen(t) + 1)
+          if (strcmp(t, a) == 0)
+            return SQLITE_OK;
+        if (!buffer_reserve(r->reads, len))
+          r->cacheable = 0;
+        else
+          {
+            memcpy(r->reads->data + r->reads->size, a, len);
+            r->reads->size += len;
+          }
+      }
+    break;
+  case SQLITE_FUNCTION:
+    if (r->reads != NULL)
+      for (i = 0; volatile_functions[i] != NULL; i++)
+        if (sqlite3_stricmp(b, volatile_functions[i]) == 0)
+          r->cacheable = 0;
+    break;
+  case SQLITE_ALTER_TABLE:
+  case SQLITE_DROP_TABLE:
+  case SQLITE_DROP_TEMP_TABLE:
+  case SQLITE_DROP_VIEW:
+  case SQLITE_DROP_TEMP_VIEW:
+  case SQLITE_DROP_VTABLE:
+  case SQLITE_ATTACH:
+  case SQLITE_DETACH:
+    r->schema = 1;
+    break;
+  }
+  return SQLITE_OK;
+}
+
+
+/*
+** Return the data version of the main database, which changes when
+** another connection commits a write, or -1 if it cannot be read.
+*/
+static sqlite3_int64 results_version(conn_data *conn)
+{
+  result_cache *r = &conn->results;
+  sqlite3_int64 version = -1;
+
+  if (r->version == NULL
+      && sqlite3_prepare_v2(conn->sql_conn, "PRAGMA data_version", -1,
+			    &r->version, NULL) != SQLITE_OK)
+    return -1;
+  if (conn->profile != NULL)
+    conn->profile->internal = r->version;
+  if (sqlite3_step(r->version) == SQLITE_ROW)
+    version = sqlite3_column_int64(r->version, 0);
+  sqlite3_reset(r->version);
+  return version;
+}
+
+
+/*
+** Discards every result if the schema may have changed, if rows were
+** changed without the update hook seeing them (a DELETE without WHERE,
+** a WITHOUT ROWID table) or if another connection wrote to the
+** database.
+*/
+static void results_check(conn_data *conn)
+{
+  result_cache *r = &conn->results;
+  int changes = sqlite3_total_changes(conn->sql_conn);
+  sqlite3_int64 version = results_version(conn);
+
+  if (r->schema || changes != r->changes || version != r->data_version
+      || version == -1)
+    {
+      r->invalidations += r->entries;
+      results_clear(r);
+      r->schema = 0;
+      r->changes = changes;
+      r->data_version = version;
+    }
+}
+
+
+/*
+** Enables the result cache with a capacity of 'capacity' bytes, or
+** disables it if it is 0.  The cached results are discarded.
+*/
+static void results_configure(conn_data *conn, double capacity)
+{
+  result_cache *r = &conn->results;
+  sqlite3 *db = conn->sql_conn;
+
+  r->capacity = capacity > 0 ? (size_t)capacity : 0;
+  results_clear(r);
+  if (r->capacity > 0)
+    {
+      sqlite3_update_hook(db, results_update, r);
+      sqlite3_rollback_hook(db, results_rollback, r);
+      sqlite3_set_authorizer(db, results_authorizer, r);
+      r->changes = sqlite3_total_changes(db);
+      r->data_version = results_version(conn);
+      r->schema = 0;
+    }
+  else
+    {
+      sqlite3_update_hook(db, NULL, NULL);
+      sqlite3_rollback_hook(db, NULL, NULL);
+      sqlite3_set_authorizer(db, NULL, NULL);
+      sqlite3_finalize(r->version);
+      r->version = NULL;
+    }
+}
+
+
+/*
+** Looks up the cached result of a query, keeping it as the most
+** recently used one.
+** Return NULL if there is none.
+*/
+static result_entry *results_get(conn_data *conn, const char *key,
+				 size_t len)
+{
+  result_cache *r = &conn->results;
+  unsigned int hash;
+  result_entry *e;
+
+  results_check(conn);
+  hash = cache_hash(key, len);
+  for (e = r->first; e != NULL; e = e->next)
+    if (e->hash == hash && e->len == len && memcmp(e->key, key, len) == 0)
+      {
+        if (e != r->first)
+          {
+            e->prev->next = e->next;
+            if (e->next) e->next->prev = e->prev; else r->last = e->prev;
+            e->prev = NULL;
+            e->next = r->first;
+            r->first->prev = e;
+            r->first = e;
+          }
+        r->hits++;
+        return e;
+      }
+  return NULL;
+}
+
+
+/*
+** Starts caching the result of a query, once the tables it reads are
+** known: the statement is compiled again with the authorizer collecting
+** them.
+** Return NULL if the query cannot be cached (it reads no table, a
+** virtual table of the connection or calls a volatile function).
+*/
+static result_entry *results_begin(conn_data *conn, const char *key,
+				   size_t len, sqlite3_stmt *vm)
+{
+  result_cache *r = &conn->results;
+  value_buffer reads = {NULL, 0, 0};
+  sqlite3_stmt *probe = NULL;
+  result_entry *e;
+  int i;
+
+  r->reads = &reads;
+  r->cacheable = 1;
+  if (sqlite3_prepare_v2(conn->sql_conn, sqlite3_sql(vm), -1, &probe, NULL)
+      != SQLITE_OK)
+    r->cacheable = 0;
+  sqlite3_finalize(probe);
+  r->reads = NULL;
+  if (!r->cacheable || reads.size == 0 || !buffer_reserve(&reads, 1)
+      || (e = (result_entry *)malloc(sizeof(result_entry))) == NULL)
+    {
+      free(reads.data);
+      return NULL;
+    }
+  reads.data[reads.size++] = '\0';
+
+  e->key = (char *)malloc(len);
+  e->len = len;
+  e->hash = cache_hash(key, len);
+  e->tables = (char *)reads.data;
+  e->ncols = sqlite3_column_count(vm);
+  e->nrows = 0;
+  e->columns.data = e->rows.data = NULL;
+  e->columns.size = e->columns.capacity = 0;
+  e->rows.size = e->rows.capacity = 0;
+  e->bytes = sizeof(result_entry) + len + reads.size;
+  e->refs = 1;
+  e->prev = e->next = NULL;
+  if (e->key == NULL)
+    {
+      results_unref(e);
+      return NULL;
+    }
+  memcpy(e->key, key, len);
+  for (i = 0; i < e->ncols; i++)
+    {
+      pooled_value v;
+      v.s = sqlite3_column_name(vm, i);
+      v.type = SQLITE_TEXT;
+      v.len = strlen(v.s);
+      if (!value_encode(&e->columns, &v))
+        break;
+      v.s = sqlite3_column_decltype(vm, i);
+      v.type = v.s != NULL ? SQLITE_TEXT : SQLITE_NULL;
+      v.len = v.s != NULL ? strlen(v.s) : 0;
+      if (!value_encode(&e->columns, &v))
+        break;
+    }
+  if (i < e->ncols)
+    {
+      results_unref(e);
+      return NULL;
+    }
+  return e;
+}
+
+
+/*
+** Appends the current row of a cursor to the result it is caching.
+** Return 0 if out of memory or if the result outgrows the cache.
+*/
+static int results_row(cur_data *cur)
+{
+  result_entry *e = cur->capture;
+  int i;
+
+  for (i = 0; i < e->ncols; i++)
+    {
+      pooled_value v;
+      value_column(cur->sql_vm, i, &v);
+      if (!value_encode(&e->rows, &v))
+        return 0;
+    }
+  e->nrows++;
+  return e->bytes + e->columns.size + e->rows.size
+    <= cur->conn_data->results.capacity;
+}
+
+
+/*
+** Stores the result cached by a cursor which read all of its rows,
+** unless the tables were written meanwhile.
+*/
+static void results_store(cur_data *cur)
+{
+  conn_data *conn = cur->conn_data;
+  result_cache *r = &conn->results;
+  result_entry *e = cur->capture, *old;
+
+  cur->capture = NULL;
+  results_check(conn);
+  if (r->capacity == 0 || r->generation != cur->generation)
+    {
+      results_unref(e);
+      return;
+    }
+  if (e->rows.size > 0 && e->rows.size < e->rows.capacity)
+    {
+      unsigned char *data = (unsigned char *)realloc(e->rows.data,
+						     e->rows.size);
+      if (data != NULL)
+        {
+          e->rows.data = data;
+          e->rows.capacity = e->rows.size;
+        }
+    }
+  e->bytes += e->columns.capacity + e->rows.capacity;
+  /* keep only one result for each query */
+  for (old = r->first; old != NULL; old = old->next)
+    if (old->hash == e->hash && old->len == e->len
+	&& memcmp(old->key, e->key, e->len) == 0)
+      {
+        results_remove(r, old);
+        break;
+      }
+  e->next = r->first;
+  if (r->first) r->first->prev = e; else r->last = e;
+  r->first = e;
+  r->size += e->bytes;
+  r->entries++;
+  while (r->size > r->capacity)
+    {
+      r->evictions++;
+      results_remove(r, r->last);
+    }
+}
+
+
+/*
+** Releases the vm of a cursor: a prepared statement is only reset
+** so it can be executed again, otherwise the vm goes back to the
+** statement cache of the connection.
+*/
+static int release_vm(cur_data *cur) {
+  stmt_data *stmt = cur->stmt_data;
+  if (stmt == NULL)
+    return cache_release(cur->conn_data, cur->sql_vm);
+  stmt->busy = 0;
+  if (stmt->closed)
+    return SQLITE_OK;
+  return sqlite3_reset(cur->sql_vm);
+}
+
+/*
+** Closes the cursor and nullify all structure fields.
+*/
+static void cur_nullify(lua_State *L, cur_data *cur)
+{
+  conn_data *conn;
+
+  /* Nullify structure fields. */
+  cur->closed = 1;
+  if (cur->sql_vm != NULL)
+    release_vm(cur);
+  cur->sql_vm = NULL;
+  if (cur->capture != NULL)
+    results_unref(cur->capture);
+  cur->capture = NULL;
+  if (cur->replay != NULL)
+    {
+      results_unref(cur->replay);
+      free(cur->values);
+    }
+  cur->replay = NULL;
+  cur->values = NULL;
+  /* Decrement cursor counter on connection object */
+  lua_rawgeti (L, LUA_REGISTRYINDEX, cur->conn);
+  conn = lua_touserdata (L, -1);
+  conn->cur_counter--;
+  lua_pop(L, 1);
+
+  luaL_unref(L, LUA_REGISTRYINDEX, cur->conn);
+  luaL_unref(L, LUA_REGISTRYINDEX, cur->stmt);
+  luaL_unref(L, LUA_REGISTRYINDEX, cur->colnames);
+  luaL_unref(L, LUA_REGISTRYINDEX, cur->coltypes);
+}
+
+
+/*
+** Finalizes the vm and closes the cursor
+** Return nil + errmsg or nil in case of sucess
+*/
+static int finalize(lua_State *L, cur_data *cur) {
+  const char *errmsg;
+  if (release_vm(cur) != SQLITE_OK || cur->conn_data->deadline.timedout)
+    {
+      errmsg = error_message(cur->conn_data);
+      cur->sql_vm = NULL;
+      lua_pushnil(L);
+      lua_pushliteral(L, LUASQL_PREFIX);
+      lua_pushstring(L, errmsg);
+      lua_concat(L, 2);
+      cur_nullify(L, cur);
+      return 2;
+    }
+  cur->sql_vm = NULL;
+  cur_nullify(L, cur);
+  lua_pushnil(L);
+  return 1;
+}
+
+
+static void push_column(lua_State *L, sqlite3_stmt *vm, int column) {
+  switch (sqlite3_column_type(vm, column)) {
+  case SQLITE_INTEGER:
+    lua_pushinteger(L, sqlite3_column_int64(vm, column));
+    break;
+  case SQLITE_FLOAT:
+    lua_pushnumber(L, sqlite3_column_double(vm, column));
+    break;
+  case SQLITE_TEXT:
+    lua_pushlstring(L, sqlite3_column_text(vm, column),
+		    sqlite3_column_bytes(vm, column));
+    break;
+  case SQLITE_BLOB:
+    lua_pushlstring(L, sqlite3_column_blob(vm, column),
+		    sqlite3_column_bytes(vm, column));
+    break;
+  case SQLITE_NULL:
+    lua_pushnil(L);
+    break;
+  default:
+    luaL_error(L, LUASQL_PREFIX"Unrecognized column type");
+    break;
+  }
+}
+
+/*
+** Pushes a column of the current row of a cursor, read from its vm or
+** from the cached result it replays.
+*/
+static void push_field(lua_State *L, cur_data *cur, int column) {
+  if (cur->compat)
+    {
+      /* SQLite 2 returns every value as a string */
+      char buff[32];
+      if (cur->replay == NULL)
+	{
+	  sqlite3_stmt *vm = cur->sql_vm;
+	  if (sqlite3_column_type(vm, column) == SQLITE_NULL)
+	    lua_pushnil(L);
+	  else
+	    lua_pushlstring(L, (const char *)sqlite3_column_text(vm, column),
+			    sqlite3_column_bytes(vm, column));
+	}
+      else if (cur->values[column].type == SQLITE_INTEGER)
+	lua_pushstring(L, sqlite3_snprintf(sizeof(buff), buff, "%lld",
+					   cur->values[column].i));
+      else if (cur->values[column].type == SQLITE_FLOAT)
+	lua_pushstring(L, sqlite3_snprintf(sizeof(buff), buff, "%!.15g",
+					   cur->values[column].d));
+      else
+	value_push(L, &cur->values[column]);
+    }
+  else if (cur->replay != NULL)
+    value_push(L, &cur->values[column]);
+  else
+    push_column(L, cur->sql_vm, column);
+}
+
+/*
+** Creates the tables with the names and the declared types of the
+** columns of a cursor, the first time they are asked for.
+*/
+static void cur_colinfo(lua_State *L, cur_data *cur)
+{
+  const unsigned char *p = NULL;
+  int i;
+
+  if (cur->colnames != LUA_NOREF)
+    return;
+  if (cur->replay != NULL)
+    p = cur->replay->columns.data;
+  lua_createtable(L, cur->numcols, 0);
+  lua_createtable(L, cur->numcols, 0);
+  for (i = 1; i <= cur->numcols; i++)
+    {
+      if (p != NULL)
+	{
+	  pooled_value v;
+	  p = value_decode(p, &v);
+	  value_push(L, &v);
+	  lua_rawseti(L, -3, i);
+	  p = value_decode(p, &v);
+	  value_push(L, &v);
+	}
+      else
+	{
+	  lua_pushstring(L, sqlite3_column_name(cur->sql_vm, i - 1));
+	  lua_rawseti(L, -3, i);
+	  lua_pushstring(L, sqlite3_column_decltype(cur->sql_vm, i - 1));
+	}
+      lua_rawseti(L, -2, i);
+    }
+  cur->coltypes = luaL_ref(L, LUA_REGISTRYINDEX);
+  cur->colnames = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+/*
+** Get another row of the given cursor.
+*/
+static int cur_fetch (lua_State *L) {
+  cur_data *cur = getcursor(L);
+  sqlite3_stmt *vm = cur->sql_vm;
+  int res;
+
+  if (cur->replay != NULL)
+    {
+      int i;
+      if (cur->row == cur->replay->nrows)
+        {
+          cur_nullify(L, cur);
+          lua_pushnil(L);
+          return 1;
+        }
+      for (i = 0; i < cur->numcols; i++)
+        cur->next = value_decode(cur->next, &cur->values[i]);
+      cur->row++;
+    }
+  else
+    {
+      if (vm == NULL)
+        return 0;
+
+      /* the first step was already run by execute */
+      if (cur->pending)
+        {
+          res = cur->pending;
+          cur->pending = 0;
+        }
+      else
+        res = deadline_step(cur->conn_data, vm, cur->expires);
+
+      /* no more results? */
+      if (res == SQLITE_DONE)
+        {
+          if (cur->capture != NULL)
+            results_store(cur);
+          return finalize(L, cur);
+        }
+
+      if (res != SQLITE_ROW)
+        return finalize(L, cur);
+
+      if (cur->capture != NULL && !results_row(cur))
+        {
+          results_unref(cur->capture);
+          cur->capture = NULL;
+        }
+    }
+
+  if (lua_istable (L, 2))
+    {
+      int i;
+      const char *opts = luasql_getfetchmodestring( L, cur->modestring );
+
+      if (strchr(opts, 'n') != NULL)
+        {
+	  /* Copy values to numerical indices */
+	  for (i = 0; i < cur->numcols;)
+            {
+	      push_field(L, cur, i);
+	      lua_rawseti(L, 2, ++i);
+	    }
+        }
+      if (strchr(opts, 'a') != NULL)
+        {
+	  /* Copy values to alphanumerical indices */
+	  cur_colinfo(L, cur);
+	  lua_rawgeti(L, LUA_REGISTRYINDEX, cur->colnames);
+
+	  for (i = 0; i < cur->numcols; i++)
+            {
+	      lua_rawgeti(L, -1, i+1);
+	      push_field(L, cur, i);
+	      lua_rawset (L, 2);
+	    }
+        }
+      lua_pushvalue(L, 2);
+      return 1; /* return table */
+    }
+  else
+    {
+      int i;
+      luaL_checkstack (L, cur->numcols, LUASQL_PREFIX"too many columns");
+      for (i = 0; i < cur->numcols; ++i)
+	push_field(L, cur, i);
+      return cur->numcols; /* return #numcols values */
+    }
+}
+
+
+/*
+** Close the cursor on top of the stack.
+** Return 1
+*/
+static int cur_close(lua_State *L)
+{
+  cur_data *cur = (cur_data *)luaL_checkudata(L, 1, LUASQL_CURSOR_SQLITE);
+  luaL_argcheck(L, cur != NULL, 1, LUASQL_PREFIX"cursor expected");
+  if (cur->closed) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+
+  cur_nullify(L, cur);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Return the list of field names.
+*/
+static int cur_getcolnames(lua_State *L)
+{
+  cur_data *cur = getcursor(L);
+  cur_colinfo(L, cur);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, cur->colnames);
+  return 1;
+}
+
+
+/*
+** Return the list of field types.
+*/
+static int cur_getcoltypes(lua_State *L)
+{
+  cur_data *cur = getcursor(L);
+  cur_colinfo(L, cur);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, cur->coltypes);
+  return 1;
+}
+
+
+/*
+ * Sets the cursor parameters
+ */
+static void cur_set(lua_State *L) {
+	if( lua_istable( L, 2 ) ) {
+		cur_data *cur = getcursor(L);
+		char *key;
+		lua_pushnil(L);
+
+		while( lua_next(L, 2) != 0 ) {
+			if( lua_isstring(L, -2) ) {
+				key = lua_tostring(L, -2);
+
+				if( strcmp(key, LUASQL_MODESTRING) == 0 ) {
+					if( lua_isstring( L, -1 ) )
+						cur->modestring = lua_tostring( L, -1 );
+				}
+			}
+
+			lua_pop(L, 1);
+		}		
+	}
+}
+
+
+/*
+ * Retrieve the specified cursor parameters
+ */
+static int cur_get( lua_State *L ) {
+	if( lua_istable( L, 2 ) ) {
+		lua_newtable(L);
+		int rsp = lua_gettop(L);
+		cur_data *cur = getcursor(L);
+		char *key;
+		lua_pushnil(L);
+
+		while( lua_next(L, 2) != 0 ) {
+			if( lua_isstring(L, -1) ) {
+				key = lua_tostring(L, -1);
+
+				if( strcmp(key, LUASQL_MODESTRING) == 0 ) {
+					lua_pushstring( L, LUASQL_MODESTRING );
+					lua_pushstring( L, cur->modestring );
+					lua_settable( L, rsp );
+				}
+			}
+
+			lua_pop(L, 1);
+		}
+	} else
+		if( lua_isstring( L, 2 ) ) {
+			const char *key = lua_tostring(L, 2);
+
+			if( strcmp(key, LUASQL_MODESTRING) == 0 ) {
+				cur_data *cur = getcursor(L);
+				lua_pushstring( L, cur->modestring );
+			} else
+				lua_pushnil(L);
+		} else 
+			lua_pushnil(L);
+
+	return 1;
+}
+
+
+/*
+** Create a new Cursor object and push it on top of the stack.
+*/
+/* static int create_cursor(lua_State *L, int conn, sqlite3_stmt *sql_vm,
+   int numcols, const char **row, const char **col_info)*/
+static int create_cursor(lua_State *L, int o, conn_data *conn, 
+			 sqlite3_stmt *sql_vm, int numcols)
+{
+  cur_data *cur = (cur_data*)lua_newuserdata(L, sizeof(cur_data));
+  luasql_setmeta (L, LUASQL_CURSOR_SQLITE);
+
+  /* increment cursor count for the connection creating this cursor */
+  conn->cur_counter++;
+
+  /* fill in structure */
+  cur->closed = 0;
+  cur->conn = LUA_NOREF;
+  cur->numcols = numcols;
+  cur->colnames = LUA_NOREF;
+  cur->coltypes = LUA_NOREF;
+  cur->stmt = LUA_NOREF;
+  cur->stmt_data = NULL;
+  cur->sql_vm = sql_vm;
+  cur->pending = 0;
+  cur->expires = 0;
+  cur->replay = cur->capture = NULL;
+  cur->next = NULL;
+  cur->row = 0;
+  cur->values = NULL;
+  cur->generation = 0;
+  cur->conn_data = conn;
+  cur->compat = conn->compat;
+  cur->modestring = "n";
+
+  /* column information is built by cur_colinfo when asked for */
+  lua_pushvalue(L, o);
+  cur->conn = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+
+/*
+** Create a Cursor object replaying a cached result and push it on top
+** of the stack.
+** Return 0 (and push nothing) if out of memory.
+*/
+static int results_cursor(lua_State *L, int o, conn_data *conn,
+			  result_entry *e)
+{
+  pooled_value *values = NULL;
+  cur_data *cur;
+
+  if (e->ncols > 0
+      && (values = (pooled_value *)malloc(e->ncols * sizeof(pooled_value)))
+	 == NULL)
+    return 0;
+  create_cursor(L, o, conn, NULL, 0);
+  cur = (cur_data *)lua_touserdata(L, -1);
+  cur->numcols = e->ncols;
+  cur->replay = e;
+  cur->next = e->rows.data;
+  cur->values = values;
+  e->refs++;
+  return 1;
+}
+
+
+/*
+** Starts caching the result of the query whose cursor was pushed by
+** execute_vm, if the result cache is enabled.  'generation' is the one
+** of the cache before the query started.
+** Return 'nres', the number of results of execute_vm.
+*/
+static int results_capture(lua_State *L, conn_data *conn, const char *key,
+			   size_t len, unsigned long generation, int nres)
+{
+  cur_data *cur;
+
+  if (conn->results.capacity == 0 || key == NULL || nres != 1
+      || !lua_isuserdata(L, -1))
+    return nres;
+  cur = (cur_data *)lua_touserdata(L, -1);
+  if (!sqlite3_stmt_readonly(cur->sql_vm))
+    return nres;
+  conn->results.misses++;
+  cur->capture = results_begin(conn, key, len, cur->sql_vm);
+  cur->generation = generation;
+  return nres;
+}
+
+
+/*
+** Copies the SQL text to 'out' replacing its string, blob and numeric
+** literals with '?', so that statements differing only by their values
+** share an entry, collapsing the runs of spaces outside of quoted names
+** into one and removing the leading and trailing ones.
+** Return the length of the result.
+*/
+static size_t normalize_sql(const char *sql, char *out)
+{
+  size_t len = 0;
+  char quote = 0;
+  for (; *sql != '\0'; sql++)
+    {
+      unsigned char c = (unsigned char)*sql;
+      /* a literal cannot follow a name or a parameter prefix */
+      int after_name = len > 0 && (isalnum((unsigned char)out[len - 1])
+        || strchr("_$?:@", out[len - 1]) != NULL);
+      if (quote != 0)
+        {
+          if (c == quote)
+            quote = 0;
+          out[len++] = c;
+          continue;
+        }
+      if (isspace(c))
+        {
+          if (len > 0 && out[len - 1] != ' ')
+            out[len++] = ' ';
+          continue;
+        }
+      if (c == '"' || c == '`')
+        quote = c;
+      else if (c == '\'' || ((c == 'x' || c == 'X') && sql[1] == '\''
+                             && !after_name))
+        {
+          /* skip the literal, where '' stands for a quote */
+          const char *p = sql + (c == '\'' ? 1 : 2);
+          while (*p != '\0' && (*p != '\'' || p[1] == '\''))
+            p += *p == '\'' ? 2 : 1;
+          sql = *p == '\0' ? p - 1 : p;
+          out[len++] = '?';
+          continue;
+        }
+      else if ((isdigit(c) || (c == '.' && isdigit((unsigned char)sql[1])))
+               && !after_name)
+        {
+          while (isalnum((unsigned char)sql[1]) || sql[1] == '.'
+                 || ((sql[1] == '+' || sql[1] == '-')
+                     && (*sql == 'e' || *sql == 'E')))
+            sql++;
+          out[len++] = '?';
+          continue;
+        }
+      out[len++] = c;
+    }
+  if (len > 0 && out[len - 1] == ' ')
+    len--;
+  out[len] = '\0';
+  return len;
+}
+
+
+/*
+** Finds (or creates) the profile entry of a normalized SQL text.
+** Return NULL if there is no memory for a new entry.
+*/
+static profile_entry *profile_lookup(profile_data *prof, const char *sql,
+				     size_t len, unsigned int hash)
+{
+  profile_entry *e;
+
+  for (e = prof->buckets[hash % prof->nbuckets]; e != NULL; e = e->next)
+    if (e->hash == hash && e->len == len && memcmp(e->sql, sql, len) == 0)
+      return e;
+
+  if (prof->size >= prof->nbuckets)  /* grow the table */
+    {
+      int n = prof->nbuckets * 2, i;
+      profile_entry **buckets = (profile_entry **)calloc(n, sizeof(profile_entry *));
+      if (buckets != NULL)
+        {
+          for (i = 0; i < prof->nbuckets; i++)
+            while ((e = prof->buckets[i]) != NULL)
+              {
+                prof->buckets[i] = e->next;
+                e->next = buckets[e->hash % n];
+                buckets[e->hash % n] = e;
+              }
+          free(prof->buckets);
+          prof->buckets = buckets;
+          prof->nbuckets = n;
+        }
+    }
+  e = (profile_entry *)malloc(sizeof(profile_entry) + len + 1);
+  if (e == NULL)
+    return NULL;
+  memset(e, 0, sizeof(profile_entry));
+  e->sql = (char *)(e + 1);
+  memcpy(e->sql, sql, len + 1);
+  e->len = len;
+  e->hash = hash;
+  e->next = prof->buckets[hash % prof->nbuckets];
+  prof->buckets[hash % prof->nbuckets] = e;
+  prof->size++;
+  return e;
+}
+
+
+/*
+** Finds (or creates) the profile entry of a statement, keyed by its
+** normalized SQL text.
+** Return NULL if there is no memory for a new entry.
+*/
+static profile_entry *profile_find(profile_data *prof, const char *text)
+{
+  char buff[256];
+  char *sql = strlen(text) < sizeof(buff) ? buff
+    : (char *)malloc(strlen(text) + 1);
+  size_t len;
+  unsigned int hash;
+  profile_entry *e;
+
+  if (sql == NULL)
+    return NULL;
+  len = normalize_sql(text, sql);
+  hash = cache_hash(sql, len);
+  e = profile_lookup(prof, sql, len, hash);
+  if (sql != buff)
+    free(sql);
+  return e;
+}
+
+
+/*
+** Removes all the entries of a profile.
+*/
+static void profile_clear(profile_data *prof)
+{
+  int i;
+  for (i = 0; i < prof->nbuckets; i++)
+    while (prof->buckets[i] != NULL)
+      {
+        profile_entry *e = prof->buckets[i];
+        prof->buckets[i] = e->next;
+        free(e);
+      }
+  prof->size = 0;
+  prof->last_vm = NULL;
+  prof->last = NULL;
+}
+
+
+/*
+** Callback of sqlite3_trace_v2: counts the rows of each statement and
+** records its statistics when it completes.  The Lua callbacks run in
+** protected mode and their errors are ignored.
+*/
+static int profile_callback(unsigned int event, void *data, void *p, void *x)
+{
+  profile_data *prof = (profile_data *)data;
+  sqlite3_stmt *vm = (sqlite3_stmt *)p;
+  profile_entry *e;
+  const char *sql;
+
+  if (vm == prof->internal)
+    return 0;
+  switch (event)
+    {
+    case SQLITE_TRACE_STMT:
+      lua_rawgeti(prof->T, LUA_REGISTRYINDEX, prof->trace);
+      lua_pushstring(prof->T, (const char *)x);
+      prof->running = 1;
+      if (lua_pcall(prof->T, 1, 0, 0) != 0)
+        lua_pop(prof->T, 1);
+      prof->running = 0;
+      break;
+
+    case SQLITE_TRACE_ROW:
+      if (vm != prof->last_vm || prof->last == NULL)
+        {
+          if ((sql = sqlite3_sql(vm)) == NULL)
+            break;
+          prof->last = profile_find(prof, sql);
+          prof->last_vm = vm;
+        }
+      if (prof->last != NULL)
+        prof->last->rows++;
+      break;
+
+    case SQLITE_TRACE_PROFILE:
+      {
+        sqlite3_int64 ns = *(sqlite3_int64 *)x;
+        if ((sql = sqlite3_sql(vm)) == NULL
+            || (e = profile_find(prof, sql)) == NULL)
+          break;
+        if (e->count == 0 || ns < e->min)
+          e->min = ns;
+        if (ns > e->max)
+          e->max = ns;
+        e->count++;
+        e->total += ns;
+        e->fullscan_steps += sqlite3_stmt_status(vm, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+        e->sorts += sqlite3_stmt_status(vm, SQLITE_STMTSTATUS_SORT, 1);
+        e->autoindexes += sqlite3_stmt_status(vm, SQLITE_STMTSTATUS_AUTOINDEX, 1);
+        e->vm_steps += sqlite3_stmt_status(vm, SQLITE_STMTSTATUS_VM_STEP, 1);
+        if (vm == prof->last_vm)  /* the next run may be another statement */
+          prof->last_vm = NULL;
+        if (prof->slow != LUA_NOREF && ns >= prof->slow_ns)
+          {
+            lua_rawgeti(prof->T, LUA_REGISTRYINDEX, prof->slow);
+            lua_pushlstring(prof->T, e->sql, e->len);
+            lua_pushnumber(prof->T, ns / 1e6);
+            prof->running = 1;
+            if (lua_pcall(prof->T, 2, 0, 0) != 0)
+              lua_pop(prof->T, 1);
+            prof->running = 0;
+          }
+      }
+      break;
+    }
+  return 0;
+}
+
+
+/*
+** Stops profiling a connection and releases its statistics.
+*/
+static void profile_disable(lua_State *L, conn_data *conn)
+{
+  profile_data *prof = conn->profile;
+  if (prof == NULL)
+    return;
+  sqlite3_trace_v2(conn->sql_conn, 0, NULL, NULL);
+  profile_clear(prof);
+  free(prof->buckets);
+  luaL_unref(L, LUA_REGISTRYINDEX, prof->thread);
+  luaL_unref(L, LUA_REGISTRYINDEX, prof->slow);
+  luaL_unref(L, LUA_REGISTRYINDEX, prof->trace);
+  free(prof);
+  conn->profile = NULL;
+}
+
+
+/*
+** Pushes a table with the statistics of the profile, keyed by the SQL
+** text of the statements.
+*/
+static void profile_push(lua_State *L, profile_data *prof)
+{
+  int i;
+  lua_newtable(L);
+  if (prof == NULL)
+    return;
+  for (i = 0; i < prof->nbuckets; i++)
+    {
+      profile_entry *e;
+      for (e = prof->buckets[i]; e != NULL; e = e->next)
+        {
+          if (e->count == 0)  /* still running */
+            continue;
+          lua_pushlstring(L, e->sql, e->len);
+          lua_createtable(L, 0, 9);
+          lua_pushnumber(L, e->count);
+          lua_setfield(L, -2, "count");
+          lua_pushnumber(L, e->total / 1e9);
+          lua_setfield(L, -2, "time");
+          lua_pushnumber(L, e->min / 1e9);
+          lua_setfield(L, -2, "min");
+          lua_pushnumber(L, e->max / 1e9);
+          lua_setfield(L, -2, "max");
+          lua_pushnumber(L, e->rows);
+          lua_setfield(L, -2, "rows");
+          lua_pushnumber(L, e->fullscan_steps);
+          lua_setfield(L, -2, "fullscan_steps");
+          lua_pushnumber(L, e->sorts);
+          lua_setfield(L, -2, "sorts");
+          lua_pushnumber(L, e->autoindexes);
+          lua_setfield(L, -2, "autoindexes");
+          lua_pushnumber(L, e->vm_steps);
+          lua_setfield(L, -2, "vm_steps");
+          lua_rawset(L, -3);
+        }
+    }
+}
+
+
+/*
+** Counters of sqlite3_db_status reported by conn:get and conn:profile,
+** and of sqlite3_status64 reported by env:get.  Some of them are only
+** meaningful as high-water marks.
+*/
+typedef struct
+{
+  const char   *name;
+  int          op;
+  int          highwater;
+} status_counter;
+
+static const status_counter db_status[] = {
+  {"cache_hit", SQLITE_DBSTATUS_CACHE_HIT, 0},
+  {"cache_miss", SQLITE_DBSTATUS_CACHE_MISS, 0},
+  {"cache_write", SQLITE_DBSTATUS_CACHE_WRITE, 0},
+  {"cache_spill", SQLITE_DBSTATUS_CACHE_SPILL, 0},
+  {"cache_used", SQLITE_DBSTATUS_CACHE_USED, 0},
+  {"lookaside_used", SQLITE_DBSTATUS_LOOKASIDE_USED, 0},
+  {"lookaside_highwater", SQLITE_DBSTATUS_LOOKASIDE_USED, 1},
+  {"lookaside_hit", SQLITE_DBSTATUS_LOOKASIDE_HIT, 1},
+  {"lookaside_miss_size", SQLITE_DBSTATUS_LOOKASIDE_MISS_SIZE, 1},
+  {"lookaside_miss_full", SQLITE_DBSTATUS_LOOKASIDE_MISS_FULL, 1},
+  {"schema_used", SQLITE_DBSTATUS_SCHEMA_USED, 0},
+  {"stmt_used", SQLITE_DBSTATUS_STMT_USED, 0},
+  {NULL, 0, 0}
+};
+
+static const status_counter memory_status[] = {
+  {"memory_used", SQLITE_STATUS_MEMORY_USED, 0},
+  {"memory_highwater", SQLITE_STATUS_MEMORY_USED, 1},
+  {"malloc_count", SQLITE_STATUS_MALLOC_COUNT, 0},
+  {"malloc_size", SQLITE_STATUS_MALLOC_SIZE, 1},
+  {"pagecache_used", SQLITE_STATUS_PAGECACHE_USED, 0},
+  {"pagecache_overflow", SQLITE_STATUS_PAGECACHE_OVERFLOW, 0},
+  {"pagecache_size", SQLITE_STATUS_PAGECACHE_SIZE, 1},
+  {NULL, 0, 0}
+};
+
+
+/*
+** Pushes a counter of sqlite3_db_status, for conn:get.
+** Returns 0 (and pushes nothing) if the counter is unknown.
+*/
+static int push_db_status(lua_State *L, sqlite3 *db, const char *key)
+{
+  int i, cur, hiwtr;
+  for (i = 0; db_status[i].name != NULL; i++)
+    if (strcmp(key, db_status[i].name) == 0)
+      {
+        if (sqlite3_db_status(db, db_status[i].op, &cur, &hiwtr, 0) != SQLITE_OK)
+          lua_pushnil(L);
+        else
+          lua_pushinteger(L, db_status[i].highwater ? hiwtr : cur);
+        return 1;
+      }
+  return 0;
+}
+
+
+/*
+** Pushes a counter of sqlite3_status64, for env:get.
+** Returns 0 (and pushes nothing) if the counter is unknown.
+*/
+static int push_memory_status(lua_State *L, const char *key)
+{
+  int i;
+  sqlite3_int64 cur, hiwtr;
+  for (i = 0; memory_status[i].name != NULL; i++)
+    if (strcmp(key, memory_status[i].name) == 0)
+      {
+        if (sqlite3_status64(memory_status[i].op, &cur, &hiwtr, 0) != SQLITE_OK)
+          lua_pushnil(L);
+        else
+          lua_pushnumber(L, (lua_Number)(memory_status[i].highwater ? hiwtr : cur));
+        return 1;
+      }
+  return 0;
+}
+
+
+/*
+** Pushes a table with the page cache and lookaside usage of the
+** connection.
+*/
+static void push_cache_status(lua_State *L, sqlite3 *db)
+{
+  int i;
+  lua_newtable(L);
+  for (i = 0; db_status[i].name != NULL; i++)
+    {
+      push_db_status(L, db, db_status[i].name);
+      lua_setfield(L, -2, db_status[i].name);
+    }
+}
+
+
+/*
+** Returns the statistics collected so far and changes the profiling
+** of the connection.  Options (table at position 2):
+**   enable:  start (true) or stop (false) profiling;
+**   reset:   clear the statistics after returning them;
+**   slow_ms, slow: when enabling, function called with the SQL text
+**            and the elapsed milliseconds of each statement that takes
+**            at least slow_ms;
+**   trace:   when enabling, function called with the SQL text of each
+**            statement as it starts.
+** Return the statistics, keyed by SQL text, and the page cache usage.
+*/
+static int conn_profile(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  profile_data *prof;
+  int enable = -1;
+
+  if (conn->profile != NULL && conn->profile->running)
+    return luaL_error(L, LUASQL_PREFIX"profile callback running");
+  if (!lua_isnoneornil(L, 2))
+    {
+      luaL_checktype(L, 2, LUA_TTABLE);
+      lua_getfield(L, 2, LUASQL_ENABLE);
+      if (lua_isboolean(L, -1))
+        enable = lua_toboolean(L, -1);
+      lua_pop(L, 1);
+    }
+  profile_push(L, conn->profile);
+  push_cache_status(L, conn->sql_conn);
+  if (lua_istable(L, 2))
+    {
+      lua_getfield(L, 2, LUASQL_RESET);
+      if (lua_toboolean(L, -1) && conn->profile != NULL)
+        profile_clear(conn->profile);
+      lua_pop(L, 1);
+    }
+
+  if (enable == 0)
+    profile_disable(L, conn);
+  else if (enable == 1)
+    {
+      unsigned int mask = SQLITE_TRACE_PROFILE | SQLITE_TRACE_ROW;
+      profile_disable(L, conn);
+      prof = (profile_data *)malloc(sizeof(profile_data));
+      if (prof == NULL)
+        return luaL_error(L, LUASQL_PREFIX"out of memory");
+      prof->nbuckets = 16;
+      prof->size = 0;
+      prof->buckets = (profile_entry **)calloc(prof->nbuckets, sizeof(profile_entry *));
+      if (prof->buckets == NULL)
+        {
+          free(prof);
+          return luaL_error(L, LUASQL_PREFIX"out of memory");
+        }
+      prof->last_vm = NULL;
+      prof->last = NULL;
+      prof->internal = NULL;
+      prof->running = 0;
+      prof->T = lua_newthread(L);
+      prof->thread = luaL_ref(L, LUA_REGISTRYINDEX);
+      lua_getfield(L, 2, LUASQL_SLOWMS);
+      prof->slow_ns = (sqlite3_int64)(lua_tonumber(L, -1) * 1e6);
+      lua_getfield(L, 2, LUASQL_SLOW);
+      prof->slow = lua_isfunction(L, -1) ? luaL_ref(L, LUA_REGISTRYINDEX)
+        : (lua_pop(L, 1), LUA_NOREF);
+      lua_getfield(L, 2, LUASQL_TRACE);
+      prof->trace = lua_isfunction(L, -1) ? luaL_ref(L, LUA_REGISTRYINDEX)
+        : (lua_pop(L, 1), LUA_NOREF);
+      lua_pop(L, 1);
+      if (prof->trace != LUA_NOREF)
+        mask |= SQLITE_TRACE_STMT;
+      conn->profile = prof;
+      sqlite3_trace_v2(conn->sql_conn, mask, profile_callback, prof);
+    }
+  return 2;
+}
+
+
+
+/*
+** Waits on a condition for at most 'seconds', with the mutex held.
+** Return 0 on timeout.
+*/
+static int cond_timedwait(sys_cond *c, sys_mutex *m, double seconds)
+{
+#ifdef _WIN32
+  return SleepConditionVariableCS(c, m, (DWORD)(seconds * 1e3));
+#else
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += (time_t)seconds;
+  deadline.tv_nsec += (long)((seconds - (time_t)seconds) * 1e9);
+  if (deadline.tv_nsec >= 1000000000L)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+  return pthread_cond_timedwait(c, m, &deadline) != ETIMEDOUT;
+#endif
+}
+
+
+/*
+** Waits for the next checkpoint, with the lock held.
+** Return 1 if the checkpointer was stopped meanwhile.
+*/
+static int checkpoint_wait(checkpointer *ckpt)
+{
+  double deadline = monotonic_time() + ckpt->interval_ms / 1e3;
+  while (!ckpt->stop)
+    {
+      double left = deadline - monotonic_time();
+      if (left <= 0 || !cond_timedwait(&ckpt->wake, &ckpt->lock, left))
+        break;
+    }
+  return ckpt->stop;
+}
+
+
+/*
+** Runs one checkpoint: PASSIVE first, which never blocks the writers,
+** then RESTART or TRUNCATE if the WAL is still too large or was not
+** emptied for max_age_ms.
+*/
+static void checkpoint_run(checkpointer *ckpt)
+{
+  int mode = SQLITE_CHECKPOINT_PASSIVE;
+  int nlog = 0, nckpt = 0, res;
+  double start = monotonic_time();
+
+  res = sqlite3_wal_checkpoint_v2(ckpt->db, NULL, mode, &nlog, &nckpt);
+  if (res == SQLITE_OK && nlog == 0)
+    ckpt->last_reset = start;
+  else if (res == SQLITE_OK)
+    {
+      if ((ckpt->truncate_pages > 0 && nlog >= ckpt->truncate_pages)
+	  || (ckpt->max_age_ms > 0
+	      && (start - ckpt->last_reset) * 1e3 >= ckpt->max_age_ms))
+        mode = SQLITE_CHECKPOINT_TRUNCATE;
+      else if (ckpt->restart_pages > 0 && nlog >= ckpt->restart_pages)
+        mode = SQLITE_CHECKPOINT_RESTART;
+      if (mode != SQLITE_CHECKPOINT_PASSIVE)
+        {
+          res = sqlite3_wal_checkpoint_v2(ckpt->db, NULL, mode, &nlog, &nckpt);
+          if (res == SQLITE_OK)
+            ckpt->last_reset = monotonic_time();
+        }
+    }
+
+  mutex_lock(&ckpt->lock);
+  ckpt->count++;
+  if (res == SQLITE_BUSY)
+    ckpt->busy++;
+  if (nlog >= 0)
+    {
+      ckpt->wal_frames = nlog;
+      ckpt->checkpointed = nckpt;
+    }
+  ckpt->duration = monotonic_time() - start;
+  ckpt->mode = mode == SQLITE_CHECKPOINT_TRUNCATE ? "truncate"
+    : mode == SQLITE_CHECKPOINT_RESTART ? "restart" : "passive";
+  mutex_unlock(&ckpt->lock);
+}
+
+
+/*
+** Body of the worker thread.
+*/
+static WORKER_API checkpoint_thread(void *p)
+{
+  checkpointer *ckpt = (checkpointer *)p;
+
+  mutex_lock(&ckpt->lock);
+  while (!checkpoint_wait(ckpt))
+    {
+      mutex_unlock(&ckpt->lock);
+      checkpoint_run(ckpt);
+      mutex_lock(&ckpt->lock);
+    }
+  mutex_unlock(&ckpt->lock);
+  return 0;
+}
+
+
+/*
+** Stops the checkpointer of a connection, if any, and gives the
+** checkpoints back to the writers.
+*/
+static void checkpoint_stop(conn_data *conn)
+{
+  checkpointer *ckpt = conn->checkpointer;
+  if (ckpt == NULL)
+    return;
+
+  mutex_lock(&ckpt->lock);
+  ckpt->stop = 1;
+  cond_signal(&ckpt->wake);
+  mutex_unlock(&ckpt->lock);
+  thread_join(ckpt->thread);
+  cond_destroy(&ckpt->wake);
+  mutex_destroy(&ckpt->lock);
+  sqlite3_close(ckpt->db);
+  sqlite3_wal_autocheckpoint(conn->sql_conn, ckpt->autocheckpoint);
+  free(ckpt);
+  conn->checkpointer = NULL;
+}
+
+
+/*
+** Returns the integer result of a pragma, or 'def' if it cannot be read.
+*/
+static int pragma_int(sqlite3 *db, const char *sql, int def)
+{
+  sqlite3_stmt *vm;
+
+  if (sqlite3_prepare_v2(db, sql, -1, &vm, NULL) == SQLITE_OK
+      && sqlite3_step(vm) == SQLITE_ROW)
+    def = sqlite3_column_int(vm, 0);
+  sqlite3_finalize(vm);
+  return def;
+}
+
+
+/*
+** Starts (or stops) a background checkpointer for a connection in WAL
+** mode, replacing the automatic checkpoints run by the writers at
+** commit.  Options (table at position 2):
+**   enable:         false stops the checkpointer;
+**   interval_ms:    pause between checkpoints (1000 by default);
+**   restart_pages:  WAL size escalating to a RESTART checkpoint (1000
+**                   by default, 0 never);
+**   truncate_pages: WAL size escalating to a TRUNCATE checkpoint (0 by
+**                   default, never);
+**   max_age_ms:     TRUNCATE when the WAL was not emptied for so long (0
+**                   by default, never);
+**   busy_timeout:   how long RESTART and TRUNCATE wait for the readers
+**                   (0 by default).
+** Return true, or nil + errmsg.
+*/
+static int conn_checkpointer(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  const char *filename;
+  checkpointer *ckpt;
+  sqlite3 *db;
+  int busy_timeout = 0, res;
+
+  if (!lua_isnoneornil(L, 2))
+    luaL_checktype(L, 2, LUA_TTABLE);
+  checkpoint_stop(conn);
+  if (lua_istable(L, 2))
+    {
+      lua_getfield(L, 2, LUASQL_ENABLE);
+      if (lua_isboolean(L, -1) && !lua_toboolean(L, -1))
+        {
+          lua_pushboolean(L, 1);
+          return 1;
+        }
+      lua_pop(L, 1);
+    }
+
+  if (!sqlite3_threadsafe())
+    return luasql_faildirect(L, LUASQL_PREFIX"SQLite was built without threads");
+  filename = sqlite3_db_filename(conn->sql_conn, "main");
+  if (filename == NULL || *filename == '\0')
+    return luasql_faildirect(L, LUASQL_PREFIX"checkpointer needs a database file");
+  if (sqlite3_db_readonly(conn->sql_conn, "main") == 1)
+    return luasql_faildirect(L, LUASQL_PREFIX"database is read-only");
+
+  res = sqlite3_open_v2(filename, &db,
+			SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX, NULL);
+  if (res == SQLITE_OK)
+    {
+      sqlite3_stmt *vm;
+      res = sqlite3_prepare_v2(db, "PRAGMA journal_mode", -1, &vm, NULL);
+      if (res == SQLITE_OK && sqlite3_step(vm) == SQLITE_ROW
+	  && sqlite3_stricmp((const char *)sqlite3_column_text(vm, 0), "wal") != 0)
+        {
+          sqlite3_finalize(vm);
+          sqlite3_close(db);
+          return luasql_faildirect(L, LUASQL_PREFIX"database is not in WAL mode");
+        }
+      sqlite3_finalize(vm);
+    }
+  if (res != SQLITE_OK)
+    {
+      lua_pushnil(L);
+      lua_pushliteral(L, LUASQL_PREFIX);
+      lua_pushstring(L, sqlite3_errmsg(db));
+      lua_concat(L, 2);
+      sqlite3_close(db);
+      return 2;
+    }
+
+  ckpt = (checkpointer *)malloc(sizeof(checkpointer));
+  if (ckpt == NULL)
+    {
+      sqlite3_close(db);
+      return luaL_error(L, LUASQL_PREFIX"out of memory");
+    }
+  ckpt->db = db;
+  ckpt->interval_ms = 1000;
+  ckpt->restart_pages = 1000;
+  ckpt->truncate_pages = 0;
+  ckpt->max_age_ms = 0;
+  if (lua_istable(L, 2))
+    {
+      lua_getfield(L, 2, LUASQL_INTERVALMS);
+      if (lua_isnumber(L, -1))
+        ckpt->interval_ms = lua_tointeger(L, -1);
+      lua_getfield(L, 2, LUASQL_RESTARTPAGES);
+      if (lua_isnumber(L, -1))
+        ckpt->restart_pages = lua_tointeger(L, -1);
+      lua_getfield(L, 2, LUASQL_TRUNCATEPAGES);
+      if (lua_isnumber(L, -1))
+        ckpt->truncate_pages = lua_tointeger(L, -1);
+      lua_getfield(L, 2, LUASQL_MAXAGEMS);
+      if (lua_isnumber(L, -1))
+        ckpt->max_age_ms = lua_tointeger(L, -1);
+      lua_getfield(L, 2, LUASQL_BUSYTIMEOUT);
+      if (lua_isnumber(L, -1))
+        busy_timeout = lua_tointeger(L, -1);
+      lua_pop(L, 5);
+    }
+  if (ckpt->interval_ms < 1)
+    ckpt->interval_ms = 1;
+  sqlite3_busy_timeout(db, busy_timeout);
+  ckpt->page_size = pragma_int(db, "PRAGMA page_size", 0);
+  ckpt->autocheckpoint = pragma_int(conn->sql_conn,
+				    "PRAGMA wal_autocheckpoint", 1000);
+  ckpt->stop = 0;
+  ckpt->last_reset = monotonic_time();
+  ckpt->wal_frames = ckpt->checkpointed = 0;
+  ckpt->duration = 0;
+  ckpt->mode = NULL;
+  ckpt->count = ckpt->busy = 0;
+
+  mutex_init(&ckpt->lock);
+  cond_init(&ckpt->wake);
+  if (thread_create(&ckpt->thread, checkpoint_thread, ckpt))
+    {
+      cond_destroy(&ckpt->wake);
+      mutex_destroy(&ckpt->lock);
+      sqlite3_close(db);
+      free(ckpt);
+      return luasql_faildirect(L, LUASQL_PREFIX"cannot start checkpointer thread");
+    }
+  /* the writers no longer checkpoint at commit */
+  sqlite3_wal_autocheckpoint(conn->sql_conn, 0);
+  conn->checkpointer = ckpt;
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Pushes a statistic of the checkpointer, for conn:get.
+** Returns 0 (and pushes nothing) if the parameter is unknown or there
+** is no checkpointer.
+*/
+static int checkpoint_pushparam(lua_State *L, checkpointer *ckpt,
+				const char *key)
+{
+  int found = 1;
+  if (ckpt == NULL)
+    return 0;
+
+  mutex_lock(&ckpt->lock);
+  if (strcmp(key, LUASQL_WALSIZE) == 0)
+    /* WAL header plus a header of 24 bytes for each frame */
+    lua_pushnumber(L, ckpt->wal_frames > 0 ?
+		   32 + (double)ckpt->wal_frames * (ckpt->page_size + 24) : 0);
+  else if (strcmp(key, LUASQL_WALFRAMES) == 0)
+    lua_pushinteger(L, ckpt->wal_frames);
+  else if (strcmp(key, LUASQL_CHECKPOINTED) == 0)
+    lua_pushinteger(L, ckpt->checkpointed);
+  else if (strcmp(key, LUASQL_CHECKPOINTMS) == 0)
+    lua_pushnumber(L, ckpt->duration * 1e3);
+  else if (strcmp(key, LUASQL_CHECKPOINTMODE) == 0)
+    {
+      if (ckpt->mode != NULL)
+        lua_pushstring(L, ckpt->mode);
+      else
+        lua_pushnil(L);
+    }
+  else if (strcmp(key, LUASQL_CHECKPOINTS) == 0)
+    lua_pushnumber(L, ckpt->count);
+  else if (strcmp(key, LUASQL_CHECKPOINTBUSY) == 0)
+    lua_pushnumber(L, ckpt->busy);
+  else
+    found = 0;
+  mutex_unlock(&ckpt->lock);
+  return found;
+}
+
+
+/*
+** Prepares the connection to run a statement under group commit: a
+** read (or a transaction statement) commits the open group first, and
+** a write outside of any transaction opens one.
+*/
+static int group_begin(conn_data *conn, sqlite3_stmt *vm)
+{
+  group_commit *group = &conn->group;
+  int res;
+
+  if (group->open)
+    {
+      if (sqlite3_stmt_readonly(vm) || group->max_rows == 0)
+        return group_flush(conn);
+      return SQLITE_OK;
+    }
+  if (group->max_rows == 0 || !conn->auto_commit || sqlite3_stmt_readonly(vm)
+      || !sqlite3_get_autocommit(conn->sql_conn))
+    return SQLITE_OK;
+  res = sqlite3_exec(conn->sql_conn, "BEGIN", NULL, NULL, NULL);
+  if (res == SQLITE_OK)
+    {
+      group->open = 1;
+      group->pending = 0;
+      group->start = monotonic_time();
+    }
+  return res;
+}
+
+
+/*
+** Counts a statement run in the open group, committing the group when
+** it is full or old enough.  A failed commit is retried by the next
+** statement.
+*/
+static void group_end(conn_data *conn)
+{
+  group_commit *group = &conn->group;
+
+  if (!group->open)
+    return;
+  group->pending++;
+  if (group->pending >= group->max_rows
+      || (group->max_ms > 0
+	  && (monotonic_time() - group->start) * 1e3 >= group->max_ms))
+    group_flush(conn);
+}
+
+
+/*
+** Enables group commit with the limits of the table at stack position
+** 'idx', or disables it (committing the open group) if it is not a
+** table.
+*/
+static void group_configure(lua_State *L, conn_data *conn, int idx)
+{
+  group_commit *group = &conn->group;
+
+  if (!lua_istable(L, idx))
+    {
+      group->max_rows = 0;
+      group_flush(conn);
+      return;
+    }
+  lua_getfield(L, idx, LUASQL_MAXROWS);
+  group->max_rows = lua_isnumber(L, -1) ? lua_tointeger(L, -1) : 100;
+  if (group->max_rows < 1)
+    group->max_rows = 1;
+  lua_getfield(L, idx, LUASQL_MAXMS);
+  group->max_ms = lua_isnumber(L, -1) ? lua_tointeger(L, -1) : 100;
+  lua_pop(L, 2);
+}
+
+
+/*
+** Pushes nil and the last error message of the connection.
+*/
+static int conn_error(lua_State *L, conn_data *conn)
+{
+  lua_pushnil(L);
+  lua_pushliteral(L, LUASQL_PREFIX);
+  lua_pushstring(L, error_message(conn));
+  lua_concat(L, 2);
+  return 2;
+}
+
+
+/*
+** Close a Connection object.
+*/
+static int conn_close(lua_State *L)
+{
+  conn_data *conn = (conn_data *)luaL_checkudata(L, 1, LUASQL_CONNECTION_SQLITE);
+  luaL_argcheck (L, conn != NULL, 1, LUASQL_PREFIX"connection expected");
+  if (conn->closed) 
+    {
+      lua_pushboolean(L, 0);
+      return 1;
+    }
+
+  if (conn->cur_counter > 0)
+    return luaL_error (L, LUASQL_PREFIX"there are open cursors");
+  if (conn->profile != NULL && conn->profile->running)
+    return luaL_error (L, LUASQL_PREFIX"profile callback running");
+  /* closing would roll back the batched writes */
+  if (group_flush(conn) != SQLITE_OK)
+    return conn_error(L, conn);
+
+  /* Nullify structure fields. */
+  conn->closed = 1;
+  luaL_unref(L, LUA_REGISTRYINDEX, conn->env);
+  /* finalize prepared statements still alive */
+  while (conn->statements != NULL)
+    {
+      stmt_data *stmt = conn->statements;
+      conn->statements = stmt->next;
+      stmt->closed = 1;
+      stmt->next = NULL;
+      sqlite3_finalize(stmt->sql_vm);
+      stmt->sql_vm = NULL;
+    }
+  /* close blob handles still open */
+  while (conn->blobs != NULL)
+    {
+      blob_data *blob = conn->blobs;
+      conn->blobs = blob->next;
+      blob->closed = 1;
+      blob->next = NULL;
+      sqlite3_blob_close(blob->blob);
+      blob->blob = NULL;
+    }
+  /* finish backups still reading from it */
+  while (conn->backups != NULL)
+    {
+      backup_data *backup = conn->backups;
+      conn->backups = backup->next;
+      backup->closed = 1;
+      backup->next = NULL;
+      sqlite3_backup_finish(backup->backup);
+      backup->backup = NULL;
+      if (backup->dest_data == NULL)
+        sqlite3_close(backup->dest_db);
+      backup->dest_db = NULL;
+    }
+  cache_trim(&conn->cache, 0);
+  results_clear(&conn->results);
+  sqlite3_finalize(conn->results.version);
+  profile_disable(L, conn);
+  checkpoint_stop(conn);
+  /* a destination of a backup is only released when the backup ends */
+  sqlite3_close_v2(conn->sql_conn);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Connection object collector function: it closes the connection even
+** when the writes batched by group commit cannot be committed.
+*/
+static int conn_gc(lua_State *L)
+{
+  conn_data *conn = (conn_data *)luaL_checkudata(L, 1, LUASQL_CONNECTION_SQLITE);
+  if (conn != NULL && !conn->closed && group_flush(conn) != SQLITE_OK)
+    conn->group.open = conn->group.pending = 0;
+  return conn_close(L);
+}
+
+static int conn_escape(lua_State *L)
+{
+  const char *from = luaL_checklstring (L, 2, 0);
+  char *escaped = sqlite3_mprintf("%q", from);
+  if (escaped == NULL) 
+    {
+      lua_pushnil(L);
+    } 
+  else
+    {
+      lua_pushstring(L, escaped);        
+      sqlite3_free(escaped);
+    }
+  return 1;
+}
+
+/*
+** Interrupts the statements running on the connection, which fail with
+** an "interrupted" error.  It only sets a flag of the connection, so it
+** may be called from a SQL function or a debug hook while a statement
+** runs.
+*/
+static int conn_interrupt(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  sqlite3_interrupt(conn->sql_conn);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Commits the writes batched by group commit.
+** Return true, or nil + errmsg.
+*/
+static int conn_flush(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  if (group_flush(conn) != SQLITE_OK)
+    return conn_error(L, conn);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Run a compiled statement.
+** The vm is owned by the prepared statement 'stmt' or, if it is NULL,
+** by this call (and then by the cursor created), which gives it back
+** to the statement cache.
+** The connection object must be at stack position 'o' and the statement
+** object, if any, at position 1.
+** The statement, and its cursor, must finish within 'timeout' seconds
+** (0 for no limit).
+** Return a Cursor object if the statement is a query, otherwise
+** return the number of tuples affected by the statement.
+*/
+static int execute_vm(lua_State *L, int o, conn_data *conn,
+		      sqlite3_stmt *vm, stmt_data *stmt, double timeout)
+{
+  int res;
+  int numcols;
+  double expires = deadline_start(conn, timeout);
+  int changes = sqlite3_total_changes(conn->sql_conn);
+
+  res = group_begin(conn, vm);
+  if (res == SQLITE_OK)
+    /* process first result to retrive query information and type */
+    res = deadline_step(conn, vm, expires);
+  numcols = sqlite3_column_count(vm);
+
+  /* real query? if empty, must have numcols!=0 */
+  if ((res == SQLITE_ROW) || ((res == SQLITE_DONE) && numcols))
+    {
+      cur_data *cur;
+      create_cursor(L, o, conn, vm, numcols);
+      cur = (cur_data *)lua_touserdata(L, -1);
+      /* keep the result of this step for the first fetch */
+      cur->pending = res;
+      cur->expires = expires;
+      if (stmt != NULL)
+        {
+          stmt->busy = 1;
+          cur->stmt_data = stmt;
+          lua_pushvalue(L, 1);
+          cur->stmt = luaL_ref(L, LUA_REGISTRYINDEX);
+        }
+      group_end(conn);
+      return 1;
+    }
+
+  if (res == SQLITE_DONE) /* and numcols==0, INSERT,UPDATE,DELETE statement */
+    {
+      if (stmt == NULL)
+        cache_release(conn, vm);
+      else
+        sqlite3_reset(vm);
+      /* return number of columns changed; like SQLite 2, the
+         compatibility API reports 0 for statements changing no row */
+      if (conn->compat && sqlite3_total_changes(conn->sql_conn) == changes)
+        lua_pushnumber(L, 0);
+      else
+        lua_pushnumber(L, sqlite3_changes(conn->sql_conn));
+      group_end(conn);
+      return 1;
+    }
+
+  /* error */
+  res = conn_error(L, conn);
+  if (stmt == NULL)
+    cache_release(conn, vm);
+  else
+    sqlite3_reset(vm);
+  return res;
+}
+
+
+/*
+** Execute an SQL statement, within the timeout of the connection or
+** the one given in milliseconds.
+** Return a Cursor object if the statement is a query, otherwise
+** return the number of tuples affected by the statement.
+*/
+static int conn_execute(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  size_t len;
+  const char *statement = luaL_checklstring(L, 2, &len);
+  double timeout = lua_isnoneornil(L, 3) ? conn->deadline.timeout
+    : luaL_checknumber(L, 3) / 1e3;
+  unsigned long generation = conn->results.generation;
+  int res;
+  sqlite3_stmt *vm;
+  const char *tail;
+
+  if (conn->results.capacity > 0)
+    {
+      result_entry *e = results_get(conn, statement, len);
+      if (e != NULL && results_cursor(L, 1, conn, e))
+        return 1;
+    }
+
+  vm = cache_get(conn, statement, len);
+  if (vm != NULL)
+    return results_capture(L, conn, statement, len, generation,
+			   execute_vm(L, 1, conn, vm, NULL, timeout));
+
+  res = sqlite3_prepare_v2(conn->sql_conn, statement, (int)len + 1, &vm, &tail);
+  if (res != SQLITE_OK)
+    return conn_error(L, conn);
+
+  if (vm == NULL) /* empty statement */
+    {
+      lua_pushnumber(L, 0);
+      return 1;
+    }
+
+  return results_capture(L, conn, statement, len, generation,
+			 execute_vm(L, 1, conn, vm, NULL, timeout));
+}
+
+
+/*
+** Bind the value at stack position 'idx' to parameter 'param'.
+** Numbers with no fractional part are bound as integers.
+** Return the SQLite result code.
+*/
+static int bind_value(lua_State *L, sqlite3_stmt *vm, int param, int idx)
+{
+  switch (lua_type(L, idx)) {
+  case LUA_TNONE:
+  case LUA_TNIL:
+    return sqlite3_bind_null(vm, param);
+  case LUA_TBOOLEAN:
+    return sqlite3_bind_int(vm, param, lua_toboolean(L, idx));
+  case LUA_TNUMBER:
+    {
+      lua_Number n = lua_tonumber(L, idx);
+      if (n >= -9.2e18 && n <= 9.2e18 && n == (lua_Number)(sqlite3_int64)n)
+        return sqlite3_bind_int64(vm, param, (sqlite3_int64)n);
+      return sqlite3_bind_double(vm, param, n);
+    }
+  case LUA_TSTRING:
+    {
+      size_t len;
+      const char *s = lua_tolstring(L, idx, &len);
+      return sqlite3_bind_text(vm, param, s, (int)len, SQLITE_TRANSIENT);
+    }
+  default:
+    return luaL_error(L, LUASQL_PREFIX"cannot bind a %s value (parameter %d)",
+		      luaL_typename(L, idx), param);
+  }
+}
+
+
+/*
+** Check that a statement can be bound or executed again.
+*/
+static stmt_data *getidlestatement(lua_State *L)
+{
+  stmt_data *stmt = getstatement(L);
+  if (stmt->busy)
+    luaL_error(L, LUASQL_PREFIX"statement has an open cursor");
+  return stmt;
+}
+
+
+/*
+** Bind the positional parameters starting at stack position 'first'.
+** Return 0 on success, otherwise push nil + errmsg and return 2.
+*/
+static int bind_list(lua_State *L, stmt_data *stmt, int first)
+{
+  int i;
+  int top = lua_gettop(L);
+  sqlite3_reset(stmt->sql_vm);
+  sqlite3_clear_bindings(stmt->sql_vm);
+  for (i = first; i <= top; i++)
+    if (bind_value(L, stmt->sql_vm, i - first + 1, i) != SQLITE_OK)
+      return conn_error(L, stmt->conn_data);
+  return 0;
+}
+
+
+/*
+** Bind the given values to the positional parameters of the statement.
+** Parameters not given are bound to NULL.
+*/
+static int stmt_bind(lua_State *L)
+{
+  stmt_data *stmt = getidlestatement(L);
+  int res = bind_list(L, stmt, 2);
+  if (res)
+    return res;
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Bind the fields of the table at stack position 'idx' to the
+** parameters of a statement: named parameters (:name, @name or $name)
+** by their name and positional ones by their index.
+** Parameters missing from the table are bound to NULL.
+** Return the SQLite result code.
+*/
+static int bind_table(lua_State *L, sqlite3_stmt *vm, int idx)
+{
+  int i, n = sqlite3_bind_parameter_count(vm);
+  for (i = 1; i <= n; i++)
+    {
+      const char *name = sqlite3_bind_parameter_name(vm, i);
+      int res;
+      if (name == NULL) /* positional parameter */
+        lua_rawgeti(L, idx, i);
+      else
+        lua_getfield(L, idx, name + 1);
+      res = bind_value(L, vm, i, -1);
+      lua_pop(L, 1);
+      if (res != SQLITE_OK)
+        return res;
+    }
+  return SQLITE_OK;
+}
+
+
+/*
+** Bind the fields of a table to the named parameters (:name, @name
+** or $name) of the statement.
+** Parameters missing from the table are bound to NULL.
+*/
+static int stmt_bind_names(lua_State *L)
+{
+  stmt_data *stmt = getidlestatement(L);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  sqlite3_reset(stmt->sql_vm);
+  sqlite3_clear_bindings(stmt->sql_vm);
+  if (bind_table(L, stmt->sql_vm, 2) != SQLITE_OK)
+    return conn_error(L, stmt->conn_data);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Bind a string as a BLOB to a parameter given by its index or name.
+*/
+static int stmt_bind_blob(lua_State *L)
+{
+  stmt_data *stmt = getidlestatement(L);
+  size_t len;
+  const char *blob = luaL_checklstring(L, 3, &len);
+  int param;
+  if (lua_type(L, 2) == LUA_TSTRING)
+    {
+      param = sqlite3_bind_parameter_index(stmt->sql_vm, lua_tostring(L, 2));
+      luaL_argcheck(L, param > 0, 2, LUASQL_PREFIX"unknown parameter");
+    }
+  else
+    param = luaL_checkint(L, 2);
+  sqlite3_reset(stmt->sql_vm);
+  if (sqlite3_bind_blob(stmt->sql_vm, param, blob, (int)len, SQLITE_TRANSIENT)
+      != SQLITE_OK)
+    return conn_error(L, stmt->conn_data);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Execute the prepared statement.
+** If any argument is given, it is bound as by stmt:bind.
+** Return a Cursor object if the statement is a query, otherwise
+** return the number of tuples affected by the statement.
+*/
+static int stmt_execute(lua_State *L)
+{
+  stmt_data *stmt = getidlestatement(L);
+  conn_data *conn = stmt->conn_data;
+  unsigned long generation = conn->results.generation;
+  char *key = NULL;
+  int res;
+  if (lua_gettop(L) > 1)
+    {
+      res = bind_list(L, stmt, 2);
+      if (res)
+        return res;
+    }
+  else
+    sqlite3_reset(stmt->sql_vm);
+  lua_settop(L, 1);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, stmt->conn);
+  /* cached results are keyed by the SQL text with the values bound */
+  if (conn->results.capacity > 0
+      && (key = sqlite3_expanded_sql(stmt->sql_vm)) != NULL)
+    {
+      result_entry *e = results_get(conn, key, strlen(key));
+      if (e != NULL && results_cursor(L, 2, conn, e))
+        {
+          sqlite3_free(key);
+          return 1;
+        }
+    }
+  res = results_capture(L, conn, key, key != NULL ? strlen(key) : 0,
+			generation,
+			execute_vm(L, 2, conn, stmt->sql_vm, stmt,
+				   conn->deadline.timeout));
+  sqlite3_free(key);
+  return res;
+}
+
+
+/*
+** Reset the statement so it can be executed again.
+** Bound values are kept.
+*/
+static int stmt_reset(lua_State *L)
+{
+  stmt_data *stmt = getidlestatement(L);
+  sqlite3_reset(stmt->sql_vm);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Finalize the statement and remove it from its connection list.
+*/
+static void stmt_nullify(lua_State *L, stmt_data *stmt)
+{
+  stmt_data **p = &stmt->conn_data->statements;
+  while (*p != NULL && *p != stmt)
+    p = &(*p)->next;
+  if (*p != NULL)
+    *p = stmt->next;
+  stmt->closed = 1;
+  sqlite3_finalize(stmt->sql_vm);
+  stmt->sql_vm = NULL;
+  luaL_unref(L, LUA_REGISTRYINDEX, stmt->conn);
+  stmt->conn = LUA_NOREF;
+}
+
+
+/*
+** Statement object collector function
+*/
+static int stmt_gc(lua_State *L)
+{
+  stmt_data *stmt = (stmt_data *)luaL_checkudata(L, 1, LUASQL_STATEMENT_SQLITE);
+  if (stmt != NULL && !stmt->closed)
+    stmt_nullify(L, stmt);
+  else if (stmt != NULL) /* finalized by its connection */
+    {
+      luaL_unref(L, LUA_REGISTRYINDEX, stmt->conn);
+      stmt->conn = LUA_NOREF;
+    }
+  return 0;
+}
+
+
+/*
+** Close the statement on top of the stack.
+** Return 1
+*/
+static int stmt_close(lua_State *L)
+{
+  stmt_data *stmt = (stmt_data *)luaL_checkudata(L, 1, LUASQL_STATEMENT_SQLITE);
+  luaL_argcheck(L, stmt != NULL, 1, LUASQL_PREFIX"statement expected");
+  if (stmt->closed) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  if (stmt->busy)
+    return luaL_error(L, LUASQL_PREFIX"statement has an open cursor");
+  stmt_nullify(L, stmt);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Compile an SQL statement once for repeated execution.
+** Return a Statement object.
+*/
+static int conn_prepare(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  const char *statement = luaL_checkstring(L, 2);
+  sqlite3_stmt *vm;
+  stmt_data *stmt;
+
+  if (sqlite3_prepare_v2(conn->sql_conn, statement, -1, &vm, NULL) != SQLITE_OK)
+    return conn_error(L, conn);
+  if (vm == NULL)
+    return luasql_faildirect(L, LUASQL_PREFIX"empty statement");
+
+  stmt = (stmt_data *)lua_newuserdata(L, sizeof(stmt_data));
+  luasql_setmeta(L, LUASQL_STATEMENT_SQLITE);
+
+  /* fill in structure */
+  stmt->closed = 0;
+  stmt->busy = 0;
+  stmt->conn_data = conn;
+  stmt->sql_vm = vm;
+  lua_pushvalue(L, 1);
+  stmt->conn = luaL_ref(L, LUA_REGISTRYINDEX);
+  stmt->next = conn->statements;
+  conn->statements = stmt;
+  return 1;
+}
+
+
+/*
+** State of a bulk insertion.
+*/
+typedef struct
+{
+  conn_data    *conn;
+  sqlite3_stmt *vm;
+  int          batch;              /* rows per transaction, 0 for none */
+  int          intrans;            /* a batch transaction is open */
+  int          row;                /* number of the current row */
+  double       changes;            /* rows changed so far */
+} bulk_data;
+
+
+/*
+** Runs the rows of a bulk insertion through its statement.
+** Called in protected mode with the bulk_data and the rows (a table or
+** an iterator function) on the stack.
+** Return nothing on success or the error message of the failing row.
+*/
+static int bulk_loop(lua_State *L)
+{
+  bulk_data *bulk = (bulk_data *)lua_touserdata(L, 1);
+  sqlite3 *db = bulk->conn->sql_conn;
+  int iterator = lua_isfunction(L, 2);
+  int res;
+
+  for (;;)
+    {
+      if (iterator)
+        {
+          lua_pushvalue(L, 2);
+          lua_call(L, 0, 1);
+        }
+      else
+        lua_rawgeti(L, 2, bulk->row + 1);
+      if (lua_isnil(L, -1))
+        break;
+      bulk->row++;
+      if (!lua_istable(L, -1))
+        return luaL_error(L, LUASQL_PREFIX"row is a %s value",
+			  luaL_typename(L, -1));
+
+      if (bulk->batch && !bulk->intrans)
+        {
+          if (sqlite3_exec(db, "BEGIN", NULL, NULL, NULL) != SQLITE_OK)
+            break;
+          bulk->intrans = 1;
+        }
+      res = bind_table(L, bulk->vm, lua_gettop(L));
+      if (res == SQLITE_OK)
+        while ((res = sqlite3_step(bulk->vm)) == SQLITE_ROW)
+          ;
+      if (res != SQLITE_DONE)
+        break;
+      bulk->changes += sqlite3_changes(db);
+      sqlite3_reset(bulk->vm);
+      lua_pop(L, 1);
+
+      if (bulk->intrans && bulk->row % bulk->batch == 0)
+        {
+          if (sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK)
+            break;
+          bulk->intrans = 0;
+        }
+    }
+  if (lua_isnil(L, -1) && bulk->intrans)
+    {
+      if (sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) == SQLITE_OK)
+        bulk->intrans = 0;
+      else
+        lua_pushboolean(L, 0);
+    }
+  if (!lua_isnil(L, -1)) /* stopped by an error */
+    {
+      lua_pushliteral(L, LUASQL_PREFIX);
+      lua_pushstring(L, sqlite3_errmsg(db));
+      lua_concat(L, 2);
+      return 1;
+    }
+  return 0;
+}
+
+
+/*
+** Insert many rows through one compiled statement.
+** The rows are given as a table of rows or as an iterator function
+** returning one row per call, and each row is bound as by
+** stmt:bind_names.  In auto commit mode every 'batch_size' rows run
+** in one transaction.
+** Return the number of rows changed, or nil + errmsg + the number of
+** the failing row; the batch of this row is rolled back.
+*/
+static int conn_insertmany(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  const char *statement = luaL_checkstring(L, 2);
+  int batch = luaL_optint(L, 4, 1000);
+  bulk_data bulk;
+  int res;
+
+  luaL_argcheck(L, lua_istable(L, 3) || lua_isfunction(L, 3), 3,
+		LUASQL_PREFIX"table or function expected");
+  luaL_argcheck(L, batch > 0, 4, LUASQL_PREFIX"invalid batch size");
+  if (group_flush(conn) != SQLITE_OK
+      || sqlite3_prepare_v2(conn->sql_conn, statement, -1, &bulk.vm, NULL)
+      != SQLITE_OK)
+    return conn_error(L, conn);
+  if (bulk.vm == NULL)
+    return luasql_faildirect(L, LUASQL_PREFIX"empty statement");
+
+  bulk.conn = conn;
+  bulk.batch = conn->auto_commit ? batch : 0;
+  bulk.intrans = 0;
+  bulk.row = 0;
+  bulk.changes = 0;
+
+  lua_settop(L, 3);
+  lua_pushcfunction(L, bulk_loop);
+  lua_pushlightuserdata(L, &bulk);
+  lua_pushvalue(L, 3);
+  res = lua_pcall(L, 2, 1, 0);
+  sqlite3_finalize(bulk.vm);
+
+  if (res == 0 && lua_isnil(L, -1))
+    {
+      lua_pushnumber(L, bulk.changes);
+      return 1;
+    }
+  /* error: message on top */
+  if (bulk.intrans)
+    sqlite3_exec(conn->sql_conn, "ROLLBACK", NULL, NULL, NULL);
+  lua_pushnil(L);
+  lua_insert(L, -2);
+  lua_pushinteger(L, bulk.row);
+  return 3;
+}
+
+
+/*
+** Execute every statement of a script, following the tail left by
+** sqlite3_prepare_v2.  Options (table at position 3):
+**   transaction: run the script inside a savepoint, so a failing
+**                statement undoes the whole script;
+**   timings:     also return a table with the elapsed seconds of
+**                each statement.
+** Return the number of rows changed (by sqlite3_total_changes) [and
+** the timings], or nil + errmsg + the index of the failing statement.
+*/
+static int conn_exec_script(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  const char *sql = luaL_checkstring(L, 2);
+  sqlite3 *db = conn->sql_conn;
+  int transaction = 0, timings = 0;
+  int changes = sqlite3_total_changes(db);
+  int index = 0;
+  int res = SQLITE_OK;
+
+  if (!lua_isnoneornil(L, 3))
+    {
+      luaL_checktype(L, 3, LUA_TTABLE);
+      lua_getfield(L, 3, LUASQL_TRANSACTION);
+      transaction = lua_toboolean(L, -1);
+      lua_getfield(L, 3, LUASQL_TIMINGS);
+      timings = lua_toboolean(L, -1);
+    }
+  lua_settop(L, 3);
+  if (timings)
+    lua_newtable(L);
+
+  if (group_flush(conn) != SQLITE_OK)
+    return conn_error(L, conn);
+  if (transaction
+      && sqlite3_exec(db, "SAVEPOINT luasql_script", NULL, NULL, NULL)
+      != SQLITE_OK)
+    return conn_error(L, conn);
+
+  while (*sql != '\0')
+    {
+      double start = monotonic_time();
+      sqlite3_stmt *vm;
+      const char *tail;
+
+      res = sqlite3_prepare_v2(db, sql, -1, &vm, &tail);
+      if (res != SQLITE_OK)
+        {
+          index++;
+          break;
+        }
+      sql = tail;
+      if (vm == NULL)  /* only spaces or comments left */
+        continue;
+      index++;
+      while ((res = sqlite3_step(vm)) == SQLITE_ROW)
+        ;
+      sqlite3_finalize(vm);
+      if (res != SQLITE_DONE)
+        break;
+      res = SQLITE_OK;
+      if (timings)
+        {
+          lua_pushnumber(L, monotonic_time() - start);
+          lua_rawseti(L, 4, index);
+        }
+    }
+
+  if (res == SQLITE_OK && transaction
+      && sqlite3_exec(db, "RELEASE luasql_script", NULL, NULL, NULL)
+      != SQLITE_OK)
+    res = SQLITE_ERROR;
+  if (res != SQLITE_OK)
+    {
+      lua_pushnil(L);
+      lua_pushliteral(L, LUASQL_PREFIX);
+      lua_pushstring(L, sqlite3_errmsg(db));
+      lua_concat(L, 2);
+      lua_pushinteger(L, index);
+      if (transaction)
+        sqlite3_exec(db, "ROLLBACK TO luasql_script; RELEASE luasql_script",
+		     NULL, NULL, NULL);
+      return 3;
+    }
+
+  lua_pushnumber(L, sqlite3_total_changes(db) - changes);
+  if (timings)
+    {
+      lua_pushvalue(L, 4);
+      return 2;
+    }
+  return 1;
+}
+
+
+/*
+** Open a handle for incremental I/O on the BLOB at row 'rowid' of
+** column 'column' in table 'table' of database 'db' ("main", "temp" or
+** the name of an attached database).
+** Return a Blob object.
+*/
+static int conn_openblob(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  const char *db = luaL_optstring(L, 2, "main");
+  const char *table = luaL_checkstring(L, 3);
+  const char *column = luaL_checkstring(L, 4);
+  sqlite3_int64 rowid = (sqlite3_int64)luaL_checknumber(L, 5);
+  int writable = lua_toboolean(L, 6);
+  sqlite3_blob *handle;
+  blob_data *blob;
+
+  if (group_flush(conn) != SQLITE_OK)
+    return conn_error(L, conn);
+  if (sqlite3_blob_open(conn->sql_conn, db, table, column, rowid, writable,
+			&handle) != SQLITE_OK)
+    {
+      int res = conn_error(L, conn);
+      sqlite3_blob_close(handle);
+      return res;
+    }
+
+  blob = (blob_data *)lua_newuserdata(L, sizeof(blob_data));
+  luasql_setmeta(L, LUASQL_BLOB_SQLITE);
+
+  /* fill in structure */
+  blob->closed = 0;
+  blob->conn_data = conn;
+  blob->blob = handle;
+  blob->offset = 0;
+  lua_pushvalue(L, 1);
+  blob->conn = luaL_ref(L, LUA_REGISTRYINDEX);
+  blob->next = conn->blobs;
+  conn->blobs = blob;
+  return 1;
+}
+
+
+/*
+** Read up to 'n' bytes from the given byte offset (starting at 0) or
+** from the end of the last read or write.
+** Return the bytes read, or nil at the end of the BLOB.
+*/
+static int blob_read(lua_State *L)
+{
+  blob_data *blob = getblob(L);
+  int n = luaL_checkint(L, 2);
+  int offset = luaL_optint(L, 3, blob->offset);
+  int size = sqlite3_blob_bytes(blob->blob);
+  void *buff;
+
+  luaL_argcheck(L, n >= 0, 2, LUASQL_PREFIX"invalid size");
+  luaL_argcheck(L, offset >= 0, 3, LUASQL_PREFIX"invalid offset");
+  if (offset >= size)
+    {
+      if (n > 0)
+        lua_pushnil(L);
+      else
+        lua_pushliteral(L, "");
+      return 1;
+    }
+  if (n > size - offset)
+    n = size - offset;
+  /* read into a userdata so the buffer is collected on errors */
+  buff = lua_newuserdata(L, n);
+  if (n > 0 && sqlite3_blob_read(blob->blob, buff, n, offset) != SQLITE_OK)
+    return conn_error(L, blob->conn_data);
+  lua_pushlstring(L, (const char *)buff, n);
+  blob->offset = offset + n;
+  return 1;
+}
+
+
+/*
+** Write a string at the given byte offset or at the end of the last
+** read or write.  The size of a BLOB cannot be changed.
+*/
+static int blob_write(lua_State *L)
+{
+  blob_data *blob = getblob(L);
+  size_t len;
+  const char *data = luaL_checklstring(L, 2, &len);
+  int offset = luaL_optint(L, 3, blob->offset);
+
+  luaL_argcheck(L, offset >= 0, 3, LUASQL_PREFIX"invalid offset");
+  if ((size_t)offset + len > (size_t)sqlite3_blob_bytes(blob->blob))
+    return luasql_faildirect(L, LUASQL_PREFIX"write past the end of the blob");
+  if (sqlite3_blob_write(blob->blob, data, (int)len, offset) != SQLITE_OK)
+    return conn_error(L, blob->conn_data);
+  blob->offset = offset + (int)len;
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Return the size of the BLOB in bytes.
+*/
+static int blob_size(lua_State *L)
+{
+  blob_data *blob = getblob(L);
+  lua_pushinteger(L, sqlite3_blob_bytes(blob->blob));
+  return 1;
+}
+
+
+/*
+** Move the handle to the BLOB of another row of the same table and
+** column.
+*/
+static int blob_reopen(lua_State *L)
+{
+  blob_data *blob = getblob(L);
+  sqlite3_int64 rowid = (sqlite3_int64)luaL_checknumber(L, 2);
+  if (sqlite3_blob_reopen(blob->blob, rowid) != SQLITE_OK)
+    return conn_error(L, blob->conn_data);
+  blob->offset = 0;
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Close the blob handle and remove it from its connection list.
+*/
+static int blob_nullify(lua_State *L, blob_data *blob)
+{
+  blob_data **p = &blob->conn_data->blobs;
+  int res;
+  while (*p != NULL && *p != blob)
+    p = &(*p)->next;
+  if (*p != NULL)
+    *p = blob->next;
+  blob->closed = 1;
+  res = sqlite3_blob_close(blob->blob);
+  blob->blob = NULL;
+  luaL_unref(L, LUA_REGISTRYINDEX, blob->conn);
+  blob->conn = LUA_NOREF;
+  return res;
+}
+
+
+/*
+** Blob object collector function
+*/
+static int blob_gc(lua_State *L)
+{
+  blob_data *blob = (blob_data *)luaL_checkudata(L, 1, LUASQL_BLOB_SQLITE);
+  if (blob != NULL && !blob->closed)
+    blob_nullify(L, blob);
+  else if (blob != NULL) /* closed by its connection */
+    {
+      luaL_unref(L, LUA_REGISTRYINDEX, blob->conn);
+      blob->conn = LUA_NOREF;
+    }
+  return 0;
+}
+
+
+/*
+** Close the blob handle on top of the stack.
+** Return 1
+*/
+static int blob_close(lua_State *L)
+{
+  blob_data *blob = (blob_data *)luaL_checkudata(L, 1, LUASQL_BLOB_SQLITE);
+  luaL_argcheck(L, blob != NULL, 1, LUASQL_PREFIX"blob expected");
+  if (blob->closed) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  if (blob_nullify(L, blob) != SQLITE_OK)
+    return conn_error(L, blob->conn_data);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Start an online backup of the connection into another connection or
+** into the database file at the given path.  Options (table at
+** position 3):
+**   pages_per_step: pages copied by each step (100 by default, -1 for
+**                   all of them);
+**   sleep_ms:       pause between the steps of backup:run;
+**   progress:       function called by backup:run after each step with
+**                   the remaining and total pages; returning false
+**                   stops the backup;
+**   schema:         database to copy ("main" by default).
+** Return a Backup object.
+*/
+static int conn_backup(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  conn_data *dest_data = NULL;
+  const char *schema = "main";
+  int pages_per_step = 100, sleep_ms = 0;
+  sqlite3 *dest_db;
+  sqlite3_backup *handle;
+  backup_data *backup;
+
+  if (lua_isstring(L, 2))
+    {
+      if (sqlite3_open_v2(lua_tostring(L, 2), &dest_db,
+			  SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL)
+	  != SQLITE_OK)
+        {
+          lua_pushnil(L);
+          lua_pushliteral(L, LUASQL_PREFIX);
+          lua_pushstring(L, sqlite3_errmsg(dest_db));
+          lua_concat(L, 2);
+          sqlite3_close(dest_db);
+          return 2;
+        }
+    }
+  else
+    {
+      dest_data = (conn_data *)luaL_checkudata(L, 2, LUASQL_CONNECTION_SQLITE);
+      luaL_argcheck(L, dest_data != NULL, 2,
+		    LUASQL_PREFIX"connection or path expected");
+      luaL_argcheck(L, !dest_data->closed, 2, LUASQL_PREFIX"connection is closed");
+      luaL_argcheck(L, dest_data != conn, 2,
+		    LUASQL_PREFIX"cannot backup a connection into itself");
+      dest_db = dest_data->sql_conn;
+    }
+  if (!lua_isnoneornil(L, 3))
+    {
+      luaL_checktype(L, 3, LUA_TTABLE);
+      lua_getfield(L, 3, LUASQL_PAGESPERSTEP);
+      if (lua_isnumber(L, -1))
+        pages_per_step = lua_tointeger(L, -1);
+      lua_getfield(L, 3, LUASQL_SLEEPMS);
+      if (lua_isnumber(L, -1))
+        sleep_ms = lua_tointeger(L, -1);
+      lua_getfield(L, 3, LUASQL_SCHEMA);
+      if (lua_isstring(L, -1))
+        schema = lua_tostring(L, -1);
+    }
+
+  /* writes batched by group commit are copied too */
+  group_flush(conn);
+  if (dest_data != NULL)
+    group_flush(dest_data);
+  handle = sqlite3_backup_init(dest_db, schema, conn->sql_conn, schema);
+  if (handle == NULL)
+    {
+      lua_pushnil(L);
+      lua_pushliteral(L, LUASQL_PREFIX);
+      lua_pushstring(L, sqlite3_errmsg(dest_db));
+      lua_concat(L, 2);
+      if (dest_data == NULL)
+        sqlite3_close(dest_db);
+      return 2;
+    }
+
+  backup = (backup_data *)lua_newuserdata(L, sizeof(backup_data));
+  luasql_setmeta(L, LUASQL_BACKUP_SQLITE);
+
+  /* fill in structure */
+  backup->closed = 0;
+  backup->conn_data = conn;
+  backup->dest_data = dest_data;
+  backup->dest_db = dest_db;
+  backup->backup = handle;
+  backup->pages_per_step = pages_per_step;
+  backup->sleep_ms = sleep_ms;
+  lua_pushvalue(L, 1);
+  backup->conn = luaL_ref(L, LUA_REGISTRYINDEX);
+  backup->dest = LUA_NOREF;
+  if (dest_data != NULL)
+    {
+      lua_pushvalue(L, 2);
+      backup->dest = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+  backup->progress = LUA_NOREF;
+  if (lua_istable(L, 3))
+    {
+      lua_getfield(L, 3, LUASQL_PROGRESS);
+      if (lua_isfunction(L, -1))
+        backup->progress = luaL_ref(L, LUA_REGISTRYINDEX);
+      else
+        lua_pop(L, 1);
+    }
+  backup->next = conn->backups;
+  conn->backups = backup;
+  return 1;
+}
+
+
+/*
+** Pushes the error 'res' of a backup, taken from the source connection
+** when it failed there and from the destination otherwise.
+** Return nil + errmsg.
+*/
+static int backup_error(lua_State *L, backup_data *backup, int res)
+{
+  sqlite3 *db = backup->dest_db;
+  if (sqlite3_errcode(db) != res
+      && sqlite3_errcode(backup->conn_data->sql_conn) == res)
+    db = backup->conn_data->sql_conn;
+  lua_pushnil(L);
+  lua_pushliteral(L, LUASQL_PREFIX);
+  lua_pushstring(L, sqlite3_errmsg(db));
+  lua_concat(L, 2);
+  return 2;
+}
+
+
+/*
+** Copy up to 'n' pages (by default the pages_per_step of the backup).
+** A busy or locked source is not an error; the step can be retried.
+** Return true when the copy is complete and false otherwise.
+*/
+static int backup_step(lua_State *L)
+{
+  backup_data *backup = getbackup(L);
+  int n = luaL_optint(L, 2, backup->pages_per_step);
+  int res;
+
+  if (backup->dest_data != NULL && backup->dest_data->closed)
+    return luasql_faildirect(L, LUASQL_PREFIX"destination connection is closed");
+  res = sqlite3_backup_step(backup->backup, n);
+  if (res != SQLITE_OK && res != SQLITE_DONE && res != SQLITE_BUSY
+      && res != SQLITE_LOCKED)
+    return backup_error(L, backup, res);
+  lua_pushboolean(L, res == SQLITE_DONE);
+  return 1;
+}
+
+
+/*
+** Return the number of pages still to be copied, as of the last step.
+*/
+static int backup_remaining(lua_State *L)
+{
+  backup_data *backup = getbackup(L);
+  lua_pushinteger(L, sqlite3_backup_remaining(backup->backup));
+  return 1;
+}
+
+
+/*
+** Return the number of pages of the source, as of the last step.
+*/
+static int backup_pagecount(lua_State *L)
+{
+  backup_data *backup = getbackup(L);
+  lua_pushinteger(L, sqlite3_backup_pagecount(backup->backup));
+  return 1;
+}
+
+
+/*
+** Finish the backup and remove it from its connection list.
+** Return the result of sqlite3_backup_finish.
+*/
+static int backup_nullify(lua_State *L, backup_data *backup)
+{
+  backup_data **p = &backup->conn_data->backups;
+  int res;
+  while (*p != NULL && *p != backup)
+    p = &(*p)->next;
+  if (*p != NULL)
+    *p = backup->next;
+  backup->closed = 1;
+  res = sqlite3_backup_finish(backup->backup);
+  backup->backup = NULL;
+  luaL_unref(L, LUA_REGISTRYINDEX, backup->conn);
+  backup->conn = LUA_NOREF;
+  luaL_unref(L, LUA_REGISTRYINDEX, backup->dest);
+  backup->dest = LUA_NOREF;
+  luaL_unref(L, LUA_REGISTRYINDEX, backup->progress);
+  backup->progress = LUA_NOREF;
+  return res;
+}
+
+
+/*
+** Finish the backup object on top of the stack.
+** Return true, or nil + errmsg if some step failed.
+*/
+static int backup_finish(lua_State *L)
+{
+  backup_data *backup = (backup_data *)luaL_checkudata(L, 1, LUASQL_BACKUP_SQLITE);
+  int res;
+  luaL_argcheck(L, backup != NULL, 1, LUASQL_PREFIX"backup expected");
+  if (backup->closed) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  res = backup_nullify(L, backup);
+  if (res != SQLITE_OK)
+    res = backup_error(L, backup, res);
+  else
+    {
+      lua_pushboolean(L, 1);
+      res = 1;
+    }
+  if (backup->dest_data == NULL)
+    sqlite3_close(backup->dest_db);
+  backup->dest_db = NULL;
+  return res;
+}
+
+
+/*
+** Step the backup until it is complete, sleeping 'sleep_ms' between
+** steps (and backing off while the source is busy) and calling the
+** progress function after each one, then finish it.
+** Return true, or nil + errmsg.
+*/
+static int backup_run(lua_State *L)
+{
+  backup_data *backup = getbackup(L);
+  int res, wait = 1;
+
+  lua_settop(L, 1);
+  for (;;)
+    {
+      if (backup->dest_data != NULL && backup->dest_data->closed)
+        return luasql_faildirect(L, LUASQL_PREFIX"destination connection is closed");
+      res = sqlite3_backup_step(backup->backup, backup->pages_per_step);
+      if (res != SQLITE_OK && res != SQLITE_DONE && res != SQLITE_BUSY
+	  && res != SQLITE_LOCKED)
+        return backup_error(L, backup, res);
+      if (backup->progress != LUA_NOREF)
+        {
+          lua_rawgeti(L, LUA_REGISTRYINDEX, backup->progress);
+          lua_pushinteger(L, sqlite3_backup_remaining(backup->backup));
+          lua_pushinteger(L, sqlite3_backup_pagecount(backup->backup));
+          lua_call(L, 2, 1);
+          if (lua_isboolean(L, -1) && !lua_toboolean(L, -1))
+            return luasql_faildirect(L, LUASQL_PREFIX"backup interrupted");
+          lua_pop(L, 1);
+        }
+      if (res == SQLITE_DONE)
+        break;
+      /* back off up to 100 ms while the source is busy */
+      if (res == SQLITE_BUSY || res == SQLITE_LOCKED)
+        {
+          sqlite3_sleep(backup->sleep_ms > wait ? backup->sleep_ms : wait);
+          if (wait < 100)
+            wait *= 2;
+        }
+      else
+        {
+          wait = 1;
+          if (backup->sleep_ms > 0)
+            sqlite3_sleep(backup->sleep_ms);
+        }
+    }
+  return backup_finish(L);
+}
+
+
+/*
+** Backup object collector function
+*/
+static int backup_gc(lua_State *L)
+{
+  backup_data *backup = (backup_data *)luaL_checkudata(L, 1, LUASQL_BACKUP_SQLITE);
+  if (backup != NULL && !backup->closed)
+    {
+      backup_nullify(L, backup);
+      if (backup->dest_data == NULL)
+        sqlite3_close(backup->dest_db);
+      backup->dest_db = NULL;
+    }
+  else if (backup != NULL) /* finished by its connection */
+    {
+      luaL_unref(L, LUA_REGISTRYINDEX, backup->conn);
+      backup->conn = LUA_NOREF;
+      luaL_unref(L, LUA_REGISTRYINDEX, backup->dest);
+      backup->dest = LUA_NOREF;
+      luaL_unref(L, LUA_REGISTRYINDEX, backup->progress);
+      backup->progress = LUA_NOREF;
+    }
+  return 0;
+}
+
+
+/*
+** Return the image of a database of the connection ("main" by default)
+** as a string.
+*/
+static int conn_serialize(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  const char *schema = luaL_optstring(L, 2, "main");
+  sqlite3_int64 size;
+  unsigned char *image;
+
+  if (group_flush(conn) != SQLITE_OK)
+    return conn_error(L, conn);
+  /* in-memory databases are contiguous and can be read without a copy */
+  image = sqlite3_serialize(conn->sql_conn, schema, &size,
+			    SQLITE_SERIALIZE_NOCOPY);
+  if (image != NULL)
+    {
+      lua_pushlstring(L, (const char *)image, (size_t)size);
+      return 1;
+    }
+  image = sqlite3_serialize(conn->sql_conn, schema, &size, 0);
+  if (image == NULL)
+    {
+      if (size == 0)  /* empty database */
+        {
+          lua_pushliteral(L, "");
+          return 1;
+        }
+      return conn_error(L, conn);
+    }
+  lua_pushlstring(L, (const char *)image, (size_t)size);
+  sqlite3_free(image);
+  return 1;
+}
+
+
+/*
+** Lua function called by SQL, created by conn:createfunction or
+** conn:createaggregate.
+*/
+typedef struct
+{
+  lua_State    *T;                 /* thread running the function */
+  int          thread;             /* reference to T */
+  int          fn;                 /* scalar or step function */
+  int          final;              /* final function of aggregates */
+} func_data;
+
+
+/*
+** Pushes a SQL value with the same mapping as push_column.
+*/
+static void push_value(lua_State *L, sqlite3_value *value) {
+  switch (sqlite3_value_type(value)) {
+  case SQLITE_INTEGER:
+    lua_pushinteger(L, sqlite3_value_int64(value));
+    break;
+  case SQLITE_FLOAT:
+    lua_pushnumber(L, sqlite3_value_double(value));
+    break;
+  case SQLITE_TEXT:
+    lua_pushlstring(L, (const char *)sqlite3_value_text(value),
+		    sqlite3_value_bytes(value));
+    break;
+  case SQLITE_BLOB:
+    lua_pushlstring(L, sqlite3_value_blob(value), sqlite3_value_bytes(value));
+    break;
+  default:
+    lua_pushnil(L);
+    break;
+  }
+}
+
+
+/*
+** Sets the result of a SQL function to the Lua value at 'idx', with the
+** same mapping as bind_value.
+*/
+static void result_value(sqlite3_context *ctx, lua_State *L, int idx)
+{
+  switch (lua_type(L, idx)) {
+  case LUA_TNONE:
+  case LUA_TNIL:
+    sqlite3_result_null(ctx);
+    break;
+  case LUA_TBOOLEAN:
+    sqlite3_result_int(ctx, lua_toboolean(L, idx));
+    break;
+  case LUA_TNUMBER:
+    {
+      lua_Number n = lua_tonumber(L, idx);
+      if (n >= -9.2e18 && n <= 9.2e18 && n == (lua_Number)(sqlite3_int64)n)
+        sqlite3_result_int64(ctx, (sqlite3_int64)n);
+      else
+        sqlite3_result_double(ctx, n);
+    }
+    break;
+  case LUA_TSTRING:
+    {
+      size_t len;
+      const char *s = lua_tolstring(L, idx, &len);
+      sqlite3_result_text(ctx, s, (int)len, SQLITE_TRANSIENT);
+    }
+    break;
+  default:
+    {
+      char *msg = sqlite3_mprintf(LUASQL_PREFIX"cannot return a %s value",
+				  luaL_typename(L, idx));
+      sqlite3_result_error(ctx, msg, -1);
+      sqlite3_free(msg);
+    }
+    break;
+  }
+}
+
+
+/*
+** Calls the function on top of the thread with the arguments of the
+** SQL function and the 'extra' values below it.
+** Return 0 on success, leaving the result on top of the thread, or sets
+** the error of the SQL function.
+*/
+static int func_pcall(sqlite3_context *ctx, lua_State *T, int extra,
+		      int argc, sqlite3_value **argv)
+{
+  int i;
+  if (!lua_checkstack(T, argc))
+    {
+      sqlite3_result_error_nomem(ctx);
+      return 1;
+    }
+  for (i = 0; i < argc; i++)
+    push_value(T, argv[i]);
+  if (lua_pcall(T, extra + argc, 1, 0) != 0)
+    {
+      sqlite3_result_error(ctx, lua_tostring(T, -1), -1);
+      return 1;
+    }
+  return 0;
+}
+
+
+/*
+** Calls a scalar function.
+*/
+static void func_call(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+  func_data *func = (func_data *)sqlite3_user_data(ctx);
+  lua_State *T = func->T;
+  lua_rawgeti(T, LUA_REGISTRYINDEX, func->fn);
+  if (func_pcall(ctx, T, 0, argc, argv) == 0)
+    result_value(ctx, T, -1);
+  lua_settop(T, 0);
+}
+
+
+/*
+** Calls the step function of an aggregate with its current state and
+** keeps the value returned as the new state.  The state is referenced
+** by the aggregate context (0 before the first step).
+*/
+static void func_step(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+  func_data *func = (func_data *)sqlite3_user_data(ctx);
+  lua_State *T = func->T;
+  int *state = (int *)sqlite3_aggregate_context(ctx, sizeof(int));
+
+  if (state == NULL)
+    {
+      sqlite3_result_error_nomem(ctx);
+      return;
+    }
+  lua_rawgeti(T, LUA_REGISTRYINDEX, func->fn);
+  if (*state == 0)
+    lua_pushnil(T);
+  else
+    lua_rawgeti(T, LUA_REGISTRYINDEX, *state);
+  if (func_pcall(ctx, T, 1, argc, argv) == 0)
+    {
+      if (*state != 0)
+        luaL_unref(T, LUA_REGISTRYINDEX, *state);
+      *state = luaL_ref(T, LUA_REGISTRYINDEX);
+    }
+  lua_settop(T, 0);
+}
+
+
+/*
+** Calls the final function of an aggregate with its state, or returns
+** the state if there is no final function.
+*/
+static void func_final(sqlite3_context *ctx)
+{
+  func_data *func = (func_data *)sqlite3_user_data(ctx);
+  lua_State *T = func->T;
+  int *state = (int *)sqlite3_aggregate_context(ctx, 0);
+
+  if (func->final != LUA_NOREF)
+    lua_rawgeti(T, LUA_REGISTRYINDEX, func->final);
+  if (state == NULL || *state == 0)
+    lua_pushnil(T);
+  else
+    {
+      lua_rawgeti(T, LUA_REGISTRYINDEX, *state);
+      luaL_unref(T, LUA_REGISTRYINDEX, *state);
+      *state = 0;
+    }
+  if (func->final == LUA_NOREF || func_pcall(ctx, T, 1, 0, NULL) == 0)
+    result_value(ctx, T, -1);
+  lua_settop(T, 0);
+}
+
+
+/*
+** Releases a function when it is replaced or its connection is closed.
+*/
+static void func_destroy(void *p)
+{
+  func_data *func = (func_data *)p;
+  luaL_unref(func->T, LUA_REGISTRYINDEX, func->fn);
+  luaL_unref(func->T, LUA_REGISTRYINDEX, func->final);
+  luaL_unref(func->T, LUA_REGISTRYINDEX, func->thread);
+  free(func);
+}
+
+
+/*
+** Registers the function at position 'fn' as a SQL scalar function,
+** or as the step function of an aggregate if 'aggregate' is set, with
+** the final function at position 'final' (0 for none).
+** Return true or nil + errmsg.
+*/
+static int create_function(lua_State *L, conn_data *conn, const char *name,
+			   int nargs, int flags, int fn, int aggregate,
+			   int final)
+{
+  func_data *func = (func_data *)malloc(sizeof(func_data));
+  int res;
+
+  if (func == NULL)
+    return luaL_error(L, LUASQL_PREFIX"out of memory");
+  func->T = lua_newthread(L);
+  func->thread = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_pushvalue(L, fn);
+  func->fn = luaL_ref(L, LUA_REGISTRYINDEX);
+  func->final = LUA_NOREF;
+  if (final != 0)
+    {
+      lua_pushvalue(L, final);
+      func->final = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+  /* the function is destroyed by SQLite even when this fails */
+  if (!aggregate)
+    res = sqlite3_create_function_v2(conn->sql_conn, name, nargs,
+				     SQLITE_UTF8 | flags, func, func_call,
+				     NULL, NULL, func_destroy);
+  else
+    res = sqlite3_create_function_v2(conn->sql_conn, name, nargs,
+				     SQLITE_UTF8 | flags, func, NULL,
+				     func_step, func_final, func_destroy);
+  if (res != SQLITE_OK)
+    return conn_error(L, conn);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Create (or replace) a SQL scalar function implemented by a Lua
+** function, called with the SQL arguments.  'nargs' is -1 for any
+** number of arguments.  Options (table at position 5): deterministic
+** (the function always returns the same result for the same arguments,
+** so it can be used in indexes on expressions).
+** Return true or nil + errmsg.
+*/
+static int conn_createfunction(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  const char *name = luaL_checkstring(L, 2);
+  int nargs = luaL_checkint(L, 3);
+  int flags = 0;
+
+  luaL_checktype(L, 4, LUA_TFUNCTION);
+  if (!lua_isnoneornil(L, 5))
+    {
+      luaL_checktype(L, 5, LUA_TTABLE);
+      lua_getfield(L, 5, LUASQL_DETERMINISTIC);
+      if (lua_toboolean(L, -1))
+        flags |= SQLITE_DETERMINISTIC;
+      lua_pop(L, 1);
+    }
+  return create_function(L, conn, name, nargs, flags, 4, 0, 0);
+}
+
+
+/*
+** Create (or replace) a SQL aggregate function.  For each row 'step' is
+** called with the current state (nil at first) and the SQL arguments,
+** and returns the new state; 'final' is called with the last state and
+** returns the result (without 'final' the result is the state).
+** Return true or nil + errmsg.
+*/
+static int conn_createaggregate(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  const char *name = luaL_checkstring(L, 2);
+  int nargs = luaL_checkint(L, 3);
+
+  luaL_checktype(L, 4, LUA_TFUNCTION);
+  if (lua_isnoneornil(L, 5))  /* the state is the result */
+    return create_function(L, conn, name, nargs, 0, 4, 1, 0);
+  luaL_checktype(L, 5, LUA_TFUNCTION);
+  return create_function(L, conn, name, nargs, 0, 4, 1, 5);
+}
+
+
+/*
+** Virtual table module created by conn:createvtab, shared by its
+** vtab and cursor objects.
+*/
+typedef struct
+{
+  lua_State    *T;                 /* thread running the callbacks */
+  int          thread;             /* reference to T */
+  int          columns;            /* reference to the list of columns */
+  int          ncols;
+  int          scan;               /* reference to the scan function */
+  int          best_index;         /* reference to best_index, or LUA_NOREF */
+  result_cache *results;           /* of the connection */
+} vtab_module;
+
+
+typedef struct
+{
+  sqlite3_vtab base;
+  vtab_module  *module;
+} lua_vtab;
+
+
+typedef struct
+{
+  sqlite3_vtab_cursor base;
+  int          rows;               /* reference to the iterator or table */
+  int          row;                /* reference to the current row */
+  int          index;              /* number of the current row */
+  int          eof;
+} lua_vtab_cursor;
+
+
+/*
+** Operators of the constraints passed to best_index and scan.
+*/
+static const struct { int op; const char *name; } vtab_ops[] = {
+  {SQLITE_INDEX_CONSTRAINT_EQ, "="},
+  {SQLITE_INDEX_CONSTRAINT_GT, ">"},
+  {SQLITE_INDEX_CONSTRAINT_LE, "<="},
+  {SQLITE_INDEX_CONSTRAINT_LT, "<"},
+  {SQLITE_INDEX_CONSTRAINT_GE, ">="},
+  {SQLITE_INDEX_CONSTRAINT_MATCH, "match"},
+  {SQLITE_INDEX_CONSTRAINT_LIKE, "like"},
+  {SQLITE_INDEX_CONSTRAINT_GLOB, "glob"},
+  {SQLITE_INDEX_CONSTRAINT_REGEXP, "regexp"},
+  {SQLITE_INDEX_CONSTRAINT_NE, "!="},
+  {SQLITE_INDEX_CONSTRAINT_ISNOT, "is not"},
+  {SQLITE_INDEX_CONSTRAINT_ISNOTNULL, "is not null"},
+  {SQLITE_INDEX_CONSTRAINT_ISNULL, "is null"},
+  {SQLITE_INDEX_CONSTRAINT_IS, "is"},
+  {0, NULL}
+};
+
+
+static const char *vtab_opname(int op)
+{
+  int i;
+  for (i = 0; vtab_ops[i].name != NULL; i++)
+    if (vtab_ops[i].op == op)
+      return vtab_ops[i].name;
+  return NULL;
+}
+
+
+/*
+** Sets the error message of a virtual table from the top of the thread.
+*/
+static int vtab_error(sqlite3_vtab *vtab, lua_State *T)
+{
+  sqlite3_free(vtab->zErrMsg);
+  vtab->zErrMsg = sqlite3_mprintf("%s", lua_tostring(T, -1));
+  return SQLITE_ERROR;
+}
+
+
+/*
+** Pushes a constraint table ({column=name, op=op}) of a virtual table.
+*/
+static void vtab_pushconstraint(lua_State *T, vtab_module *module,
+				int column, const char *op)
+{
+  lua_createtable(T, 0, 3);
+  if (column >= 0)
+    {
+      lua_rawgeti(T, LUA_REGISTRYINDEX, module->columns);
+      lua_rawgeti(T, -1, column + 1);
+      lua_setfield(T, -3, "column");
+      lua_pop(T, 1);
+    }
+  else
+    {
+      lua_pushliteral(T, "rowid");
+      lua_setfield(T, -2, "column");
+    }
+  lua_pushstring(T, op);
+  lua_setfield(T, -2, "op");
+}
+
+
+static int vtab_connect(sqlite3 *db, void *aux, int argc,
+			const char *const *argv, sqlite3_vtab **pvtab,
+			char **errmsg)
+{
+  vtab_module *module = (vtab_module *)aux;
+  lua_State *T = module->T;
+  int top = lua_gettop(T);
+  lua_vtab *vtab;
+  char *sql = sqlite3_mprintf("CREATE TABLE x(");
+  int i, res;
+
+  lua_rawgeti(T, LUA_REGISTRYINDEX, module->columns);
+  for (i = 1; i <= module->ncols && sql != NULL; i++)
+    {
+      char *s;
+      lua_rawgeti(T, -1, i);
+      s = sqlite3_mprintf("%s%s\"%w\"", sql, i > 1 ? "," : "",
+			  lua_tostring(T, -1));
+      sqlite3_free(sql);
+      sql = s;
+      lua_pop(T, 1);
+    }
+  lua_settop(T, top);
+  if (sql == NULL || (sql = sqlite3_mprintf("%z)", sql)) == NULL)
+    return SQLITE_NOMEM;
+  res = sqlite3_declare_vtab(db, sql);
+  sqlite3_free(sql);
+  if (res != SQLITE_OK)
+    return res;
+
+  vtab = (lua_vtab *)sqlite3_malloc(sizeof(lua_vtab));
+  if (vtab == NULL)
+    return SQLITE_NOMEM;
+  memset(vtab, 0, sizeof(lua_vtab));
+  vtab->module = module;
+  *pvtab = &vtab->base;
+  return SQLITE_OK;
+}
+
+
+static int vtab_disconnect(sqlite3_vtab *vtab)
+{
+  sqlite3_free(vtab);
+  return SQLITE_OK;
+}
+
+
+/*
+** Chooses the constraints passed to scan: those selected by the
+** best_index function or, without it, the equality constraints.
+** The plan is encoded in idxStr as "column,op;" for each argument.
+*/
+static int vtab_bestindex(sqlite3_vtab *pvtab, sqlite3_index_info *info)
+{
+  vtab_module *module = ((lua_vtab *)pvtab)->module;
+  lua_State *T = module->T;
+  int top = lua_gettop(T);
+  int *usable = (int *)sqlite3_malloc(sizeof(int) * (info->nConstraint + 1));
+  int n = 0, nargs = 0, cost = 0, i;
+  char *plan = sqlite3_mprintf("");
+
+  /* its rows are not known to the result cache */
+  if (module->results->reads != NULL)
+    module->results->cacheable = 0;
+  if (usable == NULL || plan == NULL)
+    {
+      sqlite3_free(usable);
+      sqlite3_free(plan);
+      return SQLITE_NOMEM;
+    }
+  /* list of usable constraints */
+  lua_newtable(T);
+  for (i = 0; i < info->nConstraint; i++)
+    {
+      const char *op = vtab_opname(info->aConstraint[i].op);
+      if (!info->aConstraint[i].usable || op == NULL)
+        continue;
+      vtab_pushconstraint(T, module, info->aConstraint[i].iColumn, op);
+      lua_rawseti(T, -2, ++n);
+      usable[n] = i;
+    }
+
+  if (module->best_index != LUA_NOREF)
+    {
+      lua_rawgeti(T, LUA_REGISTRYINDEX, module->best_index);
+      lua_pushvalue(T, -2);
+      if (lua_pcall(T, 1, 2, 0) != 0)
+        {
+          sqlite3_free(usable);
+          sqlite3_free(plan);
+          vtab_error(pvtab, T);
+          lua_settop(T, top);
+          return SQLITE_ERROR;
+        }
+      if ((cost = lua_isnumber(T, -1)) != 0)
+        info->estimatedCost = lua_tonumber(T, -1);
+      lua_pop(T, 1);
+    }
+  else  /* choose the equality constraints */
+    {
+      lua_newtable(T);
+      for (i = 1; i <= n; i++)
+        if (info->aConstraint[usable[i]].op == SQLITE_INDEX_CONSTRAINT_EQ)
+          {
+            lua_pushinteger(T, i);
+            lua_rawseti(T, -2, ++nargs);
+          }
+      nargs = 0;
+    }
+
+  /* chosen constraints are on top */
+  if (lua_istable(T, -1))
+    for (i = 1; ; i++)
+      {
+        int k, c;
+        lua_rawgeti(T, -1, i);
+        k = lua_tointeger(T, -1);
+        lua_pop(T, 1);
+        if (k < 1 || k > n)
+          break;
+        c = usable[k];
+        if (info->aConstraintUsage[c].argvIndex > 0)  /* repeated */
+          continue;
+        info->aConstraintUsage[c].argvIndex = ++nargs;
+        plan = sqlite3_mprintf("%z%d,%d;", plan, info->aConstraint[c].iColumn,
+			       info->aConstraint[c].op);
+        if (plan == NULL)
+          break;
+      }
+  if (!cost)
+    info->estimatedCost = nargs > 0 ? 10.0 : 1e6;
+  info->idxStr = plan;
+  info->needToFreeIdxStr = 1;
+  sqlite3_free(usable);
+  lua_settop(T, top);
+  return plan == NULL ? SQLITE_NOMEM : SQLITE_OK;
+}
+
+
+static int vtab_open(sqlite3_vtab *pvtab, sqlite3_vtab_cursor **pcur)
+{
+  lua_vtab_cursor *cur = (lua_vtab_cursor *)sqlite3_malloc(sizeof(lua_vtab_cursor));
+  if (cur == NULL)
+    return SQLITE_NOMEM;
+  memset(cur, 0, sizeof(lua_vtab_cursor));
+  cur->rows = LUA_NOREF;
+  cur->row = LUA_NOREF;
+  cur->eof = 1;
+  *pcur = &cur->base;
+  return SQLITE_OK;
+}
+
+
+static int vtab_close(sqlite3_vtab_cursor *pcur)
+{
+  lua_vtab_cursor *cur = (lua_vtab_cursor *)pcur;
+  lua_State *T = ((lua_vtab *)pcur->pVtab)->module->T;
+  luaL_unref(T, LUA_REGISTRYINDEX, cur->rows);
+  luaL_unref(T, LUA_REGISTRYINDEX, cur->row);
+  sqlite3_free(cur);
+  return SQLITE_OK;
+}
+
+
+/*
+** Moves to the next row, calling the iterator or indexing the table
+** returned by scan.
+*/
+static int vtab_next(sqlite3_vtab_cursor *pcur)
+{
+  lua_vtab_cursor *cur = (lua_vtab_cursor *)pcur;
+  lua_State *T = ((lua_vtab *)pcur->pVtab)->module->T;
+  int top = lua_gettop(T);
+
+  lua_rawgeti(T, LUA_REGISTRYINDEX, cur->rows);
+  if (lua_isfunction(T, -1))
+    {
+      if (lua_pcall(T, 0, 1, 0) != 0)
+        {
+          vtab_error(pcur->pVtab, T);
+          lua_settop(T, top);
+          return SQLITE_ERROR;
+        }
+    }
+  else
+    lua_rawgeti(T, -1, cur->index + 1);
+  luaL_unref(T, LUA_REGISTRYINDEX, cur->row);
+  cur->row = LUA_NOREF;
+  if (lua_isnil(T, -1))
+    cur->eof = 1;
+  else if (!lua_istable(T, -1))
+    {
+      lua_pushfstring(T, LUASQL_PREFIX"row is a %s value", luaL_typename(T, -1));
+      vtab_error(pcur->pVtab, T);
+      lua_settop(T, top);
+      return SQLITE_ERROR;
+    }
+  else
+    {
+      cur->row = luaL_ref(T, LUA_REGISTRYINDEX);
+      cur->index++;
+    }
+  lua_settop(T, top);
+  return SQLITE_OK;
+}
+
+
+/*
+** Calls scan with the constraints chosen by vtab_bestindex, with their
+** values, and moves to the first row.
+*/
+static int vtab_filter(sqlite3_vtab_cursor *pcur, int idxnum,
+		       const char *idxstr, int argc, sqlite3_value **argv)
+{
+  lua_vtab_cursor *cur = (lua_vtab_cursor *)pcur;
+  vtab_module *module = ((lua_vtab *)pcur->pVtab)->module;
+  lua_State *T = module->T;
+  int top = lua_gettop(T);
+  int i;
+
+  (void)idxnum;
+  lua_rawgeti(T, LUA_REGISTRYINDEX, module->scan);
+  lua_createtable(T, argc, 0);
+  for (i = 0; i < argc && idxstr != NULL; i++)
+    {
+      int column = (int)strtol(idxstr, (char **)&idxstr, 10);
+      int op = (int)strtol(idxstr + 1, (char **)&idxstr, 10);
+      idxstr++;  /* skip ';' */
+      vtab_pushconstraint(T, module, column, vtab_opname(op));
+      push_value(T, argv[i]);
+      lua_setfield(T, -2, "value");
+      lua_rawseti(T, -2, i + 1);
+    }
+  if (lua_pcall(T, 1, 1, 0) != 0)
+    {
+      vtab_error(pcur->pVtab, T);
+      lua_settop(T, top);
+      return SQLITE_ERROR;
+    }
+  if (!lua_isfunction(T, -1) && !lua_istable(T, -1))
+    {
+      lua_pushfstring(T, LUASQL_PREFIX"scan returned a %s value",
+		      luaL_typename(T, -1));
+      vtab_error(pcur->pVtab, T);
+      lua_settop(T, top);
+      return SQLITE_ERROR;
+    }
+  luaL_unref(T, LUA_REGISTRYINDEX, cur->rows);
+  cur->rows = luaL_ref(T, LUA_REGISTRYINDEX);
+  lua_settop(T, top);
+  cur->index = 0;
+  cur->eof = 0;
+  return vtab_next(pcur);
+}
+
+
+static int vtab_eof(sqlite3_vtab_cursor *pcur)
+{
+  return ((lua_vtab_cursor *)pcur)->eof;
+}
+
+
+/*
+** Returns a column of the current row, looked up by its name or, if
+** absent, by its position.
+*/
+static int vtab_column(sqlite3_vtab_cursor *pcur, sqlite3_context *ctx,
+		       int column)
+{
+  lua_vtab_cursor *cur = (lua_vtab_cursor *)pcur;
+  vtab_module *module = ((lua_vtab *)pcur->pVtab)->module;
+  lua_State *T = module->T;
+  int top = lua_gettop(T);
+
+  lua_rawgeti(T, LUA_REGISTRYINDEX, cur->row);
+  lua_rawgeti(T, LUA_REGISTRYINDEX, module->columns);
+  lua_rawgeti(T, -1, column + 1);
+  lua_gettable(T, -3);
+  if (lua_isnil(T, -1))
+    lua_rawgeti(T, -3, column + 1);
+  result_value(ctx, T, -1);
+  lua_settop(T, top);
+  return SQLITE_OK;
+}
+
+
+static int vtab_rowid(sqlite3_vtab_cursor *pcur, sqlite3_int64 *rowid)
+{
+  *rowid = ((lua_vtab_cursor *)pcur)->index;
+  return SQLITE_OK;
+}
+
+
+static sqlite3_module lua_vtab_module = {
+  0,                /* iVersion */
+  NULL,             /* xCreate: eponymous-only */
+  vtab_connect,
+  vtab_bestindex,
+  vtab_disconnect,
+  NULL,             /* xDestroy */
+  vtab_open,
+  vtab_close,
+  vtab_filter,
+  vtab_next,
+  vtab_eof,
+  vtab_column,
+  vtab_rowid,        /* other methods are not supported */
+};
+
+
+/*
+** Releases a module when its connection is closed.
+*/
+static void vtab_destroy(void *p)
+{
+  vtab_module *module = (vtab_module *)p;
+  luaL_unref(module->T, LUA_REGISTRYINDEX, module->columns);
+  luaL_unref(module->T, LUA_REGISTRYINDEX, module->scan);
+  luaL_unref(module->T, LUA_REGISTRYINDEX, module->best_index);
+  luaL_unref(module->T, LUA_REGISTRYINDEX, module->thread);
+  free(module);
+}
+
+
+/*
+** Create a read-only virtual table named 'name', with the given list
+** of column names, whose rows are produced by Lua.  Options (table at
+** position 4):
+**   scan:       function called with the list of constraints chosen for
+**               a query ({column=, op=, value=}); returns a table of
+**               rows or an iterator function returning one row per
+**               call.  A row is a table indexed by column names or
+**               positions.
+**   best_index: optional function called with the list of usable
+**               constraints ({column=, op=}); returns the list of the
+**               positions of those to pass to scan and the estimated
+**               cost.  By default the equality constraints are passed.
+** SQLite checks every constraint again, so scan may return more rows.
+** Return true or nil + errmsg.
+*/
+static int conn_createvtab(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  const char *name = luaL_checkstring(L, 2);
+  vtab_module *module;
+  int i, ncols;
+
+  luaL_checktype(L, 3, LUA_TTABLE);
+  luaL_checktype(L, 4, LUA_TTABLE);
+  ncols = lua_objlen(L, 3);
+  luaL_argcheck(L, ncols > 0, 3, LUASQL_PREFIX"columns expected");
+  for (i = 1; i <= ncols; i++)
+    {
+      lua_rawgeti(L, 3, i);
+      if (!lua_isstring(L, -1))
+        return luaL_argerror(L, 3, LUASQL_PREFIX"column names must be strings");
+      lua_pop(L, 1);
+    }
+  lua_getfield(L, 4, LUASQL_SCAN);
+  luaL_argcheck(L, lua_isfunction(L, -1), 4, LUASQL_PREFIX"scan function expected");
+  lua_getfield(L, 4, LUASQL_BESTINDEX);
+
+  module = (vtab_module *)malloc(sizeof(vtab_module));
+  if (module == NULL)
+    return luaL_error(L, LUASQL_PREFIX"out of memory");
+  module->best_index = lua_isfunction(L, -1) ? luaL_ref(L, LUA_REGISTRYINDEX)
+    : (lua_pop(L, 1), LUA_NOREF);
+  module->scan = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_pushvalue(L, 3);
+  module->columns = luaL_ref(L, LUA_REGISTRYINDEX);
+  module->ncols = ncols;
+  module->results = &conn->results;
+  module->T = lua_newthread(L);
+  module->thread = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  /* the module is destroyed by SQLite even when this fails */
+  if (sqlite3_create_module_v2(conn->sql_conn, name, &lua_vtab_module, module,
+			       vtab_destroy) != SQLITE_OK)
+    return conn_error(L, conn);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Commit the current transaction.
+*/
+static int conn_commit(lua_State *L)
+{
+  char *errmsg;
+  conn_data *conn = getconnection(L);
+  int res;
+  const char *sql = "COMMIT";
+
+  if (conn->group.open)
+    {
+      if (group_flush(conn) != SQLITE_OK)
+        return conn_error(L, conn);
+      lua_pushboolean(L, 1);
+      return 1;
+    }
+  if (conn->auto_commit == 0) sql = "COMMIT;BEGIN";
+
+  res = sqlite3_exec(conn->sql_conn, sql, NULL, NULL, &errmsg);
+
+  if (res != SQLITE_OK)
+    {
+      lua_pushnil(L);
+      lua_pushliteral(L, LUASQL_PREFIX);
+      lua_pushstring(L, errmsg);
+      sqlite3_free(errmsg);
+      lua_concat(L, 2);
+      return 2;
+    }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Rollback the current transaction.
+*/
+static int conn_rollback(lua_State *L)
 {
-  cur_data *cur = getcursor(L);
-  lua_rawgeti(L, LUA_REGISTRYINDEX, cur->coltypes);
+  char *errmsg;
+  conn_data *conn = getconnection(L);
+  int res;
+  const char *sql = "ROLLBACK";
+
+  if (conn->auto_commit == 0) sql = "ROLLBACK;BEGIN";
+
+  /* also discards the writes batched by group commit */
+  conn->group.open = conn->group.pending = 0;
+  res = sqlite3_exec(conn->sql_conn, sql, NULL, NULL, &errmsg);
+  if (res != SQLITE_OK)
+    {
+      lua_pushnil(L);
+      lua_pushliteral(L, LUASQL_PREFIX);
+      lua_pushstring(L, errmsg);
+      sqlite3_free(errmsg);
+      lua_concat(L, 2);
+      return 2;
+    }
+  lua_pushboolean(L, 1);
   return 1;
 }
 
+static int conn_getlastautoid(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  lua_pushnumber(L, sqlite3_last_insert_rowid(conn->sql_conn));
+  return 1;
+}
 
 /*
- * Sets the cursor parameters
+** Set "auto commit" property of the connection.
+** If 'true', then rollback current transaction.
+** If 'false', then start a new transaction.
+*/
+/*
+** Return 0, or 2 with nil + errmsg pushed when the writes batched by
+** group commit cannot be committed.
+*/
+static int conn_dosetautocommit(lua_State *L, conn_data *conn, int pos) {
+	if (group_flush(conn) != SQLITE_OK)
+		return conn_error(L, conn);
+	if (lua_toboolean(L, pos))
+	{
+		conn->auto_commit = 1;
+        /* undo active transaction - ignore errors */
+	    sqlite3_exec(conn->sql_conn, "ROLLBACK", NULL, NULL, NULL);
+	}
+	else
+	{
+		char *errmsg;
+	    int res;
+	    conn->auto_commit = 0;
+	    res = sqlite3_exec(conn->sql_conn, "BEGIN", NULL, NULL, &errmsg);
+
+	    if (res != SQLITE_OK) {
+	    	lua_pushliteral(L, LUASQL_PREFIX);
+	    	lua_pushstring(L, errmsg);
+	    	sqlite3_free(errmsg);
+	    	lua_concat(L, 2);
+	    	lua_error(L);
+	    }
+	}
+	return 0;
+}
+
+
+static int conn_setautocommit(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  if (conn_dosetautocommit(L, conn, 2) != 0)
+    return 2;
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+ * Sets the connection parameters
  */
-static void cur_set(lua_State *L) {
+static int conn_set(lua_State *L) {
 	if( lua_istable( L, 2 ) ) {
-		cur_data *cur = getcursor(L);
-		char *key;
+		conn_data *conn = getconnection(L);
+		const char *key;
 		lua_pushnil(L);
 
 		while( lua_next(L, 2) != 0 ) {
 			if( lua_isstring(L, -2) ) {
 				key = lua_tostring(L, -2);
 
-				if( strcmp(key, LUASQL_MODESTRING) == 0 ) {
-					if( lua_isstring( L, -1 ) )
-						cur->modestring = lua_tostring( L, -1 );
+				if( strcmp(key, LUASQL_AUTOCOMMIT) == 0 ) {
+					if( lua_isboolean( L, -1 ) && conn_dosetautocommit(L, conn, -1) != 0 )
+						return 2;
+				} else if( strcmp(key, LUASQL_STMTCACHE) == 0 ) {
+					if( lua_isnumber( L, -1 ) ) {
+						int capacity = lua_tointeger( L, -1 );
+						conn->cache.capacity = capacity > 0 ? capacity : 0;
+						cache_trim( &conn->cache, conn->cache.capacity );
+					}
+				} else if( strcmp(key, LUASQL_GROUPCOMMIT) == 0 ) {
+					group_configure( L, conn, lua_gettop( L ) );
+				} else if( strcmp(key, LUASQL_TIMEOUTMS) == 0 ) {
+					if( lua_isnumber( L, -1 ) )
+						conn->deadline.timeout = lua_tonumber( L, -1 ) / 1e3;
+				} else if( strcmp(key, LUASQL_RESULTCACHE) == 0 ) {
+					if( lua_isnumber( L, -1 ) )
+						results_configure( conn, lua_tonumber( L, -1 ) );
 				}
 			}
 
 			lua_pop(L, 1);
 		}		
 	}
+	return 0;
 }
 
 
 /*
- * Retrieve the specified cursor parameters
+ * Pushes the current value of a pragma, or nil if it cannot be read.
  */
-static int cur_get( lua_State *L ) {
+static void push_pragma( lua_State *L, sqlite3 *db, const char *name ) {
+	char *sql = sqlite3_mprintf( "PRAGMA %s", name );
+	sqlite3_stmt *vm;
+
+	if( sqlite3_prepare_v2( db, sql, -1, &vm, NULL ) == SQLITE_OK
+	    && sqlite3_step( vm ) == SQLITE_ROW )
+		push_column( L, vm, 0 );
+	else
+		lua_pushnil( L );
+	sqlite3_finalize( vm );
+	sqlite3_free( sql );
+}
+
+
+/*
+ * Pushes the value of a connection parameter.
+ * Returns 0 (and pushes nothing) if the parameter is unknown.
+ */
+static int conn_pushparam( lua_State *L, conn_data *conn, const char *key ) {
+	int i;
+
+	for( i = 0; tuning_pragmas[i] != NULL; i++ )
+		if( strcmp(key, tuning_pragmas[i]) == 0 ) {
+			push_pragma( L, conn->sql_conn, key );
+			return 1;
+		}
+
+	if( strcmp(key, LUASQL_BUSYTIMEOUT) == 0 )
+		push_pragma( L, conn->sql_conn, key );
+	else if( strcmp(key, LUASQL_READONLY) == 0 )
+		lua_pushboolean( L, sqlite3_db_readonly( conn->sql_conn, "main" ) == 1 );
+	else if( strcmp(key, LUASQL_AUTOCOMMIT) == 0 )
+		lua_pushboolean( L, conn->auto_commit );
+	else if( strcmp(key, LUASQL_STMTCACHE) == 0 )
+		lua_pushinteger( L, conn->cache.capacity );
+	else if( strcmp(key, LUASQL_STMTCACHE_SIZE) == 0 )
+		lua_pushinteger( L, conn->cache.size );
+	else if( strcmp(key, LUASQL_STMTCACHE_HITS) == 0 )
+		lua_pushnumber( L, conn->cache.hits );
+	else if( strcmp(key, LUASQL_STMTCACHE_MISSES) == 0 )
+		lua_pushnumber( L, conn->cache.misses );
+	else if( strcmp(key, LUASQL_STMTCACHE_EVICTIONS) == 0 )
+		lua_pushnumber( L, conn->cache.evictions );
+	else if( strcmp(key, LUASQL_GROUPCOMMIT_PENDING) == 0 )
+		lua_pushinteger( L, conn->group.pending );
+	else if( strcmp(key, LUASQL_GROUPCOMMIT_COMMITS) == 0 )
+		lua_pushnumber( L, conn->group.commits );
+	else if( strcmp(key, LUASQL_GROUPCOMMIT_STATEMENTS) == 0 )
+		lua_pushnumber( L, conn->group.statements );
+	else if( strcmp(key, LUASQL_GROUPCOMMIT_LAST) == 0 )
+		lua_pushinteger( L, conn->group.last );
+	else if( strcmp(key, LUASQL_TIMEOUTMS) == 0 )
+		lua_pushnumber( L, conn->deadline.timeout * 1e3 );
+	else if( strcmp(key, LUASQL_RESULTCACHE) == 0 )
+		lua_pushnumber( L, conn->results.capacity );
+	else if( strcmp(key, LUASQL_RESULTCACHE_SIZE) == 0 )
+		lua_pushnumber( L, conn->results.size );
+	else if( strcmp(key, LUASQL_RESULTCACHE_ENTRIES) == 0 )
+		lua_pushinteger( L, conn->results.entries );
+	else if( strcmp(key, LUASQL_RESULTCACHE_HITS) == 0 )
+		lua_pushnumber( L, conn->results.hits );
+	else if( strcmp(key, LUASQL_RESULTCACHE_MISSES) == 0 )
+		lua_pushnumber( L, conn->results.misses );
+	else if( strcmp(key, LUASQL_RESULTCACHE_EVICTIONS) == 0 )
+		lua_pushnumber( L, conn->results.evictions );
+	else if( strcmp(key, LUASQL_RESULTCACHE_INVALIDATIONS) == 0 )
+		lua_pushnumber( L, conn->results.invalidations );
+	else if( !push_db_status( L, conn->sql_conn, key ) )
+		return checkpoint_pushparam( L, conn->checkpointer, key );
+	return 1;
+}
+
+
+/*
+ * Retrieve the specified connection parameters
+ */
+static int conn_get( lua_State *L ) {
+	lua_newtable(L);
+
 	if( lua_istable( L, 2 ) ) {
-		lua_newtable(L);
 		int rsp = lua_gettop(L);
-		cur_data *cur = getcursor(L);
-		char *key;
+		conn_data *conn = getconnection(L);
+		const char *key;
 		lua_pushnil(L);
 
 		while( lua_next(L, 2) != 0 ) {
 			if( lua_isstring(L, -1) ) {
 				key = lua_tostring(L, -1);
 
-				if( strcmp(key, LUASQL_MODESTRING) == 0 ) {
-					lua_pushstring( L, LUASQL_MODESTRING );
-					lua_pushstring( L, cur->modestring );
+				if( conn_pushparam( L, conn, key ) ) {
+					lua_pushstring( L, key );
+					lua_insert( L, -2 );
 					lua_settable( L, rsp );
 				}
 			}
 
 			lua_pop(L, 1);
-		}
+		}		
 	} else
 		if( lua_isstring( L, 2 ) ) {
 			const char *key = lua_tostring(L, 2);
+			conn_data *conn = getconnection(L);
 
-			if( strcmp(key, LUASQL_MODESTRING) == 0 ) {
-				cur_data *cur = getcursor(L);
-				lua_pushstring( L, cur->modestring );
-			} else
+			if( !conn_pushparam( L, conn, key ) )
 				lua_pushnil(L);
 		} else 
 			lua_pushnil(L);
@@ -316,407 +5038,1150 @@ static int cur_get( lua_State *L ) {
 
 
 /*
-** Create a new Cursor object and push it on top of the stack.
+** Create a new Connection object and push it on top of the stack.
 */
-/* static int create_cursor(lua_State *L, int conn, sqlite3_stmt *sql_vm,
-   int numcols, const char **row, const char **col_info)*/
-static int create_cursor(lua_State *L, int o, conn_data *conn, 
-			 sqlite3_stmt *sql_vm, int numcols)
+static int create_connection(lua_State *L, int env, sqlite3 *sql_conn)
+{
+  conn_data *conn = (conn_data*)lua_newuserdata(L, sizeof(conn_data));
+  luasql_setmeta(L, LUASQL_CONNECTION_SQLITE);
+
+  /* fill in structure */
+  conn->closed = 0;
+  conn->env = LUA_NOREF;
+  conn->auto_commit = 1;
+  conn->sql_conn = sql_conn;
+  conn->cur_counter = 0;
+  conn->statements = NULL;
+  conn->blobs = NULL;
+  conn->backups = NULL;
+  conn->profile = NULL;
+  conn->checkpointer = NULL;
+  conn->group.max_rows = conn->group.max_ms = 0;
+  conn->group.open = conn->group.pending = conn->group.last = 0;
+  conn->group.commits = conn->group.statements = 0;
+  conn->deadline.timeout = conn->deadline.expires = 0;
+  conn->deadline.timedout = conn->deadline.installed = 0;
+  conn->results.capacity = conn->results.size = 0;
+  conn->results.entries = conn->results.changes = 0;
+  conn->results.first = conn->results.last = NULL;
+  conn->results.schema = conn->results.cacheable = 0;
+  conn->results.reads = NULL;
+  conn->results.version = NULL;
+  conn->results.data_version = 0;
+  conn->results.generation = 0;
+  conn->results.hits = conn->results.misses = 0;
+  conn->results.evictions = conn->results.invalidations = 0;
+  conn->compat = ((env_data *)lua_touserdata(L, env))->compat;
+  conn->cache.capacity = conn->compat ? COMPAT_STMTCACHE : 0;
+  conn->cache.size = 0;
+  conn->cache.first = conn->cache.last = NULL;
+  conn->cache.buckets = NULL;
+  conn->cache.nbuckets = 0;
+  conn->cache.hits = conn->cache.misses = conn->cache.evictions = 0;
+  lua_pushvalue (L, env);
+  conn->env = luaL_ref (L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+
+/*
+** Computes the sqlite3_open_v2 flags from the connection table at
+** stack position 'idx'.
+*/
+static int open_flags(lua_State *L, int idx)
+{
+  int flags;
+
+  lua_getfield(L, idx, LUASQL_READONLY);
+  flags = lua_toboolean(L, -1) ? SQLITE_OPEN_READONLY
+    : SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+  lua_getfield(L, idx, LUASQL_URI);
+  if (lua_toboolean(L, -1))
+    flags |= SQLITE_OPEN_URI;
+  lua_getfield(L, idx, LUASQL_SHAREDCACHE);
+  if (lua_isboolean(L, -1))
+    flags |= lua_toboolean(L, -1) ? SQLITE_OPEN_SHAREDCACHE
+      : SQLITE_OPEN_PRIVATECACHE;
+  lua_getfield(L, idx, LUASQL_MUTEX);
+  if (lua_isstring(L, -1))
+    {
+      const char *mutex = lua_tostring(L, -1);
+      if (strcmp(mutex, "nomutex") == 0)
+        flags |= SQLITE_OPEN_NOMUTEX;
+      else if (strcmp(mutex, "fullmutex") == 0)
+        flags |= SQLITE_OPEN_FULLMUTEX;
+      else
+        luaL_error(L, LUASQL_PREFIX"invalid mutex mode '%s'", mutex);
+    }
+  lua_pop(L, 4);
+  return flags;
+}
+
+
+/*
+** Configures the lookaside memory of a new connection with the field
+** lookaside = {size=, count=} of the connection table at stack
+** position 'idx'.
+** Return NULL on success or an error message (pushed on the stack).
+*/
+static const char *apply_lookaside(lua_State *L, sqlite3 *db, int idx)
+{
+  int size, count;
+
+  lua_getfield(L, idx, LUASQL_LOOKASIDE);
+  if (!lua_istable(L, -1))
+    {
+      lua_pop(L, 1);
+      return NULL;
+    }
+  lua_getfield(L, -1, LUASQL_SIZE);
+  size = lua_isnumber(L, -1) ? lua_tointeger(L, -1) : 1200;
+  lua_getfield(L, -2, LUASQL_COUNT);
+  count = lua_isnumber(L, -1) ? lua_tointeger(L, -1) : 100;
+  lua_pop(L, 3);
+  /* SQLite allocates the buffer itself */
+  if (sqlite3_db_config(db, SQLITE_DBCONFIG_LOOKASIDE, NULL, size, count)
+      != SQLITE_OK)
+    return lua_pushfstring(L, "%s (lookaside)", sqlite3_errmsg(db));
+  return NULL;
+}
+
+
+/*
+** Applies the tuning pragmas given in the connection table at stack
+** position 'idx'.
+** Return NULL on success or an error message (pushed on the stack).
+*/
+static const char *apply_pragmas(lua_State *L, sqlite3 *db, int idx)
 {
   int i;
-  cur_data *cur = (cur_data*)lua_newuserdata(L, sizeof(cur_data));
-  luasql_setmeta (L, LUASQL_CURSOR_SQLITE);
 
-  /* increment cursor count for the connection creating this cursor */
-  conn->cur_counter++;
+  for (i = 0; tuning_pragmas[i] != NULL; i++)
+    {
+      const char *name = tuning_pragmas[i];
+      sqlite3_stmt *vm;
+      char *sql;
+      int res;
+
+      lua_getfield(L, idx, name);
+      if (lua_isnumber(L, -1))
+        sql = sqlite3_mprintf("PRAGMA %s=%lld", name,
+			      (sqlite3_int64)lua_tonumber(L, -1));
+      else if (lua_isstring(L, -1))
+        sql = sqlite3_mprintf("PRAGMA %s=%Q", name, lua_tostring(L, -1));
+      else
+        {
+          lua_pop(L, 1);
+          continue;
+        }
+
+      res = sqlite3_prepare_v2(db, sql, -1, &vm, NULL);
+      sqlite3_free(sql);
+      if (res == SQLITE_OK)
+        res = sqlite3_step(vm);
+      if (res != SQLITE_ROW && res != SQLITE_DONE)
+        {
+          sqlite3_finalize(vm);
+          return lua_pushfstring(L, "%s (%s)", sqlite3_errmsg(db), name);
+        }
+      /* the journal mode may be refused (e.g. WAL on memory databases) */
+      if (strcmp(name, LUASQL_JOURNALMODE) == 0 && res == SQLITE_ROW
+	  && sqlite3_stricmp((const char *)sqlite3_column_text(vm, 0),
+			     lua_tostring(L, -1)) != 0)
+        {
+          const char *msg = lua_pushfstring(L, "cannot set journal_mode to %s",
+					    lua_tostring(L, -1));
+          sqlite3_finalize(vm);
+          return msg;
+        }
+      sqlite3_finalize(vm);
+      lua_pop(L, 1);
+    }
+  return NULL;
+}
+
+
+/*
+** Connects to a data source.
+** The data source may be given with a table that also holds the options
+** used to open the database and the tuning pragmas, all of them applied
+** before the connection is returned.
+*/
+static int env_connect(lua_State *L)
+{
+  const char *sourcename = NULL;
+  sqlite3 *conn;
+  const char *errmsg;
+  int res;
+  env_data *env = getenvironment(L);  /* validate environment */
+  int time_out = env->locktimeout;
+  int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+    
+  if( lua_istable( L, 2 ) ) {
+		lua_pushstring( L, LUASQL_SOURCENAME );
+		lua_gettable( L, 2 );
+		
+		if( lua_isstring( L, -1 ) )
+			sourcename = lua_tostring( L, -1 );
+
+		lua_pop( L, 1 );
+		lua_pushstring( L, LUASQL_LOCKTIMEOUT );
+		lua_gettable( L, 2 );
+		
+		if( lua_isnumber( L, -1 ) )
+			time_out = lua_tointeger( L, -1 );
+
+		lua_pop( L, 1 );
+		lua_pushstring( L, LUASQL_BUSYTIMEOUT );
+		lua_gettable( L, 2 );
+
+		if( lua_isnumber( L, -1 ) )
+			time_out = lua_tointeger( L, -1 );
+
+		lua_pop( L, 1 );
+		flags = open_flags( L, 2 );
+  } else {
+	  sourcename = luaL_checkstring(L, 2);
+
+	  if( lua_isnumber(L, 3) )
+		  time_out = lua_tointeger(L, 3);
+  }
+  luaL_argcheck(L, sourcename != NULL, 2, LUASQL_PREFIX"sourcename expected");
+  
+  res = sqlite3_open_v2(sourcename, &conn, flags, NULL);
+  if (res != SQLITE_OK)
+    {
+      errmsg = sqlite3_errmsg(conn);
+      lua_pushnil(L);
+      lua_pushliteral(L, LUASQL_PREFIX);
+      lua_pushstring(L, errmsg);
+      lua_concat(L, 2);
+      sqlite3_close(conn);
+      return 2;
+    }
+  
+  if (time_out > -1) {
+  	sqlite3_busy_timeout(conn, time_out);
+  }
+
+  if (lua_istable(L, 2))
+    {
+      errmsg = apply_lookaside(L, conn, 2);
+      if (errmsg == NULL)
+        errmsg = apply_pragmas(L, conn, 2);
+      if (errmsg != NULL)
+        {
+          lua_pushnil(L);
+          lua_pushliteral(L, LUASQL_PREFIX);
+          lua_pushstring(L, errmsg);
+          lua_concat(L, 2);
+          sqlite3_close(conn);
+          return 2;
+        }
+    }
+  
+  create_connection(L, 1, conn);
+  if (lua_istable(L, 2))
+    {
+      conn_data *c = (conn_data *)lua_touserdata(L, -1);
+      lua_getfield(L, 2, LUASQL_STMTCACHE);
+      if (lua_tointeger(L, -1) > 0)
+        c->cache.capacity = lua_tointeger(L, -1);
+      lua_getfield(L, 2, LUASQL_GROUPCOMMIT);
+      group_configure(L, c, lua_gettop(L));
+      lua_pop(L, 2);
+    }
+  return 1;
+}
+
 
-  /* fill in structure */
-  cur->closed = 0;
-  cur->conn = LUA_NOREF;
-  cur->numcols = numcols;
-  cur->colnames = LUA_NOREF;
-  cur->coltypes = LUA_NOREF;
-  cur->sql_vm = sql_vm;
-  cur->conn_data = conn;
-  cur->modestring = "n";
+/*
+** Creates an in-memory connection from a database image, as returned
+** by conn:serialize.  Options (table at position 3): readonly (false
+** by default) and resizeable (true by default).
+** Return a Connection object.
+*/
+static int env_deserialize(lua_State *L)
+{
+  size_t len;
+  const char *image;
+  unsigned char *buff;
+  unsigned int flags = SQLITE_DESERIALIZE_FREEONCLOSE;
+  int readonly = 0, resizeable = 1;
+  sqlite3 *conn;
 
-  lua_pushvalue(L, o);
-  cur->conn = luaL_ref(L, LUA_REGISTRYINDEX);
+  getenvironment(L);  /* validate environment */
+  image = luaL_checklstring(L, 2, &len);
+  if (!lua_isnoneornil(L, 3))
+    {
+      luaL_checktype(L, 3, LUA_TTABLE);
+      lua_getfield(L, 3, LUASQL_READONLY);
+      readonly = lua_toboolean(L, -1);
+      lua_getfield(L, 3, LUASQL_RESIZEABLE);
+      if (lua_isboolean(L, -1))
+        resizeable = lua_toboolean(L, -1);
+      lua_pop(L, 2);
+    }
+  if (readonly)
+    flags |= SQLITE_DESERIALIZE_READONLY;
+  if (resizeable)
+    flags |= SQLITE_DESERIALIZE_RESIZEABLE;
 
-  /* create table with column names */
-  lua_newtable(L);
-  for (i = 0; i < numcols;)
+  if (sqlite3_open_v2(":memory:", &conn,
+		      SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL)
+      != SQLITE_OK)
     {
-      lua_pushstring(L, sqlite3_column_name(sql_vm, i));
-      lua_rawseti(L, -2, ++i);
+      lua_pushnil(L);
+      lua_pushliteral(L, LUASQL_PREFIX);
+      lua_pushstring(L, sqlite3_errmsg(conn));
+      lua_concat(L, 2);
+      sqlite3_close(conn);
+      return 2;
     }
-  cur->colnames = luaL_ref(L, LUA_REGISTRYINDEX);
-	
-  /* create table with column types */
-  lua_newtable(L);
-  for (i = 0; i < numcols;)
+  /* SQLite owns the buffer from now on, even if deserialize fails */
+  buff = (unsigned char *)sqlite3_malloc64(len > 0 ? len : 1);
+  if (buff == NULL)
     {
-      lua_pushstring(L, sqlite3_column_decltype(sql_vm, i));
-      lua_rawseti(L, -2, ++i);
+      sqlite3_close(conn);
+      return luasql_faildirect(L, LUASQL_PREFIX"out of memory");
+    }
+  memcpy(buff, image, len);
+  /* an in-memory database cannot use WAL: read the image of a WAL
+     database as a rollback journal one */
+  if (len >= 20 && buff[18] == 2 && buff[19] == 2)
+    buff[18] = buff[19] = 1;
+  if (sqlite3_deserialize(conn, "main", buff, len, len, flags) != SQLITE_OK)
+    {
+      lua_pushnil(L);
+      lua_pushliteral(L, LUASQL_PREFIX);
+      lua_pushstring(L, sqlite3_errmsg(conn));
+      lua_concat(L, 2);
+      sqlite3_close(conn);
+      return 2;
     }
-  cur->coltypes = luaL_ref(L, LUA_REGISTRYINDEX);
 
+  create_connection(L, 1, conn);
   return 1;
 }
 
 
 /*
-** Close a Connection object.
+** Appends the Lua value at stack position 'idx', converted as by
+** bind_value.
+** Return 0 if the value cannot be bound or out of memory.
 */
-static int conn_close(lua_State *L)
+static int value_encodelua(lua_State *L, value_buffer *b, int idx)
 {
-  conn_data *conn = (conn_data *)luaL_checkudata(L, 1, LUASQL_CONNECTION_SQLITE);
-  luaL_argcheck (L, conn != NULL, 1, LUASQL_PREFIX"connection expected");
-  if (conn->closed) 
+  pooled_value v;
+
+  switch (lua_type(L, idx)) {
+  case LUA_TNONE:
+  case LUA_TNIL:
+    v.type = SQLITE_NULL;
+    break;
+  case LUA_TBOOLEAN:
+    v.type = SQLITE_INTEGER;
+    v.i = lua_toboolean(L, idx);
+    break;
+  case LUA_TNUMBER:
     {
-      lua_pushboolean(L, 0);
-      return 1;
+      lua_Number n = lua_tonumber(L, idx);
+      if (n >= -9.2e18 && n <= 9.2e18 && n == (lua_Number)(sqlite3_int64)n)
+        {
+          v.type = SQLITE_INTEGER;
+          v.i = (sqlite3_int64)n;
+        }
+      else
+        {
+          v.type = SQLITE_FLOAT;
+          v.d = n;
+        }
+      break;
     }
+  case LUA_TSTRING:
+    v.type = SQLITE_TEXT;
+    v.s = lua_tolstring(L, idx, &v.len);
+    break;
+  default:
+    return 0;
+  }
+  return value_encode(b, &v);
+}
 
-  if (conn->cur_counter > 0)
-    return luaL_error (L, LUASQL_PREFIX"there are open cursors");
 
-  /* Nullify structure fields. */
-  conn->closed = 1;
-  luaL_unref(L, LUA_REGISTRYINDEX, conn->env);
-  sqlite3_close(conn->sql_conn);
-  lua_pushboolean(L, 1);
-  return 1;
+/*
+** Binds a value to a parameter of a statement.
+*/
+static int value_bind(sqlite3_stmt *vm, int param, const pooled_value *v)
+{
+  switch (v->type) {
+  case SQLITE_INTEGER:
+    return sqlite3_bind_int64(vm, param, v->i);
+  case SQLITE_FLOAT:
+    return sqlite3_bind_double(vm, param, v->d);
+  case SQLITE_TEXT:
+    return sqlite3_bind_text(vm, param, v->s, (int)v->len, SQLITE_TRANSIENT);
+  default:
+    return sqlite3_bind_null(vm, param);
+  }
 }
 
-static int conn_escape(lua_State *L)
+
+/*
+** Binds the parameters of a job, as bind_table does: positional
+** parameters by index and named ones by name without the prefix.
+** Parameters missing from the job are bound to NULL.
+*/
+static int job_bind(read_job *job, sqlite3_stmt *vm)
 {
-  const char *from = luaL_checklstring (L, 2, 0);
-  char *escaped = sqlite3_mprintf("%q", from);
-  if (escaped == NULL) 
-    {
-      lua_pushnil(L);
-    } 
-  else
+  int i, n = sqlite3_bind_parameter_count(vm);
+
+  for (i = 1; i <= n; i++)
     {
-      lua_pushstring(L, escaped);        
-      sqlite3_free(escaped);
+      const char *name = sqlite3_bind_parameter_name(vm, i);
+      const unsigned char *p = job->params.data;
+      pooled_value v;
+      int k, res;
+
+      v.type = SQLITE_NULL;
+      if (name == NULL)  /* positional parameter */
+        {
+          for (k = 1; k <= job->npositional; k++)
+            {
+              p = value_decode(p, &v);
+              if (k == i)
+                break;
+            }
+          if (k > job->npositional)
+            v.type = SQLITE_NULL;
+        }
+      else
+        {
+          for (k = 0; k < job->npositional; k++)
+            p = value_decode(p, &v);
+          for (k = 0; k < job->nnamed; k++)
+            {
+              pooled_value key;
+              p = value_decode(value_decode(p, &key), &v);
+              if (key.len == strlen(name + 1)
+		  && memcmp(key.s, name + 1, key.len) == 0)
+                break;
+            }
+          if (k == job->nnamed)
+            v.type = SQLITE_NULL;
+        }
+      res = value_bind(vm, i, &v);
+      if (res != SQLITE_OK)
+        return res;
     }
-  return 1;
+  return SQLITE_OK;
 }
 
+
 /*
-** Execute an SQL statement.
-** Return a Cursor object if the statement is a query, otherwise
-** return the number of tuples affected by the statement.
+** Runs a job on the connection of a worker, keeping all of its rows.
 */
-static int conn_execute(lua_State *L)
+static void job_run(read_job *job, sqlite3 *db)
 {
-  conn_data *conn = getconnection(L);
-  const char *statement = luaL_checkstring(L, 2);
-  int res;
   sqlite3_stmt *vm;
-  const char *errmsg;
-  int numcols;
-  const char *tail;
+  int res, i;
 
-  res = sqlite3_prepare(conn->sql_conn, statement, -1, &vm, &tail);
+  res = sqlite3_prepare_v2(db, job->sql, -1, &vm, NULL);
+  if (res == SQLITE_OK && vm == NULL)
+    {
+      job->errmsg = sqlite3_mprintf("empty statement");
+      return;
+    }
+  if (res == SQLITE_OK)
+    res = job_bind(job, vm);
   if (res != SQLITE_OK)
     {
-      errmsg = sqlite3_errmsg(conn->sql_conn);
-      lua_pushnil(L);
-      lua_pushliteral(L, LUASQL_PREFIX);
-      lua_pushstring(L, errmsg);
-      lua_concat(L, 2);
-      return 2;
+      job->errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+      sqlite3_finalize(vm);
+      return;
     }
 
-  /* process first result to retrive query information and type */
-  res = sqlite3_step(vm);
-  numcols = sqlite3_column_count(vm);
-
-  /* real query? if empty, must have numcols!=0 */
-  if ((res == SQLITE_ROW) || ((res == SQLITE_DONE) && numcols))
+  job->ncols = sqlite3_column_count(vm);
+  for (i = 0; i < job->ncols; i++)
     {
-      sqlite3_reset(vm);
-      return create_cursor(L, 1, conn, vm, numcols);
+      pooled_value v;
+      v.type = SQLITE_TEXT;
+      v.s = sqlite3_column_name(vm, i);
+      v.len = strlen(v.s);
+      if (!value_encode(&job->names, &v))
+        res = SQLITE_NOMEM;
     }
-
-  if (res == SQLITE_DONE) /* and numcols==0, INSERT,UPDATE,DELETE statement */
+  while (res == SQLITE_OK && (res = sqlite3_step(vm)) == SQLITE_ROW)
     {
-      sqlite3_finalize(vm);
-      /* return number of columns changed */
-      lua_pushnumber(L, sqlite3_changes(conn->sql_conn));
-      return 1;
+      for (i = 0; i < job->ncols; i++)
+        {
+          pooled_value v;
+          value_column(vm, i, &v);
+          if (!value_encode(&job->rows, &v))
+            break;
+        }
+      if (i < job->ncols)
+        {
+          res = SQLITE_NOMEM;
+          break;
+        }
+      job->nrows++;
+      res = SQLITE_OK;
     }
-
-  /* error */
-  errmsg = sqlite3_errmsg(conn->sql_conn);
+  if (res == SQLITE_NOMEM)
+    job->errmsg = sqlite3_mprintf("out of memory");
+  else if (res != SQLITE_DONE)
+    job->errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
   sqlite3_finalize(vm);
-  lua_pushnil(L);
-  lua_pushliteral(L, LUASQL_PREFIX);
-  lua_pushstring(L, errmsg);
-  lua_concat(L, 2);
-  return 2;
 }
 
 
 /*
-** Commit the current transaction.
+** Releases the memory of a job.
 */
-static int conn_commit(lua_State *L)
+static void job_free(read_job *job)
 {
-  char *errmsg;
-  conn_data *conn = getconnection(L);
-  int res;
-  const char *sql = "COMMIT";
+  free(job->sql);
+  free(job->params.data);
+  free(job->names.data);
+  free(job->rows.data);
+  sqlite3_free(job->errmsg);
+  free(job);
+}
 
-  if (conn->auto_commit == 0) sql = "COMMIT;BEGIN";
 
-  res = sqlite3_exec(conn->sql_conn, sql, NULL, NULL, &errmsg);
+/*
+** Drops a reference to a pool, releasing it with the last one.
+** The workers must have been joined.
+*/
+static void pool_unref(read_pool *pool)
+{
+  int refs;
 
-  if (res != SQLITE_OK)
+  mutex_lock(&pool->lock);
+  refs = --pool->refs;
+  mutex_unlock(&pool->lock);
+  if (refs == 0)
     {
-      lua_pushnil(L);
-      lua_pushliteral(L, LUASQL_PREFIX);
-      lua_pushstring(L, errmsg);
-      sqlite3_free(errmsg);
-      lua_concat(L, 2);
-      return 2;
+      cond_destroy(&pool->work);
+      cond_destroy(&pool->done);
+      mutex_destroy(&pool->lock);
+      free(pool->workers);
+      free(pool);
     }
-  lua_pushboolean(L, 1);
-  return 1;
 }
 
 
 /*
-** Rollback the current transaction.
+** Body of a worker thread: runs the queued jobs in order.
 */
-static int conn_rollback(lua_State *L)
+static WORKER_API pool_thread(void *p)
 {
-  char *errmsg;
-  conn_data *conn = getconnection(L);
-  int res;
-  const char *sql = "ROLLBACK";
+  read_worker *worker = (read_worker *)p;
+  read_pool *pool = worker->pool;
 
-  if (conn->auto_commit == 0) sql = "ROLLBACK;BEGIN";
+  mutex_lock(&pool->lock);
+  for (;;)
+    {
+      read_job *job;
+      while (!pool->stop && pool->first == NULL)
+        cond_wait(&pool->work, &pool->lock);
+      if (pool->stop)
+        break;
+      job = pool->first;
+      pool->first = job->next;
+      if (pool->first == NULL)
+        pool->last = NULL;
+      job->next = NULL;
+      job->state = JOB_RUNNING;
+      mutex_unlock(&pool->lock);
 
-  res = sqlite3_exec(conn->sql_conn, sql, NULL, NULL, &errmsg);
-  if (res != SQLITE_OK)
+      job_run(job, worker->db);
+
+      mutex_lock(&pool->lock);
+      job->state = JOB_DONE;
+      if (job->orphan)
+        {
+          job_free(job);
+          pool->refs--;  /* never the last one: the pool object is alive */
+        }
+      cond_broadcast(&pool->done);
+    }
+  mutex_unlock(&pool->lock);
+  return 0;
+}
+
+
+/*
+** Stops the workers of a pool, failing the jobs still queued, and
+** closes their connections.
+*/
+static void pool_stop(read_pool *pool)
+{
+  int i;
+
+  mutex_lock(&pool->lock);
+  pool->stop = 1;
+  while (pool->first != NULL)
     {
-      lua_pushnil(L);
-      lua_pushliteral(L, LUASQL_PREFIX);
-      lua_pushstring(L, errmsg);
-      sqlite3_free(errmsg);
-      lua_concat(L, 2);
-      return 2;
+      read_job *job = pool->first;
+      pool->first = job->next;
+      job->next = NULL;
+      job->state = JOB_DONE;
+      job->errmsg = sqlite3_mprintf("pool is closed");
     }
-  lua_pushboolean(L, 1);
-  return 1;
+  pool->last = NULL;
+  cond_broadcast(&pool->work);
+  cond_broadcast(&pool->done);
+  mutex_unlock(&pool->lock);
+  for (i = 0; i < pool->nthreads; i++)
+    {
+      thread_join(pool->workers[i].thread);
+      sqlite3_close(pool->workers[i].db);
+    }
+  pool->nthreads = 0;
 }
 
-static int conn_getlastautoid(lua_State *L)
+
+/*
+** Check for valid read pool.
+*/
+static pool_data *getpool(lua_State *L) {
+  pool_data *pool = (pool_data *)luaL_checkudata(L, 1, LUASQL_READPOOL_SQLITE);
+  luaL_argcheck(L, pool != NULL, 1, LUASQL_PREFIX"read pool expected");
+  luaL_argcheck(L, !pool->closed, 1, LUASQL_PREFIX"read pool is closed");
+  return pool;
+}
+
+
+/*
+** Check for valid read job.
+*/
+static read_job *getjob(lua_State *L) {
+  job_data *job = (job_data *)luaL_checkudata(L, 1, LUASQL_READJOB_SQLITE);
+  luaL_argcheck(L, job != NULL && job->job != NULL, 1,
+		LUASQL_PREFIX"read job expected");
+  return job->job;
+}
+
+
+/*
+** Opens a pool of 'nthreads' (4 by default) read-only connections to
+** a database, each with a native worker thread, so queries submitted
+** with pool:submit run in parallel with each other and with Lua.
+** Return a Read pool object, or nil + errmsg.
+*/
+static int env_readpool(lua_State *L)
 {
-  conn_data *conn = getconnection(L);
-  lua_pushnumber(L, sqlite3_last_insert_rowid(conn->sql_conn));
+  env_data *env = getenvironment(L);
+  const char *path = luaL_checkstring(L, 2);
+  int nthreads = luaL_optint(L, 3, 4);
+  read_pool *pool;
+  pool_data *data;
+  int i;
+
+  luaL_argcheck(L, nthreads > 0, 3, LUASQL_PREFIX"positive number expected");
+  if (!sqlite3_threadsafe())
+    return luasql_faildirect(L, LUASQL_PREFIX"SQLite was built without threads");
+  pool = (read_pool *)malloc(sizeof(read_pool));
+  if (pool != NULL)
+    {
+      pool->workers = (read_worker *)calloc(nthreads, sizeof(read_worker));
+      if (pool->workers == NULL)
+        {
+          free(pool);
+          pool = NULL;
+        }
+    }
+  if (pool == NULL)
+    return luaL_error(L, LUASQL_PREFIX"out of memory");
+  pool->refs = 1;
+  pool->stop = 0;
+  pool->nthreads = 0;
+  pool->first = pool->last = NULL;
+  mutex_init(&pool->lock);
+  cond_init(&pool->work);
+  cond_init(&pool->done);
+
+  for (i = 0; i < nthreads; i++)
+    {
+      read_worker *worker = &pool->workers[i];
+      worker->pool = pool;
+      if (sqlite3_open_v2(path, &worker->db,
+			  SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL)
+	  != SQLITE_OK)
+        {
+          lua_pushnil(L);
+          lua_pushliteral(L, LUASQL_PREFIX);
+          lua_pushstring(L, sqlite3_errmsg(worker->db));
+          lua_concat(L, 2);
+          sqlite3_close(worker->db);
+          break;
+        }
+      if (env->locktimeout > -1)
+        sqlite3_busy_timeout(worker->db, env->locktimeout);
+      if (thread_create(&worker->thread, pool_thread, worker))
+        {
+          sqlite3_close(worker->db);
+          lua_pushnil(L);
+          lua_pushliteral(L, LUASQL_PREFIX"cannot start read pool thread");
+          break;
+        }
+      pool->nthreads++;
+    }
+  if (i < nthreads)
+    {
+      pool_stop(pool);
+      pool_unref(pool);
+      return 2;
+    }
+
+  data = (pool_data *)lua_newuserdata(L, sizeof(pool_data));
+  luasql_setmeta(L, LUASQL_READPOOL_SQLITE);
+
+  /* fill in structure */
+  data->closed = 0;
+  data->pool = pool;
+  lua_pushvalue(L, 1);
+  data->env = luaL_ref(L, LUA_REGISTRYINDEX);
   return 1;
 }
 
+
 /*
-** Set "auto commit" property of the connection.
-** If 'true', then rollback current transaction.
-** If 'false', then start a new transaction.
+** Queues a query, with the parameters given by the table at position
+** 3 (bound as by stmt:bind_names and by position).
+** Return a Read job object.
 */
-static void conn_dosetautocommit(lua_State *L, conn_data *conn, int pos) {
-	if (lua_toboolean(L, pos))
-	{
-		conn->auto_commit = 1;
-        /* undo active transaction - ignore errors */
-	    sqlite3_exec(conn->sql_conn, "ROLLBACK", NULL, NULL, NULL);
-	}
-	else
-	{
-		char *errmsg;
-	    int res;
-	    conn->auto_commit = 0;
-	    res = sqlite3_exec(conn->sql_conn, "BEGIN", NULL, NULL, &errmsg);
+static int pool_submit(lua_State *L)
+{
+  read_pool *pool = getpool(L)->pool;
+  size_t len;
+  const char *sql = luaL_checklstring(L, 2, &len);
+  read_job *job;
+  job_data *data;
 
-	    if (res != SQLITE_OK) {
-	    	lua_pushliteral(L, LUASQL_PREFIX);
-	    	lua_pushstring(L, errmsg);
-	    	sqlite3_free(errmsg);
-	    	lua_concat(L, 2);
-	    	lua_error(L);
-	    }
-	}
+  job = (read_job *)calloc(1, sizeof(read_job));
+  if (job == NULL)
+    return luaL_error(L, LUASQL_PREFIX"out of memory");
+  job->pool = pool;
+  job->state = JOB_QUEUED;
+  job->sql = (char *)malloc(len + 1);
+  if (job->sql == NULL)
+    {
+      job_free(job);
+      return luaL_error(L, LUASQL_PREFIX"out of memory");
+    }
+  memcpy(job->sql, sql, len + 1);
+  if (!lua_isnoneornil(L, 3))
+    {
+      int i, n, ok = 1;
+      luaL_checktype(L, 3, LUA_TTABLE);
+      n = lua_objlen(L, 3);
+      for (i = 1; ok && i <= n; i++)
+        {
+          lua_rawgeti(L, 3, i);
+          ok = value_encodelua(L, &job->params, -1);
+          if (ok)
+            lua_pop(L, 1);
+        }
+      job->npositional = n;
+      lua_pushnil(L);
+      while (ok && lua_next(L, 3) != 0)
+        {
+          if (lua_type(L, -2) == LUA_TSTRING)
+            {
+              ok = value_encodelua(L, &job->params, -2)
+                && value_encodelua(L, &job->params, -1);
+              job->nnamed++;
+            }
+          if (ok)
+            lua_pop(L, 1);
+        }
+      if (!ok)
+        {
+          job_free(job);
+          return luaL_error(L, LUASQL_PREFIX"cannot bind a %s value",
+			    luaL_typename(L, -1));
+        }
+    }
+
+  data = (job_data *)lua_newuserdata(L, sizeof(job_data));
+  luasql_setmeta(L, LUASQL_READJOB_SQLITE);
+  data->job = job;
+  mutex_lock(&pool->lock);
+  pool->refs++;
+  if (pool->last != NULL)
+    pool->last->next = job;
+  else
+    pool->first = job;
+  pool->last = job;
+  cond_signal(&pool->work);
+  mutex_unlock(&pool->lock);
+  return 1;
 }
 
 
-static int conn_setautocommit(lua_State *L)
+/*
+** Closes a Read pool object: running queries complete, queued ones
+** fail.
+*/
+static int pool_close(lua_State *L)
 {
-  conn_data *conn = getconnection(L);
-  conn_dosetautocommit(L, conn, 2);
+  pool_data *data = (pool_data *)luaL_checkudata(L, 1, LUASQL_READPOOL_SQLITE);
+  luaL_argcheck(L, data != NULL, 1, LUASQL_PREFIX"read pool expected");
+  if (data->closed)
+    {
+      lua_pushboolean(L, 0);
+      return 1;
+    }
+
+  /* Nullify structure fields. */
+  data->closed = 1;
+  luaL_unref(L, LUA_REGISTRYINDEX, data->env);
+  pool_stop(data->pool);
+  pool_unref(data->pool);
+  data->pool = NULL;
   lua_pushboolean(L, 1);
   return 1;
 }
 
 
 /*
- * Sets the connection parameters
- */
-static void conn_set(lua_State *L) {
-	if( lua_istable( L, 2 ) ) {
-		conn_data *conn = getconnection(L);
-		char *key;
-		lua_pushnil(L);
+** Return true if the job is done.
+*/
+static int job_done(lua_State *L)
+{
+  read_job *job = getjob(L);
+  mutex_lock(&job->pool->lock);
+  lua_pushboolean(L, job->state == JOB_DONE);
+  mutex_unlock(&job->pool->lock);
+  return 1;
+}
 
-		while( lua_next(L, 2) != 0 ) {
-			if( lua_isstring(L, -2) ) {
-				key = lua_tostring(L, -2);
 
-				if( strcmp(key, LUASQL_AUTOCOMMIT) == 0 ) {
-					if( lua_isboolean( L, -1 ) )
-						conn_dosetautocommit(L, conn, -1);
-				}
-			}
+/*
+** Waits until the job is done, or for at most timeout_ms milliseconds.
+** Return true if the job is done.
+*/
+static int job_wait(lua_State *L)
+{
+  read_job *job = getjob(L);
+  read_pool *pool = job->pool;
+  double deadline = monotonic_time() + luaL_optnumber(L, 2, -1) / 1e3;
+  int timed = !lua_isnoneornil(L, 2);
 
-			lua_pop(L, 1);
-		}		
-	}
+  mutex_lock(&pool->lock);
+  while (job->state != JOB_DONE)
+    {
+      double left = deadline - monotonic_time();
+      if (!timed)
+        cond_wait(&pool->done, &pool->lock);
+      else if (left <= 0 || !cond_timedwait(&pool->done, &pool->lock, left))
+        break;
+    }
+  lua_pushboolean(L, job->state == JOB_DONE);
+  mutex_unlock(&pool->lock);
+  return 1;
 }
 
 
 /*
- * Retrieve the specified connection parameters
- */
-static int conn_get( lua_State *L ) {
-	lua_newtable(L);
-
-	if( lua_istable( L, 2 ) ) {
-		int rsp = lua_gettop(L);
-		conn_data *conn = getconnection(L);
-		char *key;
-		lua_pushnil(L);
+** Waits until the job is done and converts its rows.
+** Rows are tables indexed by position ("n", the default) or by column
+** name ("a"), as by cur:fetch.
+** Return the list of rows and the list of column names, or nil +
+** errmsg.
+*/
+static int job_result(lua_State *L)
+{
+  read_job *job = getjob(L);
+  int assoc = *luaL_optstring(L, 2, "n") == 'a';
+  const unsigned char *p;
+  int i, j, names;
 
-		while( lua_next(L, 2) != 0 ) {
-			if( lua_isstring(L, -1) ) {
-				key = lua_tostring(L, -1);
+  lua_settop(L, 1);
+  job_wait(L);
+  lua_pop(L, 1);
+  if (job->errmsg != NULL)
+    {
+      lua_pushnil(L);
+      lua_pushfstring(L, LUASQL_PREFIX"%s", job->errmsg);
+      return 2;
+    }
 
-				if( strcmp(key, LUASQL_AUTOCOMMIT) == 0 ) {
-					lua_pushstring( L, LUASQL_AUTOCOMMIT );
-					lua_pushboolean( L, conn->auto_commit );
-					lua_settable( L, rsp );
-				}
-			}
+  lua_createtable(L, job->nrows, 0);
+  lua_createtable(L, job->ncols, 0);
+  names = lua_gettop(L);
+  p = job->names.data;
+  for (j = 1; j <= job->ncols; j++)
+    {
+      pooled_value v;
+      p = value_decode(p, &v);
+      value_push(L, &v);
+      lua_rawseti(L, names, j);
+    }
+  p = job->rows.data;
+  for (i = 1; i <= job->nrows; i++)
+    {
+      lua_createtable(L, assoc ? 0 : job->ncols, assoc ? job->ncols : 0);
+      for (j = 1; j <= job->ncols; j++)
+        {
+          pooled_value v;
+          p = value_decode(p, &v);
+          if (assoc)
+            lua_rawgeti(L, names, j);
+          value_push(L, &v);
+          if (assoc)
+            lua_rawset(L, -3);
+          else
+            lua_rawseti(L, -2, j);
+        }
+      lua_rawseti(L, names - 1, i);
+    }
+  return 2;
+}
 
-			lua_pop(L, 1);
-		}		
-	} else
-		if( lua_isstring( L, 2 ) ) {
-			const char *key = lua_tostring(L, 2);
 
-			if( strcmp(key, LUASQL_AUTOCOMMIT) == 0 ) {
-				conn_data *conn = getconnection(L);
-				lua_pushboolean( L, conn->auto_commit );
-			} else
-				lua_pushnil(L);
-		} else 
-			lua_pushnil(L);
+/*
+** Releases a Read job object.  A running query is left to its worker,
+** which releases it when done.
+*/
+static int job_gc(lua_State *L)
+{
+  job_data *data = (job_data *)luaL_checkudata(L, 1, LUASQL_READJOB_SQLITE);
+  read_job *job = data->job;
+  read_pool *pool;
 
-	return 1;
+  if (job == NULL)
+    return 0;
+  data->job = NULL;
+  pool = job->pool;
+  mutex_lock(&pool->lock);
+  if (job->state == JOB_RUNNING)
+    {
+      job->orphan = 1;
+      mutex_unlock(&pool->lock);
+      return 0;
+    }
+  if (job->state == JOB_QUEUED)
+    {
+      read_job **q = &pool->first;
+      pool->last = NULL;
+      while (*q != NULL)
+        {
+          if (*q == job)
+            *q = job->next;
+          else
+            {
+              pool->last = *q;
+              q = &(*q)->next;
+            }
+        }
+    }
+  mutex_unlock(&pool->lock);
+  job_free(job);
+  pool_unref(pool);
+  return 0;
 }
 
 
 /*
-** Create a new Connection object and push it on top of the stack.
+** Close environment object.
 */
-static int create_connection(lua_State *L, int env, sqlite3 *sql_conn)
+static int env_close (lua_State *L)
 {
-  conn_data *conn = (conn_data*)lua_newuserdata(L, sizeof(conn_data));
-  luasql_setmeta(L, LUASQL_CONNECTION_SQLITE);
+  env_data *env = (env_data *)luaL_checkudata(L, 1, LUASQL_ENVIRONMENT_SQLITE);
+  luaL_argcheck(L, env != NULL, 1, LUASQL_PREFIX"environment expected");
+  if (env->closed) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
 
-  /* fill in structure */
-  conn->closed = 0;
-  conn->env = LUA_NOREF;
-  conn->auto_commit = 1;
-  conn->sql_conn = sql_conn;
-  conn->cur_counter = 0;
-  lua_pushvalue (L, env);
-  conn->env = luaL_ref (L, LUA_REGISTRYINDEX);
+  env->closed = 1;
+  lua_pushboolean(L, 1);
   return 1;
 }
 
 
+#ifdef LUASQL_SQLITE_COMPAT
 /*
-** Connects to a data source.
+** Pushes nil and an error message of the SQLite 2 library, freeing it.
 */
-static int env_connect(lua_State *L)
+static int convert_fail(lua_State *L, char *errmsg)
 {
-  char *sourcename = NULL;
-  sqlite3 *conn;
-  const char *errmsg;
-  int res;
-  env_data *env = getenvironment(L);  /* validate environment */
-  int time_out = env->locktimeout;
-    
-  if( lua_istable( L, 2 ) ) {
-		lua_pushstring( L, LUASQL_SOURCENAME );
-		lua_gettable( L, 2 );
-		
-		if( lua_isstring( L, -1 ) )
-			sourcename = lua_tostring( L, -1 );
+  lua_pushnil(L);
+  lua_pushfstring(L, LUASQL_PREFIX"%s",
+		  errmsg != NULL ? errmsg : "unknown error");
+  sqlite_freemem(errmsg);
+  return 2;
+}
 
-		lua_pop( L, 1 );
-		lua_pushstring( L, LUASQL_LOCKTIMEOUT );
-		lua_gettable( L, 2 );
-		
-		if( lua_isnumber( L, -1 ) )
-			time_out = lua_tointeger( L, -1 );
 
-		lua_pop( L, 1 );
-  } else {
-	  sourcename = luaL_checkstring(L, 2);
+/*
+** Prepares the statement inserting a row of 'ncols' values into the
+** table 'name' of a SQLite3 database.
+** Return NULL on error.
+*/
+static sqlite3_stmt *convert_insert(sqlite3 *db, const char *name, int ncols)
+{
+  sqlite3_stmt *vm = NULL;
+  char *marks = (char *)malloc(2 * ncols);
+  char *sql;
+  int i;
 
-	  if( lua_isnumber(L, 3) )
-		  time_out = lua_tointeger(L, 3);
-  }
-  
-  res = sqlite3_open(sourcename, &conn);
+  if (marks == NULL)
+    return NULL;
+  for (i = 0; i < ncols; i++)
+    {
+      marks[2 * i] = '?';
+      marks[2 * i + 1] = ',';
+    }
+  marks[2 * ncols - 1] = '\0';
+  sql = sqlite3_mprintf("INSERT INTO \"%w\" VALUES (%s)", name, marks);
+  free(marks);
+  if (sql != NULL)
+    sqlite3_prepare_v2(db, sql, -1, &vm, NULL);
+  sqlite3_free(sql);
+  return vm;
+}
+
+
+/*
+** Streams the rows of the table 'name' of a SQLite 2 database into the
+** same table of a SQLite3 database, committing every 'batch' rows.
+** Adds the number of rows copied to 'rows'.
+** Return 0 on success, otherwise push nil + errmsg and return 2.
+*/
+static int convert_table(lua_State *L, sqlite *from, sqlite3 *to,
+			 const char *name, int batch, long *rows)
+{
+  sqlite_vm *vm;
+  sqlite3_stmt *ins = NULL;
+  const char **values, **columns;
+  char *sql, *errmsg = NULL;
+  int ncols, res, i;
+
+  sql = sqlite_mprintf("SELECT * FROM '%q'", name);
+  res = sqlite_compile(from, sql, NULL, &vm, &errmsg);
+  sqlite_freemem(sql);
   if (res != SQLITE_OK)
+    return convert_fail(L, errmsg);
+  while ((res = sqlite_step(vm, &ncols, &values, &columns)) == SQLITE_ROW)
     {
-      errmsg = sqlite3_errmsg(conn);
+      if (ins == NULL && (ins = convert_insert(to, name, ncols)) == NULL)
+	break;
+      /* SQLite 2 keeps every value as text */
+      for (i = 0; i < ncols; i++)
+	if (values[i] == NULL)
+	  sqlite3_bind_null(ins, i + 1);
+	else
+	  sqlite3_bind_text(ins, i + 1, values[i], -1, SQLITE_STATIC);
+      if (sqlite3_step(ins) != SQLITE_DONE || sqlite3_reset(ins) != SQLITE_OK)
+	break;
+      if (++*rows % batch == 0
+	  && sqlite3_exec(to, "COMMIT; BEGIN", NULL, NULL, NULL) != SQLITE_OK)
+	break;
+    }
+  if (res == SQLITE_ROW)
+    {
+      /* stopped by an error of the SQLite3 database */
       lua_pushnil(L);
-      lua_pushliteral(L, LUASQL_PREFIX);
-      lua_pushstring(L, errmsg);
-      lua_concat(L, 2);
-      sqlite3_close(conn);
+      lua_pushfstring(L, LUASQL_PREFIX"%s", sqlite3_errmsg(to));
+      sqlite3_finalize(ins);
+      sqlite_finalize(vm, NULL);
       return 2;
     }
-  
-  if (time_out > -1) {
-  	sqlite3_busy_timeout(conn, time_out);
-  }
-  
-  return create_connection(L, 1, conn);
+  sqlite3_finalize(ins);
+  if (sqlite_finalize(vm, &errmsg) != SQLITE_OK)
+    return convert_fail(L, errmsg);
+  return 0;
 }
 
 
 /*
-** Close environment object.
+** Copies a SQLite 2 database into a SQLite3 database.  The rows of each
+** table are streamed in transactions of 'batch' rows (default 1000);
+** views, indexes and triggers are created after the rows.
+** Return the number of rows copied, or nil + errmsg.
 */
-static int env_close (lua_State *L)
+static int env_convert(lua_State *L)
 {
-  env_data *env = (env_data *)luaL_checkudata(L, 1, LUASQL_ENVIRONMENT_SQLITE);
-  luaL_argcheck(L, env != NULL, 1, LUASQL_PREFIX"environment expected");
-  if (env->closed) {
-    lua_pushboolean(L, 0);
-    return 1;
-  }
+  const char *source = luaL_checkstring(L, 2);
+  const char *target = luaL_checkstring(L, 3);
+  int batch = luaL_optint(L, 4, 1000);
+  sqlite *from;
+  sqlite3 *to;
+  sqlite_vm *vm;
+  const char **values, **columns;
+  char *errmsg = NULL;
+  long rows = 0;
+  int ncols, n = 0, i, res;
 
-  env->closed = 1;
-  lua_pushboolean(L, 1);
+  getenvironment(L);
+  luaL_argcheck(L, batch > 0, 4, LUASQL_PREFIX"batch size must be positive");
+  if ((from = sqlite_open(source, 0, &errmsg)) == NULL)
+    return convert_fail(L, errmsg);
+
+  /* read the whole schema: tables first, then the objects using them */
+  lua_settop(L, 4);
+  lua_newtable(L);
+  res = sqlite_compile(from, "SELECT type, name, sql FROM sqlite_master"
+		       " WHERE sql NOT NULL ORDER BY CASE type"
+		       " WHEN 'table' THEN 0 WHEN 'view' THEN 1 ELSE 2 END,"
+		       " rowid", NULL, &vm, &errmsg);
+  if (res == SQLITE_OK)
+    {
+      while (sqlite_step(vm, &ncols, &values, &columns) == SQLITE_ROW)
+	for (i = 0; i < 3; i++)
+	  {
+	    lua_pushstring(L, values[i]);
+	    lua_rawseti(L, 5, ++n);
+	  }
+      res = sqlite_finalize(vm, &errmsg);
+    }
+  if (res != SQLITE_OK)
+    {
+      sqlite_close(from);
+      return convert_fail(L, errmsg);
+    }
+
+  res = sqlite3_open_v2(target, &to,
+			SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+  if (res == SQLITE_OK)
+    res = sqlite3_exec(to, "BEGIN", NULL, NULL, NULL);
+  for (i = 1; res == SQLITE_OK && i <= n; i += 3)
+    {
+      lua_rawgeti(L, 5, i);
+      lua_rawgeti(L, 5, i + 1);
+      lua_rawgeti(L, 5, i + 2);
+      res = sqlite3_exec(to, lua_tostring(L, -1), NULL, NULL, NULL);
+      if (res == SQLITE_OK && strcmp(lua_tostring(L, -3), "table") == 0
+	  && convert_table(L, from, to, lua_tostring(L, -2), batch, &rows))
+	{
+	  sqlite3_exec(to, "ROLLBACK", NULL, NULL, NULL);
+	  sqlite3_close(to);
+	  sqlite_close(from);
+	  return 2;
+	}
+      lua_pop(L, 3);
+    }
+  if (res == SQLITE_OK)
+    res = sqlite3_exec(to, "COMMIT", NULL, NULL, NULL);
+  if (res != SQLITE_OK)
+    {
+      lua_pushnil(L);
+      lua_pushfstring(L, LUASQL_PREFIX"%s", sqlite3_errmsg(to));
+      sqlite3_exec(to, "ROLLBACK", NULL, NULL, NULL);
+    }
+  sqlite3_close(to);
+  sqlite_close(from);
+  if (res != SQLITE_OK)
+    return 2;
+  lua_pushnumber(L, (lua_Number)rows);
   return 1;
 }
+#endif
 
 
 /*
@@ -746,6 +6211,12 @@ static void env_set(lua_State *L) {
 				if( strcmp(key, LUASQL_LOCKTIMEOUT) == 0 ) {
 					if( lua_isnumber( L, -1 ) )
 						env->locktimeout = lua_tointeger( L, -1 );
+				} else if( strcmp(key, LUASQL_SOFTHEAPLIMIT) == 0 ) {
+					if( lua_isnumber( L, -1 ) )
+						sqlite3_soft_heap_limit64( (sqlite3_int64)lua_tonumber( L, -1 ) );
+				} else if( strcmp(key, LUASQL_HARDHEAPLIMIT) == 0 ) {
+					if( lua_isnumber( L, -1 ) )
+						sqlite3_hard_heap_limit64( (sqlite3_int64)lua_tonumber( L, -1 ) );
 				}
 			}
 
@@ -754,6 +6225,22 @@ static void env_set(lua_State *L) {
 	}
 }
 
+/*
+ * Pushes the value of an environment parameter.
+ * Returns 0 (and pushes nothing) if the parameter is unknown.
+ */
+static int env_pushparam( lua_State *L, env_data *env, const char *key ) {
+	if( strcmp(key, LUASQL_LOCKTIMEOUT) == 0 )
+		lua_pushinteger( L, env->locktimeout );
+	else if( strcmp(key, LUASQL_SOFTHEAPLIMIT) == 0 )
+		lua_pushnumber( L, (lua_Number)sqlite3_soft_heap_limit64( -1 ) );
+	else if( strcmp(key, LUASQL_HARDHEAPLIMIT) == 0 )
+		lua_pushnumber( L, (lua_Number)sqlite3_hard_heap_limit64( -1 ) );
+	else
+		return push_memory_status( L, key );
+	return 1;
+}
+
 /*
  * Retrieve the specified environment parameters
  */
@@ -763,16 +6250,16 @@ static int env_get(lua_State *L) {
 	if( lua_istable( L, 2 ) ) {
 		int rsp = lua_gettop(L);
 		env_data *env = getenvironment(L);
-		char *key;
+		const char *key;
 		lua_pushnil(L);
 
 		while( lua_next(L, 2) != 0 ) {
 			if( lua_isstring(L, -1) ) {
 				key = lua_tostring(L, -1);
 
-				if( strcmp(key, LUASQL_LOCKTIMEOUT) == 0 ) {
-					lua_pushstring( L, LUASQL_LOCKTIMEOUT );
-					lua_pushinteger( L, env->locktimeout );
+				if( env_pushparam( L, env, key ) ) {
+					lua_pushstring( L, key );
+					lua_insert( L, -2 );
 					lua_settable( L, rsp );
 				}
 			}
@@ -782,11 +6269,9 @@ static int env_get(lua_State *L) {
 	} else
 		if( lua_isstring( L, 2 ) ) {
 			const char *key = lua_tostring(L, 2);
+			env_data *env = getenvironment(L);
 
-			if( strcmp(key, LUASQL_LOCKTIMEOUT) == 0 ) {
-				env_data *env = getenvironment(L);
-				lua_pushinteger( L, env->locktimeout );
-			} else
+			if( !env_pushparam( L, env, key ) )
 				lua_pushnil(L);
 		} else 
 			lua_pushnil(L);
@@ -804,15 +6289,33 @@ static void create_metatables (lua_State *L)
     {"__gc", env_close},
     {"close", env_close},
     {"connect", env_connect},
+    {"deserialize", env_deserialize},
+#ifdef LUASQL_SQLITE_COMPAT
+    {"convert", env_convert},
+#endif
+    {"readpool", env_readpool},
     {"get", env_get},
     {"set", env_set},
     {NULL, NULL},
   };
   struct luaL_reg connection_methods[] = {
-    {"__gc", conn_close},
+    {"__gc", conn_gc},
     {"close", conn_close},
     {"escape", conn_escape},
     {"execute", conn_execute},
+    {"flush", conn_flush},
+    {"interrupt", conn_interrupt},
+    {"prepare", conn_prepare},
+    {"insertmany", conn_insertmany},
+    {"exec_script", conn_exec_script},
+    {"openblob", conn_openblob},
+    {"backup", conn_backup},
+    {"serialize", conn_serialize},
+    {"profile", conn_profile},
+    {"checkpointer", conn_checkpointer},
+    {"createfunction", conn_createfunction},
+    {"createaggregate", conn_createaggregate},
+    {"createvtab", conn_createvtab},
     {"commit", conn_commit},
     {"rollback", conn_rollback},
     {"setautocommit", conn_setautocommit},
@@ -831,25 +6334,169 @@ static void create_metatables (lua_State *L)
     {"set", cur_set},
     {NULL, NULL},
   };
+  struct luaL_reg statement_methods[] = {
+    {"__gc", stmt_gc},
+    {"close", stmt_close},
+    {"bind", stmt_bind},
+    {"bind_names", stmt_bind_names},
+    {"bind_blob", stmt_bind_blob},
+    {"execute", stmt_execute},
+    {"reset", stmt_reset},
+    {NULL, NULL},
+  };
+  struct luaL_reg blob_methods[] = {
+    {"__gc", blob_gc},
+    {"close", blob_close},
+    {"read", blob_read},
+    {"write", blob_write},
+    {"size", blob_size},
+    {"reopen", blob_reopen},
+    {NULL, NULL},
+  };
+  struct luaL_reg backup_methods[] = {
+    {"__gc", backup_gc},
+    {"finish", backup_finish},
+    {"step", backup_step},
+    {"run", backup_run},
+    {"remaining", backup_remaining},
+    {"pagecount", backup_pagecount},
+    {NULL, NULL},
+  };
+  struct luaL_reg pool_methods[] = {
+    {"__gc", pool_close},
+    {"close", pool_close},
+    {"submit", pool_submit},
+    {NULL, NULL},
+  };
+  struct luaL_reg job_methods[] = {
+    {"__gc", job_gc},
+    {"done", job_done},
+    {"wait", job_wait},
+    {"result", job_result},
+    {NULL, NULL},
+  };
   luasql_createmeta(L, LUASQL_ENVIRONMENT_SQLITE, environment_methods);
   luasql_createmeta(L, LUASQL_CONNECTION_SQLITE, connection_methods);
   luasql_createmeta(L, LUASQL_CURSOR_SQLITE, cursor_methods);
-  lua_pop (L, 3);
+  luasql_createmeta(L, LUASQL_STATEMENT_SQLITE, statement_methods);
+  luasql_createmeta(L, LUASQL_BLOB_SQLITE, blob_methods);
+  luasql_createmeta(L, LUASQL_BACKUP_SQLITE, backup_methods);
+  luasql_createmeta(L, LUASQL_READPOOL_SQLITE, pool_methods);
+  luasql_createmeta(L, LUASQL_READJOB_SQLITE, job_methods);
+  lua_pop (L, 8);
+}
+
+/*
+** Preallocates the page cache of the process with the field
+** pagecache = {size=, count=} of the table at stack position 'idx':
+** 'count' slots for pages of 'size' bytes, shared by all connections.
+** It can only be done before SQLite is first used, and only once.
+** Return NULL on success or an error message.
+*/
+static const char *config_pagecache(lua_State *L, int idx)
+{
+  static void *pagecache = NULL;  /* kept for the life of the process */
+  int size, count, hdrsz = 0;
+  void *buff;
+
+  lua_getfield(L, idx, LUASQL_PAGECACHE);
+  if (!lua_istable(L, -1))
+    {
+      lua_pop(L, 1);
+      return NULL;
+    }
+  lua_getfield(L, -1, LUASQL_SIZE);
+  size = lua_isnumber(L, -1) ? lua_tointeger(L, -1) : 4096;
+  lua_getfield(L, -2, LUASQL_COUNT);
+  count = lua_isnumber(L, -1) ? lua_tointeger(L, -1) : 1000;
+  lua_pop(L, 3);
+  if (pagecache != NULL)
+    return "page cache already configured";
+  if (size <= 0 || count <= 0)
+    return "invalid page cache size";
+
+  /* each slot also holds the header of its page */
+  sqlite3_config(SQLITE_CONFIG_PCACHE_HDRSZ, &hdrsz);
+  size += hdrsz;
+  buff = malloc((size_t)size * count);
+  if (buff == NULL)
+    return "out of memory";
+  if (sqlite3_config(SQLITE_CONFIG_PAGECACHE, buff, size, count) != SQLITE_OK)
+    {
+      free(buff);
+      return "cannot configure the page cache after SQLite is in use";
+    }
+  pagecache = buff;
+  return NULL;
 }
 
+
 /*
 ** Creates an Environment and returns it.
+** Options (table at position 1): pagecache, applied to the whole process
+** before SQLite is first used, and soft_heap_limit and hard_heap_limit.
 */
 static int create_environment (lua_State *L)
 {
-  env_data *env = (env_data *)lua_newuserdata(L, sizeof(env_data));
+  env_data *env;
+
+  if (lua_istable(L, 1))
+    {
+      const char *errmsg = config_pagecache(L, 1);
+      if (errmsg != NULL)
+        {
+          lua_pushnil(L);
+          lua_pushfstring(L, LUASQL_PREFIX"%s", errmsg);
+          return 2;
+        }
+      lua_getfield(L, 1, LUASQL_SOFTHEAPLIMIT);
+      if (lua_isnumber(L, -1))
+        sqlite3_soft_heap_limit64((sqlite3_int64)lua_tonumber(L, -1));
+      lua_getfield(L, 1, LUASQL_HARDHEAPLIMIT);
+      if (lua_isnumber(L, -1))
+        sqlite3_hard_heap_limit64((sqlite3_int64)lua_tonumber(L, -1));
+      lua_pop(L, 2);
+    }
+
+  env = (env_data *)lua_newuserdata(L, sizeof(env_data));
   luasql_setmeta(L, LUASQL_ENVIRONMENT_SQLITE);
 
   /* fill in structure */
   env->closed = 0;
   env->locktimeout = 100; 
+  env->compat = 0;
+  return 1;
+}
+
+
+#ifdef LUASQL_SQLITE_COMPAT
+/*
+** Creates an Environment with the API of the SQLite 2 driver.
+*/
+static int create_compat_environment (lua_State *L)
+{
+  int res = create_environment(L);
+  if (res == 1)
+    ((env_data *)lua_touserdata(L, -1))->compat = 1;
+  return res;
+}
+
+
+/*
+** Registers luasql.sqlite, the SQLite 2 API backed by the SQLite3 engine.
+*/
+LUASQL_API int luaopen_luasql_sqlite(lua_State *L)
+{
+  struct luaL_reg driver[] = {
+    {"sqlite", create_compat_environment},
+    {NULL, NULL},
+  };
+  create_metatables (L);
+  luaL_openlib (L, LUASQL_TABLENAME, driver, 0);
+  luasql_set_info (L);
   return 1;
 }
+#endif
 
 
 /*
@@ -5,3 +5,257 @@
 
 table.insert (CUR_METHODS, "numrows")
 table.insert (EXTENSIONS, numrows)
+
+table.insert (CONN_METHODS, "prepare")
+
+---------------------------------------------------------------------
+-- Server-side prepared statements.
+---------------------------------------------------------------------
+function prepare ()
+	local ins = assert (CONN:prepare (nil, "insert into t (f1, f2) values ($1, $2)"))
+	assert2 (1, ins:execute ("a", 1))
+	assert2 (1, ins:execute ("b", 2.5))
+	assert2 (nil, ins:execute ("c"), "wrong number of parameters")
+	assert2 (true, ins:close ())
+	assert2 (false, ins:close ())
+	assert2 (false, pcall (ins.execute, ins, "a", 1))
+
+	local sel = assert (CONN:prepare ("sel", "select f1 from t where f2 = $1"))
+	local cur = CUR_OK (sel:execute ("2.5"))
+	assert2 ("b", cur:fetch ())
+	assert2 (nil, cur:fetch ())
+	assert2 (true, sel:close ())
+	sel = assert (CONN:prepare ("sel", "select 1"))
+	assert2 (true, sel:close ())
+
+	-- binary parameters
+	local bin = assert (CONN:prepare (nil,
+		"select $1::int2 + 1, $2::int4 - 1, $3::int8, $4::float4, $5::float8 * 2, not $6::boolean, length ($7::bytea)"))
+	cur = CUR_OK (bin:execute (-2, 2147483647, -5000000000, 0.5, 1.25, true, "a\0b"))
+	local a, b, c, d, e, f, g = cur:fetch ()
+	assert2 ("-1", a)
+	assert2 ("2147483646", b)
+	assert2 ("-5000000000", c)
+	assert2 ("0.5", d)
+	assert2 ("2.5", e)
+	assert2 ("f", f)
+	assert2 ("3", g)
+	cur:close ()
+	assert2 (true, bin:close ())
+	assert2 (2, CONN:execute ("delete from t where f1 in ('a', 'b')"))
+	io.write (" prepare")
+end
+
+table.insert (EXTENSIONS, prepare)
+
+---------------------------------------------------------------------
+-- Values pushed by column type.
+---------------------------------------------------------------------
+function typed ()
+	local sql = "select 1::int4, 2.5::float8, 1.50::numeric, true, '\\x610062'::bytea, null::int4, 'x'::text"
+	local cur = CUR_OK (CONN:execute (sql))
+	assert2 (false, cur:get"typed")
+	cur:set { typed = true }
+	local a, b, c, d, e, f, g = cur:fetch ()
+	assert2 (1, a)
+	assert2 (2.5, b)
+	assert2 (1.5, c)
+	assert2 (true, d)
+	assert2 ("a\0b", e)
+	assert2 (nil, f)
+	assert2 ("x", g)
+	cur:close ()
+
+	CONN:set { typed = true, numeric_string = true }
+	assert2 (true, CONN:get"typed")
+	cur = CUR_OK (CONN:execute (sql))
+	a, b, c, d = cur:fetch ()
+	assert2 (1, a)
+	assert2 ("1.50", c)
+	assert2 (true, d)
+	cur:close ()
+	CONN:set { typed = false, numeric_string = false }
+	io.write (" typed")
+end
+
+table.insert (EXTENSIONS, typed)
+
+---------------------------------------------------------------------
+-- Binary results of prepared statements.
+---------------------------------------------------------------------
+function binary ()
+	CONN:set { binary = true }
+	assert2 (true, CONN:get"binary")
+	local stmt = assert (CONN:prepare (nil, "select $1::int8, $2::float8, true, '\\x00ff'::bytea, "..
+		"'a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11'::uuid, timestamp '2000-01-01 00:00:01', "..
+		"date '1970-01-02', 'x'::varchar, null::int4"))
+	local cur = CUR_OK (stmt:execute (-5000000000, 0.5))
+	local a, b, c, d, e, f, g, h, i = cur:fetch ()
+	assert2 (-5000000000, a)
+	assert2 (0.5, b)
+	assert2 (true, c)
+	assert2 ("\0\255", d)
+	assert2 ("a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11", e)
+	assert2 (946684801 * 1e6, f)
+	assert2 (1, g)
+	assert2 ("x", h)
+	assert2 (nil, i)
+	cur:close ()
+	assert2 (true, stmt:close ())
+	-- numeric is not decoded: the statement falls back to text
+	stmt = assert (CONN:prepare (nil, "select 1.5::numeric"))
+	cur = CUR_OK (stmt:execute ())
+	assert2 ("1.5", cur:fetch ())
+	cur:close ()
+	assert2 (true, stmt:close ())
+	CONN:set { binary = false }
+	io.write (" binary")
+end
+
+table.insert (EXTENSIONS, binary)
+
+table.insert (CONN_METHODS, "stream")
+
+---------------------------------------------------------------------
+-- Streaming cursors.
+---------------------------------------------------------------------
+function stream ()
+	local cur = CUR_OK (CONN:stream ("select generate_series (1, 5)"))
+	assert2 (false, pcall (CONN.execute, CONN, "select 1"), "connection used during a stream")
+	assert2 (false, pcall (CONN.close, CONN), "connection closed during a stream")
+	assert2 (nil, cur:numrows ())
+	for i = 1, 5 do
+		assert2 (tostring (i), cur:fetch ())
+	end
+	assert2 (nil, cur:fetch ())
+	assert2 (false, cur:close ())
+
+	cur = CUR_OK (CONN:stream ("select generate_series (1, 5)", 2))
+	local n = 0
+	while cur:fetch () do
+		n = n + 1
+	end
+	assert2 (5, n)
+
+	cur = CUR_OK (CONN:stream ("select 1 where false"))
+	assert2 (nil, cur:fetch ())
+	assert2 (0, CONN:stream ("update t set f1 = f1 where false"))
+
+	if CONN:get"autocommit" then
+		-- closing the cursor cancels the query
+		cur = CUR_OK (CONN:stream ("select generate_series (1, 100000000)"))
+		assert2 ("1", cur:fetch ())
+		assert2 (true, cur:close ())
+		assert2 (0, CONN:execute ("update t set f1 = f1 where false"))
+
+		-- in a transaction, closing it reads the rest instead of aborting
+		assert2 (true, CONN:setautocommit (false))
+		assert2 (1, CONN:execute ("insert into t (f1) values ('s')"))
+		cur = CUR_OK (CONN:stream ("select generate_series (1, 100000)"))
+		assert2 ("1", cur:fetch ())
+		assert2 (true, cur:close ())
+		assert2 (true, CONN:commit ())
+		assert2 (true, CONN:setautocommit (true))
+		assert2 (1, CONN:execute ("delete from t where f1 = 's'"))
+	end
+	io.write (" stream")
+end
+
+table.insert (EXTENSIONS, stream)
+
+table.insert (CONN_METHODS, "copyin")
+table.insert (CONN_METHODS, "copyout")
+
+---------------------------------------------------------------------
+-- COPY from Lua iterators and to Lua sinks.
+---------------------------------------------------------------------
+function copy ()
+	local rows = { { "a\tb", "1" }, { "c\\d", n = 2 }, "e\t3\n" }
+	local i = 0
+	assert2 (3, CONN:copyin ("copy t (f1, f2) from stdin", function ()
+		i = i + 1
+		return rows[i]
+	end))
+
+	local got = {}
+	assert2 (3, CONN:copyout ("copy (select f1, f2 from t order by f1) to stdout", function (row)
+		table.insert (got, row)
+	end, true))
+	assert2 ("a\tb", got[1][1])
+	assert2 ("1", got[1][2])
+	assert2 ("c\\d", got[2][1])
+	assert2 (nil, got[2][2])
+	assert2 (2, got[2].n)
+	assert2 ("e", got[3][1])
+
+	local chunks = {}
+	local sink = { write = function (self, chunk) table.insert (chunks, chunk) end }
+	assert2 (3, CONN:copyout ("copy (select f1 from t order by f1) to stdout", sink))
+	assert2 ("a\\tb\n", chunks[1])
+
+	assert2 (nil, CONN:copyin ("copy t (f1) from stdin", function () error ("stop") end))
+	assert2 (nil, CONN:copyin ("select 1", function () end))
+	assert2 (3, CONN:execute ("delete from t where f1 in ('a\tb', 'c\\d', 'e')"))
+
+	-- numbers are sent without losing digits
+	local sent = false
+	assert2 (1, CONN:copyin ("copy t (f1) from stdin", function ()
+		if not sent then
+			sent = true
+			return { 1234567890123456 }
+		end
+	end))
+	assert2 (1, CONN:execute ("delete from t where f1 = '1234567890123456'"))
+
+	-- the callbacks cannot use the connection during the COPY
+	local used
+	assert2 (0, CONN:copyin ("copy t (f1) from stdin", function ()
+		used = pcall (CONN.execute, CONN, "select 1")
+	end))
+	assert2 (false, used)
+	used = nil
+	assert2 (1, CONN:copyout ("copy (select 1) to stdout", function ()
+		used = pcall (CONN.execute, CONN, "select 1")
+	end))
+	assert2 (false, used)
+	io.write (" copy")
+end
+
+table.insert (EXTENSIONS, copy)
+
+---------------------------------------------------------------------
+-- Pipeline mode.
+---------------------------------------------------------------------
+function pipeline ()
+	if not CONN.pipeline then
+		return -- built with libpq older than 14
+	end
+	local stmt = assert (CONN:prepare (nil, "insert into t (f1) values ($1)"))
+	local keep
+	local res, err = CONN:pipeline (function (p)
+		keep = p
+		assert2 (1, p:execute (stmt, "a"))
+		assert2 (2, p:execute ("insert into t (f1) values ($1)", "b"))
+		assert2 (3, p:execute ("select nonexistent_column from t"))
+		assert2 (4, p:execute ("select f1 from t where f1 = $1", "b"))
+		assert2 (false, pcall (CONN.execute, CONN, "select 1"), "connection used during a pipeline")
+	end)
+	assert2 (1, res[1])
+	assert2 (1, res[2])
+	assert2 (false, res[3])
+	assert2 ("string", type (err[3]))
+	assert2 ("b", res[4]:fetch ())
+	assert2 (true, res[4]:close ())
+	assert2 (false, pcall (keep.execute, keep, "select 1"), "pipeline used after its end")
+
+	assert2 (nil, CONN:pipeline (function (p)
+		p:execute ("delete from t where f1 in ('a', 'b')")
+		error ("stop")
+	end))
+	assert2 (0, CONN:execute ("delete from t where f1 in ('a', 'b')"))
+	assert2 (true, stmt:close ())
+	io.write (" pipeline")
+end
+
+-- not in CONN_METHODS, since conn:pipeline needs libpq 14 or newer
+table.insert (EXTENSIONS, pipeline)
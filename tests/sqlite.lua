@@ -14,4 +14,44 @@ end
 
 function checkUnknownDatabase(ENV)
 	-- skip this test
-end
\ No newline at end of file
+end
+
+---------------------------------------------------------------------
+-- SQLite 2 API on the SQLite3 driver (built with LUASQL_SQLITE_COMPAT):
+-- values are fetched as strings, from the engine or the result cache.
+---------------------------------------------------------------------
+function compat ()
+	if not ENV.convert then
+		return -- the SQLite 2 driver
+	end
+	assert2 (32, CONN:get"stmtcache")
+	CONN:set { resultcache = 65536 }
+	for i = 1, 2 do
+		local cur = CUR_OK (CONN:execute ("select count(*), 1.5 + 1, null from t"))
+		local n, f, z = cur:fetch ()
+		assert2 ("0", n)
+		assert2 ("2.5", f)
+		assert2 (nil, z)
+		assert2 (nil, cur:fetch ())
+	end
+	assert2 (1, CONN:get"resultcache_hits")
+	CONN:set { resultcache = 0 }
+
+	-- a new SQLite 2 database converts to an empty SQLite3 one
+	local source, target = os.tmpname (), os.tmpname ()
+	os.remove (source)
+	os.remove (target)
+	assert2 (0, ENV:convert (source, target))
+	local conn = CONN_OK (ENV:connect (target))
+	local cur = CUR_OK (conn:execute ("select count(*) from sqlite_master"))
+	assert2 ("0", cur:fetch ())
+	cur:close ()
+	assert2 (true, conn:close ())
+	assert2 (nil, ENV:convert (source, source.."/missing/target"))
+	assert2 (false, pcall (ENV.convert, ENV, source, target, 0))
+	os.remove (source)
+	os.remove (target)
+	io.write (" compat")
+end
+
+table.insert (EXTENSIONS, compat)
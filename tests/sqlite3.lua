@@ -16,4 +16,836 @@ end
 
 function checkUnknownDatabase(ENV)
 	-- skip this test
-end
\ No newline at end of file
+end
+
+table.insert (CONN_METHODS, "prepare")
+
+---------------------------------------------------------------------
+-- Prepared statements with parameter binding.
+---------------------------------------------------------------------
+function prepare ()
+	local ins = assert (CONN:prepare ("insert into t (f1, f2) values (?, ?)"))
+	assert2 (1, ins:execute ("a", 1))
+	assert2 (true, ins:bind ("b", 2.5))
+	assert2 (1, ins:execute ())
+	assert2 (true, ins:reset ())
+	assert2 (1, ins:execute ())
+	assert2 (true, ins:close ())
+	assert2 (false, ins:close ())
+	assert2 (false, pcall (ins.execute, ins))
+
+	local sel = assert (CONN:prepare ("select f2 from t where f1 = :key order by f2"))
+	assert2 (true, sel:bind_names { key = "b" })
+	local cur = CUR_OK (sel:execute ())
+	assert2 (false, pcall (sel.execute, sel), "statement executed with an open cursor")
+	assert2 ("2.5", cur:fetch ())
+	assert2 ("2.5", cur:fetch ())
+	assert2 (nil, cur:fetch ())
+	cur:close ()
+	cur = CUR_OK (sel:execute ("a"))
+	assert2 ("1", cur:fetch ())
+	cur:close ()
+	assert2 (true, sel:close ())
+	assert2 (2, CONN:execute ("delete from t where f1 = 'b'"))
+	assert2 (1, CONN:execute ("delete from t where f1 = 'a'"))
+	io.write (" prepare")
+end
+
+table.insert (EXTENSIONS, prepare)
+
+---------------------------------------------------------------------
+-- Statement cache of conn:execute.
+---------------------------------------------------------------------
+function stmtcache ()
+	assert2 (0, CONN:get"stmtcache")
+	CONN:set { stmtcache = 2 }
+	for i = 1, 3 do
+		assert2 (1, CONN:execute ("insert into t (f1) values ('a')"))
+	end
+	local info = CONN:get { "stmtcache_hits", "stmtcache_misses", "stmtcache_size" }
+	assert2 (2, info.stmtcache_hits)
+	assert2 (1, info.stmtcache_misses)
+	assert2 (1, info.stmtcache_size)
+	local cur = CUR_OK (CONN:execute ("select count(*) from t"))
+	assert2 (1, CONN:get"stmtcache_size")
+	assert2 (3, cur:fetch ())
+	cur:close ()
+	assert2 (2, CONN:get"stmtcache_size", "statement not given back to the cache")
+	CONN:set { stmtcache = 0 }
+	assert2 (0, CONN:get"stmtcache_size")
+	assert2 (3, CONN:execute ("delete from t where f1 = 'a'"))
+	assert2 (1, CONN:execute ("insert into t (f1) values ('a')"))
+	assert2 (1, CONN:execute ("delete from t where f1 = 'a'"))
+	io.write (" stmtcache")
+end
+
+table.insert (EXTENSIONS, stmtcache)
+
+table.insert (CONN_METHODS, "insertmany")
+
+---------------------------------------------------------------------
+-- Bulk insertion.
+---------------------------------------------------------------------
+function insertmany ()
+	local rows = {}
+	for i = 1, 10 do
+		rows[i] = { "a", tostring(i) }
+	end
+	assert2 (10, CONN:insertmany ("insert into t (f1, f2) values (?, ?)", rows, 3))
+	local i = 0
+	local function iter ()
+		i = i + 1
+		if i <= 5 then
+			return { key = "b", value = tostring(i) }
+		end
+	end
+	assert2 (5, CONN:insertmany ("insert into t (f1, f2) values (:key, :value)", iter))
+	local res, err, row = CONN:insertmany ("insert into t (f1, f2) values (?, ?)", { {"c", "1"}, {"c", {}} })
+	assert2 (nil, res)
+	assert2 ("string", type(err))
+	assert2 (2, row)
+	local cur = CUR_OK (CONN:execute ("select count(*) from t where f1 = 'c'"))
+	assert2 (0, cur:fetch (), "failed batch was not rolled back")
+	cur:close ()
+	assert2 (10, CONN:execute ("delete from t where f1 = 'a'"))
+	assert2 (5, CONN:execute ("delete from t where f1 = 'b'"))
+	assert2 (1, CONN:execute ("insert into t (f1) values ('a')"))
+	assert2 (1, CONN:execute ("delete from t where f1 = 'a'"))
+	io.write (" insertmany")
+end
+
+table.insert (EXTENSIONS, insertmany)
+
+table.insert (CONN_METHODS, "openblob")
+
+---------------------------------------------------------------------
+-- Incremental BLOB I/O.
+---------------------------------------------------------------------
+function openblob ()
+	assert (CONN:execute ("create table b (id integer primary key, data blob)"))
+	assert2 (1, CONN:execute ("insert into b values (1, zeroblob(10))"))
+	assert2 (1, CONN:execute ("insert into b values (2, 'xyz')"))
+	local blob = assert (CONN:openblob ("main", "b", "data", 1, true))
+	assert2 (10, blob:size ())
+	assert2 (true, blob:write ("01234"))
+	assert2 (true, blob:write ("56789"))
+	assert2 (nil, blob:write ("a"), "write past the end of the blob")
+	assert2 ("0123", blob:read (4, 0))
+	assert2 ("456789", blob:read (100))
+	assert2 (nil, blob:read (1))
+	assert2 ("", blob:read (0, 100))
+	assert2 (true, blob:reopen (2))
+	assert2 ("xyz", blob:read (3))
+	assert2 (true, blob:close ())
+	assert2 (false, blob:close ())
+	assert2 (nil, CONN:openblob ("main", "b", "data", 3))
+	assert (CONN:execute ("drop table b"))
+	assert2 (1, CONN:execute ("insert into t (f1) values ('a')"))
+	assert2 (1, CONN:execute ("delete from t where f1 = 'a'"))
+	io.write (" openblob")
+end
+
+table.insert (EXTENSIONS, openblob)
+
+---------------------------------------------------------------------
+-- Connection tuning.
+---------------------------------------------------------------------
+function tuning ()
+	local path = os.tmpname ()
+	local conn = assert (ENV:connect {
+		sourcename = path,
+		busy_timeout = 250,
+		journal_mode = "wal",
+		synchronous = 1,
+		cache_size = -4000,
+		temp_store = "memory",
+	})
+	assert2 ("wal", conn:get ("journal_mode"))
+	assert2 (1, conn:get ("synchronous"))
+	assert2 (-4000, conn:get ("cache_size"))
+	assert2 (2, conn:get ("temp_store"))
+	assert2 (250, conn:get ("busy_timeout"))
+	assert2 (false, conn:get ("readonly"))
+	assert (conn:execute ("create table x (a integer)"))
+	assert2 (true, conn:close ())
+	conn = assert (ENV:connect { sourcename = path, readonly = true })
+	assert2 (true, conn:get ("readonly"))
+	assert2 (nil, conn:execute ("insert into x values (1)"))
+	assert2 (true, conn:close ())
+	assert2 (nil, ENV:connect { sourcename = ":memory:", journal_mode = "wal" })
+	assert2 (nil, ENV:connect { sourcename = path, readonly = true,
+		mutex = "nomutex", uri = true, journal_mode = "bogus" })
+	os.remove (path)
+	os.remove (path.."-wal")
+	os.remove (path.."-shm")
+	io.write (" tuning")
+end
+
+table.insert (EXTENSIONS, tuning)
+
+table.insert (CONN_METHODS, "exec_script")
+
+---------------------------------------------------------------------
+-- Multi-statement scripts.
+---------------------------------------------------------------------
+function exec_script ()
+	assert2 (3, CONN:exec_script ([[
+		create table s (a integer);
+		insert into s values (1);
+		insert into s values (2); -- comment
+		update s set a = a + 1 where a = 2;
+		/* trailing comment */ ]]))
+	local n, timings = CONN:exec_script ("select * from s; delete from s where a = 1",
+		{ timings = true })
+	assert2 (1, n)
+	assert2 (2, #timings)
+	assert2 ("number", type (timings[1]))
+	assert2 (nil, CONN:exec_script ("insert into s values (4); bogus; insert into s values (5)"))
+	local _, _, index = CONN:exec_script ("insert into s values (6); insert into nowhere values (1)",
+		{ transaction = true })
+	assert2 (2, index)
+	local cur = CUR_OK (CONN:execute ("select count(*) from s where a in (4, 5, 6)"))
+	assert2 ("1", tostring (cur:fetch ()), "failed script was not rolled back")
+	cur:close ()
+	assert (CONN:exec_script ("drop table s"))
+	assert2 (1, CONN:execute ("insert into t (f1) values ('a')"))
+	assert2 (1, CONN:execute ("delete from t where f1 = 'a'"))
+	io.write (" exec_script")
+end
+
+table.insert (EXTENSIONS, exec_script)
+
+table.insert (CONN_METHODS, "backup")
+
+---------------------------------------------------------------------
+-- Online backup.
+---------------------------------------------------------------------
+function backup ()
+	local src = CONN_OK (ENV:connect (":memory:"))
+	assert (src:exec_script ([[
+		create table k (a integer, b text);
+		insert into k values (1, zeroblob(10000));
+		insert into k values (2, zeroblob(10000));]]))
+	-- step by hand into another connection
+	local dest = CONN_OK (ENV:connect (":memory:"))
+	local b = assert (src:backup (dest, { pages_per_step = 1 }))
+	assert2 (false, b:step ())
+	assert2 (true, b:pagecount () > 1)
+	assert2 (b:pagecount () - 1, b:remaining ())
+	assert2 (true, b:step (-1))
+	assert2 (0, b:remaining ())
+	assert2 (true, b:finish ())
+	assert2 (false, b:finish ())
+	local cur = CUR_OK (dest:execute ("select count(*) from k"))
+	assert2 (2, cur:fetch ())
+	cur:close ()
+	-- run to completion into a file
+	local path = os.tmpname ()
+	local calls = 0
+	b = assert (src:backup (path, { pages_per_step = 2,
+		progress = function (remaining, total)
+			calls = calls + 1
+			assert2 (true, remaining < total)
+		end }))
+	assert2 (true, b:run ())
+	assert2 (true, calls > 1)
+	local copy = CONN_OK (ENV:connect (path))
+	cur = CUR_OK (copy:execute ("select count(*) from k"))
+	assert2 (2, cur:fetch ())
+	cur:close ()
+	assert2 (true, copy:close ())
+	-- interrupted by the progress function
+	b = assert (src:backup (dest, { pages_per_step = 1,
+		progress = function () return false end }))
+	assert2 (nil, b:run ())
+	-- finished by its connection
+	assert2 (true, src:close ())
+	assert2 (false, b:finish ())
+	assert2 (true, dest:close ())
+	os.remove (path)
+	io.write (" backup")
+end
+
+table.insert (EXTENSIONS, backup)
+
+table.insert (CONN_METHODS, "serialize")
+table.insert (ENV_METHODS, "deserialize")
+
+---------------------------------------------------------------------
+-- Database images.
+---------------------------------------------------------------------
+function serialize ()
+	local src = CONN_OK (ENV:connect (":memory:"))
+	assert (src:exec_script ([[
+		create table k (a integer);
+		insert into k values (1);
+		insert into k values (2);]]))
+	local image = assert (src:serialize ())
+	assert2 ("SQLite format 3\0", image:sub (1, 16))
+	assert2 (true, src:close ())
+	-- file databases are copied
+	local file = CONN_OK (ENV:connect (datasource))
+	assert2 ("string", type (file:serialize ()))
+	assert2 (nil, file:serialize ("nodb"))
+	assert2 (true, file:close ())
+
+	local copy = CONN_OK (ENV:deserialize (image))
+	local cur = CUR_OK (copy:execute ("select sum(a) from k"))
+	assert2 (3, cur:fetch ())
+	cur:close ()
+	assert2 (1, copy:execute ("insert into k values (3)"))
+	assert2 (true, copy:close ())
+	copy = CONN_OK (ENV:deserialize (image, { readonly = true }))
+	assert2 (nil, copy:execute ("insert into k values (3)"))
+	assert2 (true, copy:close ())
+	assert2 (nil, ENV:deserialize ("not a database"):execute ("select * from k"))
+	-- images of WAL databases
+	local path = os.tmpname ()
+	local wal = CONN_OK (ENV:connect (path))
+	assert (wal:execute ("pragma journal_mode = wal")):close ()
+	assert (wal:exec_script ("create table w (a integer); insert into w values (4);"))
+	image = assert (wal:serialize ())
+	assert2 (true, wal:close ())
+	os.remove (path)
+	os.remove (path.."-wal")
+	os.remove (path.."-shm")
+	copy = CONN_OK (ENV:deserialize (image))
+	cur = CUR_OK (copy:execute ("select a from w"))
+	assert2 (4, cur:fetch ())
+	cur:close ()
+	assert2 (true, copy:close ())
+	io.write (" serialize")
+end
+
+table.insert (EXTENSIONS, serialize)
+
+table.insert (CONN_METHODS, "profile")
+
+---------------------------------------------------------------------
+-- Statement profiling.
+---------------------------------------------------------------------
+function profile ()
+	local conn = CONN_OK (ENV:connect (":memory:"))
+	local stats = conn:profile ()
+	assert2 (nil, next (stats))
+	local slow, traced = {}, {}
+	conn:profile { enable = true, slow_ms = 0,
+		slow = function (sql, ms) slow[sql] = ms end,
+		trace = function (sql) traced[#traced + 1] = sql end }
+	assert (conn:exec_script ([[
+		create table k (a integer);
+		insert into k values (1);
+		insert into k values (2);
+		insert into k values (3);]]))
+	local stmt = assert (conn:prepare ("select a from k where a > ?"))
+	for i = 1, 2 do
+		assert (stmt:bind (i))
+		local cur = CUR_OK (stmt:execute ())
+		while cur:fetch () do end
+	end
+	assert2 (true, stmt:close ())
+	local cache
+	stats, cache = conn:profile { reset = true }
+	local s = stats["select a from k where a > ?"]
+	assert2 (2, s.count)
+	assert2 (3, s.rows)
+	assert2 (true, s.min <= s.max and s.max <= s.time)
+	assert2 (true, s.fullscan_steps > 0)
+	assert2 (3, stats["insert into k values (?);"].count)
+	assert2 ("number", type (cache.cache_hit))
+	assert2 ("number", type (slow["select a from k where a > ?"]))
+	assert2 (6, #traced)
+	assert2 (nil, next ((conn:profile ())), "statistics were not reset")
+	conn:profile { enable = false }
+	assert (conn:execute ("select * from k")):close ()
+	assert2 (nil, next ((conn:profile ())))
+	-- the callbacks cannot close the connection or stop profiling
+	local refused = {}
+	conn:profile { enable = true, trace = function ()
+		refused.close = not pcall (conn.close, conn)
+		refused.profile = not pcall (conn.profile, conn, { enable = false })
+	end }
+	assert (conn:execute ("select * from k")):close ()
+	assert2 (true, refused.close)
+	assert2 (true, refused.profile)
+	conn:profile { enable = false }
+	assert2 (true, conn:close ())
+	io.write (" profile")
+end
+
+table.insert (EXTENSIONS, profile)
+
+table.insert (CONN_METHODS, "createfunction")
+table.insert (CONN_METHODS, "createaggregate")
+
+---------------------------------------------------------------------
+-- SQL functions written in Lua.
+---------------------------------------------------------------------
+function functions ()
+	local conn = CONN_OK (ENV:connect (":memory:"))
+	local function fetch (sql)
+		local cur = CUR_OK (conn:execute (sql))
+		local a, b = cur:fetch ()
+		cur:close ()
+		return a, b
+	end
+	assert (conn:exec_script ([[
+		create table k (a integer, b text);
+		insert into k values (5, 'x');
+		insert into k values (15, 'y');
+		insert into k values (25, 'x');]]))
+	assert2 (true, conn:createfunction ("bucket", 1,
+		function (x) return math.floor (x / 10) end, { deterministic = true }))
+	assert2 (true, conn:createfunction ("concat", -1, function (...)
+		return table.concat ({...}, ",")
+	end))
+	assert2 (2, fetch ("select bucket(25)"))
+	assert2 ("x,2,1.5", fetch ("select concat('x', 2, 1.5)"))
+	assert2 (2, fetch ("select count(*) from k where bucket(a) >= 1"))
+	assert (conn:execute ("create index kb on k (bucket(a))"))
+	assert2 (nil, conn:execute ("create index kc on k (concat(a))"))
+	assert2 (true, conn:createfunction ("boom", 0, function () error ("boom!") end))
+	local _, err = conn:execute ("select boom()")
+	assert2 (true, string.find (err, "boom!", 1, true) ~= nil)
+	assert2 (true, conn:createfunction ("tab", 0, function () return {} end))
+	assert2 (nil, conn:execute ("select tab()"))
+
+	assert2 (true, conn:createaggregate ("lsum", 1,
+		function (s, x) return (s or 0) + x end))
+	assert2 (true, conn:createaggregate ("avgx", 2,
+		function (s, x, b)
+			s = s or { n = 0, sum = 0 }
+			if b == "x" then s.n = s.n + 1; s.sum = s.sum + x end
+			return s
+		end,
+		function (s) return s and s.sum / s.n end))
+	assert2 (45, fetch ("select lsum(a) from k"))
+	assert2 (15, fetch ("select avgx(a, b) from k"))
+	assert2 (nil, fetch ("select avgx(a, b) from k where a > 100"))
+	local cur = CUR_OK (conn:execute ("select b, lsum(a) from k group by b order by b"))
+	assert2 ("x", cur:fetch ())
+	local b, s = cur:fetch ()
+	assert2 ("y", b)
+	assert2 (15, s)
+	cur:close ()
+	assert2 (true, conn:close ())
+	io.write (" functions")
+end
+
+table.insert (EXTENSIONS, functions)
+
+table.insert (CONN_METHODS, "createvtab")
+
+---------------------------------------------------------------------
+-- Virtual tables backed by Lua.
+---------------------------------------------------------------------
+function createvtab ()
+	local conn = CONN_OK (ENV:connect (":memory:"))
+	local records = {}
+	for i = 1, 100 do
+		records[i] = { id = i, name = "r"..i }
+	end
+	local scanned
+	assert2 (true, conn:createvtab ("recs", { "id", "name" }, {
+		scan = function (constraints)
+			scanned = constraints
+			local c = constraints[1]
+			if c and c.column == "id" and c.op == "=" then
+				return { records[c.value] }
+			end
+			local i = 0
+			return function ()
+				i = i + 1
+				return records[i]
+			end
+		end,
+	}))
+	local cur = CUR_OK (conn:execute ("select name from recs where id = 42"))
+	assert2 ("r42", cur:fetch ())
+	assert2 (nil, cur:fetch ())
+	assert2 (1, #scanned)
+	assert2 (42, scanned[1].value)
+	cur = CUR_OK (conn:execute ("select count(*) from recs where id > 90"))
+	assert2 (10, cur:fetch ())
+	cur:close ()
+	assert2 (0, #scanned)
+	-- join against a real table, looking up by id
+	assert (conn:exec_script ([[
+		create table k (rid integer);
+		insert into k values (7);
+		insert into k values (8);]]))
+	cur = CUR_OK (conn:execute ("select group_concat(name) from k join recs on recs.id = k.rid"))
+	assert2 ("r7,r8", cur:fetch ())
+	cur:close ()
+
+	-- rows by position and a custom plan
+	local seen
+	assert2 (true, conn:createvtab ("pairs", { "a", "b" }, {
+		scan = function (constraints)
+			seen = constraints
+			return { { 1, "x" }, { 2, "y" }, { 3, "z" } }
+		end,
+		best_index = function (usable)
+			local use = {}
+			for i, c in ipairs (usable) do
+				if c.op == ">" then use[#use + 1] = i end
+			end
+			return use, 5
+		end,
+	}))
+	cur = CUR_OK (conn:execute ("select b from pairs where a > 1 and b != 'y'"))
+	assert2 ("z", cur:fetch ())
+	cur:close ()
+	assert2 (1, #seen)
+	assert2 (">", seen[1].op)
+	assert2 ("a", seen[1].column)
+
+	assert2 (true, conn:createvtab ("broken", { "a" }, {
+		scan = function () error ("cannot scan") end,
+	}))
+	local _, err = conn:execute ("select * from broken")
+	assert2 (true, string.find (err, "cannot scan", 1, true) ~= nil)
+	assert2 (true, conn:close ())
+	io.write (" createvtab")
+end
+
+table.insert (EXTENSIONS, createvtab)
+
+table.insert (CONN_METHODS, "checkpointer")
+
+---------------------------------------------------------------------
+-- Background WAL checkpointer.
+---------------------------------------------------------------------
+function checkpointer ()
+	local path = os.tmpname ()
+	local conn = CONN_OK (ENV:connect { sourcename = path, journal_mode = "wal" })
+	assert2 (nil, conn:get ("checkpoints"))
+	assert2 (true, conn:checkpointer { interval_ms = 10, restart_pages = 1 })
+	local cur = CUR_OK (conn:execute ("pragma wal_autocheckpoint"))
+	assert2 (0, cur:fetch ())
+	cur:close ()
+	assert (conn:exec_script ([[
+		create table c (a);
+		insert into c values (1);
+		insert into c values (2);]]))
+	local start = os.clock ()
+	while conn:get ("checkpoints") < 2 and os.clock () - start < 5 do end
+	assert (conn:get ("checkpoints") >= 2, "checkpointer did not run")
+	local stats = conn:get { "wal_size", "wal_frames", "checkpointed_frames", "checkpoint_ms" }
+	assert2 ("number", type (stats.wal_size))
+	assert (stats.checkpointed_frames <= stats.wal_frames)
+	assert (stats.checkpoint_ms >= 0)
+	assert2 (true, conn:checkpointer { enable = false })
+	assert2 (nil, conn:get ("checkpoints"))
+	cur = CUR_OK (conn:execute ("pragma wal_autocheckpoint"))
+	assert2 (1000, cur:fetch ())
+	cur:close ()
+	assert2 (true, conn:checkpointer ())
+	assert2 (true, conn:close ())
+	conn = CONN_OK (ENV:connect (":memory:"))
+	assert2 (nil, conn:checkpointer ())
+	assert2 (true, conn:close ())
+	os.remove (path)
+	os.remove (path.."-wal")
+	os.remove (path.."-shm")
+	io.write (" checkpointer")
+end
+
+table.insert (EXTENSIONS, checkpointer)
+
+table.insert (ENV_METHODS, "readpool")
+
+---------------------------------------------------------------------
+-- Read pool running queries on native threads.
+---------------------------------------------------------------------
+function readpool ()
+	local path = os.tmpname ()
+	local conn = CONN_OK (ENV:connect { sourcename = path, journal_mode = "wal" })
+	assert (conn:exec_script ([[
+		create table r (id integer, name text);
+		insert into r values (1, 'one');
+		insert into r values (2, 'two');
+		insert into r values (3, 'three');]]))
+	local pool = assert (ENV:readpool (path, 2))
+	local jobs = {}
+	for i = 1, 10 do
+		jobs[i] = pool:submit ("select id, name from r where id >= ? order by id", { i % 3 + 1 })
+	end
+	local named = pool:submit ("select name from r where id = :id", { id = 2 })
+	local bad = pool:submit ("select nope from r")
+	assert2 (true, named:wait ())
+	assert2 (true, named:done ())
+	local rows, names = named:result ("a")
+	assert2 (1, #rows)
+	assert2 ("two", rows[1].name)
+	assert2 ("name", names[1])
+	for i = 1, 10 do
+		rows = assert (jobs[i]:result ())
+		assert2 (3 - i % 3, #rows)
+		assert2 (i % 3 + 1, rows[1][1])
+	end
+	local _, err = bad:result ()
+	assert2 (true, string.find (err, "nope", 1, true) ~= nil)
+	assert2 (false, pcall (pool.submit, pool, "select ?", { {} }))
+	-- writers are not blocked by the readers
+	assert2 (1, conn:execute ("insert into r values (4, 'four')"))
+	rows = pool:submit ("select count(*) from r"):result ()
+	assert2 (4, rows[1][1])
+	assert2 (true, pool:close ())
+	assert2 (false, pool:close ())
+	assert2 (false, pcall (pool.submit, pool, "select 1"))
+	assert2 (true, conn:close ())
+	os.remove (path)
+	os.remove (path.."-wal")
+	os.remove (path.."-shm")
+	io.write (" readpool")
+end
+
+table.insert (EXTENSIONS, readpool)
+
+table.insert (CONN_METHODS, "flush")
+
+---------------------------------------------------------------------
+-- Group commit of autocommit writes.
+---------------------------------------------------------------------
+function groupcommit ()
+	local conn = CONN_OK (ENV:connect { sourcename = ":memory:",
+		groupcommit = { max_rows = 3, max_ms = 60000 } })
+	assert2 (0, conn:execute ("create table g (a integer)"))
+	local commits = conn:get ("groupcommit_commits")
+	for i = 1, 7 do
+		assert2 (1, conn:execute ("insert into g values ("..i..")"))
+	end
+	assert2 (commits + 2, conn:get ("groupcommit_commits"))
+	assert2 (3, conn:get ("groupcommit_last"))
+	assert2 (2, conn:get ("groupcommit_pending"))
+	-- a read commits the pending writes first
+	local cur = CUR_OK (conn:execute ("select count(*) from g"))
+	assert2 (7, cur:fetch ())
+	cur:close ()
+	assert2 (0, conn:get ("groupcommit_pending"))
+	assert2 (1, conn:execute ("insert into g values (8)"))
+	assert2 (true, conn:flush ())
+	assert2 (0, conn:get ("groupcommit_pending"))
+	assert2 (1, conn:execute ("insert into g values (9)"))
+	assert2 (true, conn:rollback ())
+	-- explicit transactions are left alone
+	assert2 (true, conn:setautocommit (false))
+	assert2 (1, conn:execute ("insert into g values (10)"))
+	assert2 (0, conn:get ("groupcommit_pending"))
+	assert2 (true, conn:rollback ())
+	assert2 (true, conn:setautocommit (true))
+	conn:set { groupcommit = false }
+	assert2 (1, conn:execute ("insert into g values (11)"))
+	assert2 (0, conn:get ("groupcommit_pending"))
+	cur = CUR_OK (conn:execute ("select count(*) from g"))
+	assert2 (9, cur:fetch ())
+	cur:close ()
+	-- an expired group is committed by the next call on the connection
+	conn:set { groupcommit = { max_rows = 10, max_ms = 20 } }
+	assert2 (1, conn:execute ("insert into g values (12)"))
+	local t = os.clock ()
+	while os.clock () - t < 0.05 do end
+	assert2 (0, conn:get ("groupcommit_pending"))
+	assert2 (1, conn:get ("groupcommit_last"))
+	-- a failed commit of the batched writes keeps the connection open
+	assert (conn:execute ("pragma foreign_keys = on"))
+	conn:set { groupcommit = { max_rows = 10 } }
+	assert (conn:execute ("create table p (a integer primary key)"))
+	assert (conn:execute ("create table h (a references p deferrable initially deferred)"))
+	assert2 (1, conn:execute ("insert into h values (1)"))
+	assert2 (nil, conn:close ())
+	assert2 (nil, conn:setautocommit (false))
+	assert2 (1, conn:execute ("insert into p values (1)"))
+	assert2 (true, conn:close ())
+	io.write (" groupcommit")
+end
+
+table.insert (EXTENSIONS, groupcommit)
+
+---------------------------------------------------------------------
+-- Memory controls and status counters.
+---------------------------------------------------------------------
+function memory ()
+	local conn = CONN_OK (ENV:connect { sourcename = ":memory:",
+		lookaside = { size = 512, count = 64 } })
+	assert2 (0, conn:execute ("create table m (a)"))
+	assert2 (1, conn:execute ("insert into m values (zeroblob(10000))"))
+	assert2 ("number", type (conn:get ("lookaside_used")))
+	assert2 ("number", type (conn:get ("cache_used")))
+	assert2 ("number", type (conn:get ("stmt_used")))
+	assert2 (true, ENV:get ("memory_used") > 0)
+	assert2 ("number", type (ENV:get ("pagecache_overflow")))
+	ENV:set { soft_heap_limit = 64 * 1024 * 1024 }
+	assert2 (64 * 1024 * 1024, ENV:get ("soft_heap_limit"))
+	ENV:set { soft_heap_limit = 0 }
+	assert2 (0, ENV:get ("soft_heap_limit"))
+	-- SQLite is already in use
+	local env, err = luasql.sqlite3 { pagecache = { count = 10 } }
+	assert2 (nil, env)
+	assert2 ("string", type (err))
+	assert2 (true, conn:close ())
+	io.write (" memory")
+end
+
+table.insert (EXTENSIONS, memory)
+
+table.insert (CONN_METHODS, "interrupt")
+
+---------------------------------------------------------------------
+-- Statement deadlines and interruption.
+---------------------------------------------------------------------
+function deadlines ()
+	local conn = CONN_OK (ENV:connect ":memory:")
+	local endless = "with recursive r(i) as (select 1 union all "..
+		"select i + 1 from r) select count(*) from r"
+	assert2 (0, conn:get ("timeout_ms"))
+	conn:set { timeout_ms = 50 }
+	assert2 (50, conn:get ("timeout_ms"))
+	local res, err = conn:execute (endless)
+	assert2 (nil, res)
+	assert (string.find (err, "timeout"), err)
+	-- the connection is still usable
+	local cur = CUR_OK (conn:execute ("select 1"))
+	assert2 (1, cur:fetch ())
+	cur:close ()
+	-- per-call override
+	conn:set { timeout_ms = 0 }
+	res, err = conn:execute (endless, 20)
+	assert2 (nil, res)
+	assert (string.find (err, "timeout"), err)
+	-- an open cursor fails once its deadline has passed
+	cur = CUR_OK (conn:execute ("select 1 union all select 2", 1))
+	local t = os.clock ()
+	while os.clock () - t < 0.01 do end
+	assert2 (1, cur:fetch ())
+	res, err = cur:fetch ()
+	assert2 (nil, res)
+	assert (string.find (err, "timeout"), err)
+	-- a SQL function interrupting the statement running it
+	assert2 (true, conn:createfunction ("stop", 0, function ()
+		conn:interrupt ()
+		return 0
+	end))
+	cur = CUR_OK (conn:execute ("with recursive r(i) as (select 1 "..
+		"union all select i + 1 from r) select stop () from r"))
+	assert2 (0, cur:fetch ())
+	res, err = cur:fetch ()
+	assert2 (nil, res)
+	assert (string.find (err, "interrupt"), err)
+	assert2 (true, conn:close ())
+	io.write (" deadlines")
+end
+
+table.insert (EXTENSIONS, deadlines)
+
+---------------------------------------------------------------------
+-- Result cache.
+---------------------------------------------------------------------
+function resultcache ()
+	local conn = CONN_OK (ENV:connect ":memory:")
+	assert2 (0, conn:execute ("create table a (k integer, v text)"))
+	assert2 (0, conn:execute ("create table b (k integer)"))
+	assert2 (0, conn:execute ("create table w (k primary key) without rowid"))
+	assert2 (0, conn:execute ("create table big (v)"))
+	assert2 (1, conn:execute ("insert into big values (zeroblob (4096))"))
+	assert2 (1, conn:execute ("insert into a values (1, 'one')"))
+	assert2 (1, conn:execute ("insert into b values (1)"))
+	conn:set { resultcache = 64 * 1024 }
+	assert2 (64 * 1024, conn:get ("resultcache"))
+	local function query (sql)
+		local cur = CUR_OK (conn:execute (sql))
+		local rows = {}
+		local row = cur:fetch ({}, "a")
+		while row do
+			table.insert (rows, row)
+			row = cur:fetch ({}, "a")
+		end
+		return rows
+	end
+	local sql = "select k, v from a order by k"
+	local rows = query (sql)
+	assert2 (1, conn:get ("resultcache_misses"))
+	assert2 (1, conn:get ("resultcache_entries"))
+	rows = query (sql)
+	assert2 (1, conn:get ("resultcache_hits"))
+	assert2 (1, #rows)
+	assert2 ("one", rows[1].v)
+	local cur = CUR_OK (conn:execute (sql))
+	assert2 ("k", cur:getcolnames ()[1])
+	assert2 ("text", string.lower (cur:getcoltypes ()[2]))
+	assert2 (1, cur:fetch ())
+	assert2 (nil, cur:fetch ())
+	-- writes invalidate the results read from the table only
+	assert2 (1, query ("select count(*) as n from b")[1].n)
+	assert2 (2, conn:get ("resultcache_entries"))
+	assert2 (1, conn:execute ("insert into a values (2, 'two')"))
+	assert2 (1, conn:get ("resultcache_entries"))
+	assert2 (2, #query (sql))
+	assert2 (1, query ("select count(*) as n from b")[1].n)
+	assert2 (3, conn:get ("resultcache_hits"))
+	-- prepared statements are keyed by their parameters; only the
+	-- results read to the end are kept
+	local stmt = assert (conn:prepare ("select v from a where k = ?"))
+	for _, k in ipairs { 1, 2, 1, 2 } do
+		cur = CUR_OK (stmt:execute (k))
+		assert2 (k == 1 and "one" or "two", cur:fetch ())
+		assert2 (nil, cur:fetch ())
+	end
+	cur = CUR_OK (stmt:execute (3))
+	assert2 (true, cur:close ())
+	assert2 (5, conn:get ("resultcache_hits"))
+	assert2 (true, stmt:close ())
+	-- writes the update hook does not see
+	assert2 (1, conn:execute ("insert into w values (1)"))
+	assert2 (1, #query ("select * from w"))
+	assert2 (1, conn:execute ("delete from w"))
+	assert2 (0, #query ("select * from w"))
+	assert2 (1, #query ("select * from b"))
+	assert2 (1, conn:execute ("delete from b"))
+	assert2 (0, #query ("select * from b"))
+	-- rolled back writes
+	assert2 (true, conn:setautocommit (false))
+	assert2 (1, conn:execute ("insert into b values (5)"))
+	assert2 (1, #query ("select * from b"))
+	assert2 (true, conn:rollback ())
+	assert2 (true, conn:setautocommit (true))
+	assert2 (0, #query ("select * from b"))
+	-- schema changes
+	assert2 (0, #query ("select * from b"))
+	conn:execute ("drop table b")
+	assert2 (nil, conn:execute ("select * from b"))
+	-- volatile functions are not cached
+	local hits = conn:get ("resultcache_hits")
+	query ("select random () from a")
+	query ("select random () from a")
+	assert2 (hits, conn:get ("resultcache_hits"))
+	-- the cache is bounded by its size
+	assert2 (true, conn:get ("resultcache_size") <= 64 * 1024)
+	conn:set { resultcache = 1024 }
+	assert2 (0, conn:get ("resultcache_entries"))
+	query ("select * from big")
+	assert2 (0, conn:get ("resultcache_entries"))
+	conn:set { resultcache = 0 }
+	assert2 (true, conn:close ())
+	-- writes of other connections
+	local file = CONN_OK (ENV:connect (datasource))
+	local other = CONN_OK (ENV:connect (datasource))
+	assert2 (0, file:execute ("create table rc (k integer)"))
+	file:set { resultcache = 64 * 1024 }
+	cur = CUR_OK (file:execute ("select count(*) from rc"))
+	assert2 (0, cur:fetch ())
+	assert2 (nil, cur:fetch ())
+	assert2 (1, file:get ("resultcache_entries"))
+	assert2 (1, other:execute ("insert into rc values (1)"))
+	cur = CUR_OK (file:execute ("select count(*) from rc"))
+	assert2 (1, cur:fetch ())
+	cur:close ()
+	assert2 (0, file:get ("resultcache_hits"))
+	assert (other:execute ("drop table rc"))
+	assert2 (true, other:close ())
+	assert2 (true, file:close ())
+	io.write (" resultcache")
+end
+
+table.insert (EXTENSIONS, resultcache)